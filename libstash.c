@@ -3,21 +3,40 @@
 // library interface to a stash service.   The default version uses ablocking 
 // socket calls.  All operations block until the operation is complete.
 
+// needed for ppoll()
+#define _GNU_SOURCE
+
 #include "stash.h"
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <rispbuf.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef STASH_IOURING
+#include <liburing.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef STASH_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#endif
+
 
-#if (LIBSTASH_VERSION != 0x00000700)
+#if (LIBSTASH_VERSION != 0x00000800)
 #error "Incorrect stash.h header version."
 #endif
 
@@ -35,7 +54,7 @@
 static stash_sortentry_t * __sortentry = NULL;
 
 
-typedef struct {
+typedef struct __conn_t {
 	int handle;		// socket handle to the connected controller.
 	char active;
 	char closing;
@@ -46,9 +65,63 @@ typedef struct {
 	int port;
 	
 	expbuf_t *inbuf, *outbuf, *readbuf;
+	
+	// the request id of the last request sent on this connection.  Used to 
+	// tell its reply apart from stale replies to hedged requests.
+	int lastused;
+	
+	// moving average of the time taken for a request (microseconds).  Used to 
+	// pick the fastest server for read-only requests.
+	int latency;
+	
+	// number of replies still to come on this connection for requests that 
+	// were hedged to another server, and answered there first.  They will be 
+	// discarded when they arrive.
+	int discard;
+	
+	// a multishot receive is armed on the socket (io_uring transport only).  
+	// Its completions carry the id rather than a pointer to the connection, 
+	// so that any that arrive after it has been cancelled can be ignored.
+	char ms_armed;
+	unsigned int ms_id;
+	
+	// number of times the connection has been opened, so that reconnects can 
+	// be counted.
+	int opened;
 } conn_t;
 
 
+#ifdef STASH_IOURING
+// size of each of the two registered buffers (send and receive).  Requests 
+// larger than this are sent directly from the request buffer.
+#define URING_BUFSIZE      (64*1024)
+#define URING_DEPTH        (16)
+
+// provided buffers used for multishot receives.
+#define URING_MS_BUFFERS   (16)
+#define URING_MS_BUFSIZE   (16*1024)
+#define URING_MS_GROUP     (1)
+
+#define URING_TAG_CANCEL     0
+#define URING_TAG_SEND       1
+#define URING_TAG_RECV       2
+#define URING_TAG_MULTISHOT  3
+
+typedef struct {
+	struct io_uring ring;
+	unsigned int seq;
+	
+	char *sendbuf;		// registered buffer 0
+	char *recvbuf;		// registered buffer 1
+	
+	// ring of provided buffers for multishot receives.  NULL if not supported.
+	struct io_uring_buf_ring *br;
+	char *ms_bufs;
+	unsigned int ms_seq;
+} uring_t;
+#endif
+
+
 
 
 
@@ -67,11 +140,26 @@ typedef struct {
 	stash_nameid_t nid;
 	list_t *attrlist;		// attr_t
 	stash_reply_t *reply;
-	short int done;
+	short int done;			// scratch marker (see reply_order)
 } replyrow_t;
 
 
 
+// where the first reply in a buffer ends (see reply_length).
+typedef struct {
+	const unsigned char *start;
+	risp_length_t length;
+} frame_t;
+
+static void cmdFrame(frame_t *frame, const risp_length_t length, const risp_data_t *data)
+{
+	assert(frame && frame->start && data);
+	if (frame->length == 0) {
+		frame->length = (data - frame->start) + length;
+	}
+}
+
+
 static void cmdReplyReqID(stash_reply_t *reply, risp_int_t value)
 {
 	assert(reply);
@@ -114,6 +202,33 @@ static void cmdReplyKeyID(stash_reply_t *reply, risp_int_t value)
 	reply->kid = value;
 }
 
+static void cmdReplyCreated(stash_reply_t *reply)
+{
+	assert(reply);
+	reply->created = 1;
+}
+
+static void cmdReplyVersion(stash_reply_t *reply, risp_int_t value)
+{
+	assert(reply);
+	reply->version = value;
+}
+
+static void cmdReplyNotModified(stash_reply_t *reply)
+{
+	assert(reply);
+	reply->not_modified = 1;
+}
+
+static void cmdReplyLockID(stash_reply_t *reply, risp_int_t value)
+{
+	assert(reply);
+	assert(value > 0);
+	
+	assert(reply->lockid == 0);
+	reply->lockid = value;
+}
+
 static void cmdReplyCount(stash_reply_t *reply, risp_int_t value)
 {
 	assert(reply && value >= 0);
@@ -123,6 +238,20 @@ static void cmdReplyCount(stash_reply_t *reply, risp_int_t value)
 }
 
 
+// the server had more rows than the limit.  The token is opaque, and is 
+// passed back with the query to get the next page.
+static void cmdReplyContinue(stash_reply_t *reply, const risp_length_t length, const risp_data_t *data)
+{
+	assert(reply && length > 0 && data);
+	
+	assert(reply->cont == NULL && reply->cont_len == 0);
+	reply->cont = malloc(length);
+	assert(reply->cont);
+	memcpy(reply->cont, data, length);
+	reply->cont_len = length;
+}
+
+
 static void cmdReplyRow(stash_reply_t *reply, const risp_length_t length, const risp_data_t *data)
 {
 	int cnt;
@@ -149,6 +278,7 @@ static void cmdReplyRow(stash_reply_t *reply, const risp_length_t length, const
 	// add the row to the reply list.
 	assert(reply->rows);
 	ll_push_tail(reply->rows, row);
+	reply->stash->stats.rows ++;
 	
 #ifndef NDEBUG
 	// check for any values we didn't handle.
@@ -214,6 +344,7 @@ static void cmdRowAttribute(replyrow_t *row, const risp_length_t length, const r
 	// add the row to the reply list.
 	assert(row->attrlist);
 	ll_push_tail(row->attrlist, attr);
+	row->reply->stash->stats.attributes ++;
 	
 	// check for any values we didn't handle.
 #ifndef NDEBUG
@@ -248,6 +379,121 @@ static void cmdAttrValue(attr_t *attr, const risp_length_t length, const risp_da
 
 
 
+#ifdef STASH_IOURING
+// setup the io_uring instance and its buffers.  Returns NULL if io_uring is 
+// not available, in which case the blocking socket calls will be used.
+static uring_t * uring_init(void)
+{
+	uring_t *ur;
+	struct iovec iov[2];
+	struct io_uring_probe *probe;
+	int ret, i, mask;
+	
+	ur = calloc(1, sizeof(*ur));
+	assert(ur);
+	
+	if (io_uring_queue_init(URING_DEPTH, &ur->ring, 0) < 0) {
+		free(ur);
+		return(NULL);
+	}
+	
+	// the two registered buffers.  Index 0 is for sending, index 1 is for receiving.
+	ur->sendbuf = malloc(URING_BUFSIZE);
+	ur->recvbuf = malloc(URING_BUFSIZE);
+	assert(ur->sendbuf && ur->recvbuf);
+	iov[0].iov_base = ur->sendbuf;
+	iov[0].iov_len = URING_BUFSIZE;
+	iov[1].iov_base = ur->recvbuf;
+	iov[1].iov_len = URING_BUFSIZE;
+	if (io_uring_register_buffers(&ur->ring, iov, 2) < 0) {
+		io_uring_queue_exit(&ur->ring);
+		free(ur->sendbuf);
+		free(ur->recvbuf);
+		free(ur);
+		return(NULL);
+	}
+	
+	// multishot receives need a ring of provided buffers.  If we cant get one, 
+	// then we just dont use multishot receives.
+	assert(ur->br == NULL);
+	probe = io_uring_get_probe_ring(&ur->ring);
+	if (probe) {
+		if (io_uring_opcode_supported(probe, IORING_OP_RECV)) {
+			ur->br = io_uring_setup_buf_ring(&ur->ring, URING_MS_BUFFERS, URING_MS_GROUP, 0, &ret);
+		}
+		io_uring_free_probe(probe);
+	}
+	if (ur->br) {
+		ur->ms_bufs = malloc(URING_MS_BUFFERS * URING_MS_BUFSIZE);
+		assert(ur->ms_bufs);
+		mask = io_uring_buf_ring_mask(URING_MS_BUFFERS);
+		for (i=0; i<URING_MS_BUFFERS; i++) {
+			io_uring_buf_ring_add(ur->br, ur->ms_bufs + (i * URING_MS_BUFSIZE), URING_MS_BUFSIZE, i, mask, i);
+		}
+		io_uring_buf_ring_advance(ur->br, URING_MS_BUFFERS);
+	}
+	
+	return(ur);
+}
+
+
+// stop using multishot receives, and release the provided buffers.  This is 
+// done when the kernel turns out to support provided buffer rings, but not 
+// multishot receives (they came later, in 6.0).
+static void uring_no_multishot(uring_t *ur)
+{
+	assert(ur);
+	
+	if (ur->br) {
+		io_uring_free_buf_ring(&ur->ring, ur->br, URING_MS_BUFFERS, URING_MS_GROUP);
+		ur->br = NULL;
+		assert(ur->ms_bufs);
+		free(ur->ms_bufs);
+		ur->ms_bufs = NULL;
+	}
+}
+
+
+static void uring_free(uring_t *ur)
+{
+	assert(ur);
+	
+	uring_no_multishot(ur);
+	assert(ur->br == NULL);
+	
+	io_uring_unregister_buffers(&ur->ring);
+	io_uring_queue_exit(&ur->ring);
+	
+	assert(ur->sendbuf && ur->recvbuf);
+	free(ur->sendbuf);
+	free(ur->recvbuf);
+	free(ur);
+}
+
+
+// cancel the multishot receive on a connection that is being closed.  The 
+// completions for it that are still to come will not match any connection, 
+// and will be ignored.
+static void uring_cancel(uring_t *ur, conn_t *conn)
+{
+	struct io_uring_sqe *sqe;
+	
+	assert(ur && conn);
+	assert(conn->handle >= 0);
+	
+	if (conn->ms_armed) {
+		sqe = io_uring_get_sqe(&ur->ring);
+		assert(sqe);
+		io_uring_prep_cancel_fd(sqe, conn->handle, IORING_ASYNC_CANCEL_ALL);
+		io_uring_sqe_set_data64(sqe, URING_TAG_CANCEL);
+		io_uring_submit(&ur->ring);
+		conn->ms_armed = 0;
+	}
+}
+#endif
+
+
+
 //-----------------------------------------------------------------------------
 // initialise the stash_t structure.  If a NULL is passed in, a new object is 
 // created for you, alternatively, you can pass in a pointer to an object you 
@@ -277,6 +523,11 @@ stash_t * stash_init(stash_t *stash)
 	risp_add_command(s->risp_reply, STASH_CMD_KEY_ID,       &cmdReplyKeyID);
 	risp_add_command(s->risp_reply, STASH_CMD_ROW,          &cmdReplyRow);
 	risp_add_command(s->risp_reply, STASH_CMD_COUNT,        &cmdReplyCount);
+	risp_add_command(s->risp_reply, STASH_CMD_CONTINUE,     &cmdReplyContinue);
+	risp_add_command(s->risp_reply, STASH_CMD_CREATED,      &cmdReplyCreated);
+	risp_add_command(s->risp_reply, STASH_CMD_LOCK_ID,      &cmdReplyLockID);
+	risp_add_command(s->risp_reply, STASH_CMD_VERSION,      &cmdReplyVersion);
+	risp_add_command(s->risp_reply, STASH_CMD_NOT_MODIFIED, &cmdReplyNotModified);
 	
 	s->risp_failed = risp_init(NULL);
 	assert(s->risp_failed);
@@ -293,6 +544,16 @@ stash_t * stash_init(stash_t *stash)
 	risp_add_command(s->risp_attr, STASH_CMD_KEY_ID,        &cmdAttrKeyID);
 	risp_add_command(s->risp_attr, STASH_CMD_VALUE,         &cmdAttrValue);
 	
+	// used to get the request id out of a reply without processing it.
+	s->risp_reqid = risp_init(NULL);
+	assert(s->risp_reqid);
+	
+	// used to find where the first reply in a buffer ends.
+	s->risp_frame = risp_init(NULL);
+	assert(s->risp_frame);
+	risp_add_command(s->risp_frame, STASH_CMD_REPLY,        &cmdFrame);
+	risp_add_command(s->risp_frame, STASH_CMD_FAILED,       &cmdFrame);
+	
 	
 	
 	// linked-list of our connections.  Only the one at the head is likely to be
@@ -333,6 +594,46 @@ stash_t * stash_init(stash_t *stash)
 	
 	s->curr_nsid = 0;
 	
+	// use io_uring for the transport if we can, otherwise fall back to the 
+	// blocking socket calls.
+	s->uring = NULL;
+#ifdef STASH_IOURING
+	s->uring = uring_init();
+#endif
+	
+	// everything goes to the preferred server unless stash_balance_reads() says otherwise.
+	s->balance_reads = 0;
+	
+	// hedged reads are off by default.
+	s->hedge_percentile = 0;
+	s->hedge_min = 0;
+	s->hedge_hist = NULL;
+	memset(&s->hedgestats, 0, sizeof(s->hedgestats));
+	
+	// low-latency mode is off by default.
+	s->spin_max = 0;
+	s->busy_poll = 0;
+	s->spin_start = 0;
+	s->spin_result = 0;
+	memset(&s->spinstats, 0, sizeof(s->spinstats));
+	
+	// not capturing traffic until stash_capture() is called.
+	s->capture = NULL;
+	s->capture_start = 0;
+	
+	memset(&s->stats, 0, sizeof(s->stats));
+	
+	s->profiling = 0;
+	s->first_byte = 0;
+	
+	s->trace_fn = NULL;
+	s->trace_arg = NULL;
+	memset(&s->trace_req, 0, sizeof(s->trace_req));
+	
+	s->slow_usec = 0;
+	s->slow_path = NULL;
+	s->slow_max = 0;
+	
 	return(s);
 }
 
@@ -342,14 +643,24 @@ static void reply_free(stash_reply_t *reply)
 {
 	assert(reply->rows);
 	assert(ll_count(reply->rows) == 0);
+	assert(reply->cont == NULL);
 	reply->rows = ll_free(reply->rows);
 	assert(reply->rows == NULL);
 
 	free(reply);
 }
 
+// free the connection object and everything it holds.  Any sockets still 
+// open are closed.
 static void conn_free(conn_t *conn)
 {
+	assert(conn);
+	
+	if (conn->handle >= 0) {
+		close(conn->handle);
+		conn->handle = -1;
+	}
+	
 	assert(conn->host);
 	free(conn->host);
 	
@@ -421,6 +732,10 @@ void stash_free(stash_t *stash)
 	stash->connlist = ll_free(stash->connlist);
 	assert(stash->connlist == NULL);
 	
+	// the cached replies go back to the pool.
+	stash_cache(stash, 0, 0);
+	assert(stash->cache == NULL);
+	
 	assert(stash->replypool);
 	while ((reply = ll_pop_head(stash->replypool)))
 	{
@@ -449,10 +764,38 @@ void stash_free(stash_t *stash)
 	assert(stash->risp_attr);
 	risp_shutdown(stash->risp_attr);
 	stash->risp_attr = NULL;
+	
+	assert(stash->risp_reqid);
+	risp_shutdown(stash->risp_reqid);
+	stash->risp_reqid = NULL;
+	
+	assert(stash->risp_frame);
+	risp_shutdown(stash->risp_frame);
+	stash->risp_frame = NULL;
+	
+	if (stash->hedge_hist) {
+		free(stash->hedge_hist);
+		stash->hedge_hist = NULL;
+	}
 
 	if (stash->username) { free(stash->username); stash->username = NULL; }
 	if (stash->password) { free(stash->password); stash->password = NULL; }
 	
+	if (stash->capture) {
+		stash_capture(stash, NULL);
+		assert(stash->capture == NULL);
+	}
+	
+	if (stash->slow_path) { free(stash->slow_path); stash->slow_path = NULL; }
+	
+#ifdef STASH_IOURING
+	if (stash->uring) {
+		uring_free(stash->uring);
+		stash->uring = NULL;
+	}
+#endif
+	assert(stash->uring == NULL);
+	
 	if (stash->internally_created > 0) {
 		free(stash);
 	}
@@ -475,16 +818,10 @@ stash_result_t stash_authority(stash_t *stash, const char *username, const char
 }
 
 
-// add a server to the list.
-stash_result_t stash_addserver(stash_t *stash, const char *host, int priority)
+// create a new (unconnected) connection object.
+static conn_t * conn_new(void)
 {
 	conn_t *conn;
-	char *copy;
-	char *first;
-	char *next;
-	
-	assert(stash);
-	assert(host);
 	
 	conn = calloc(1, sizeof(conn_t));
 	assert(conn);
@@ -499,6 +836,31 @@ stash_result_t stash_addserver(stash_t *stash, const char *host, int priority)
 	conn->outbuf = expbuf_init(NULL, 0);
 	conn->readbuf = expbuf_init(NULL, 0);
 	
+	conn->lastused = 0;
+	conn->latency = 0;
+	conn->discard = 0;
+	conn->ms_armed = 0;
+	conn->ms_id = 0;
+	conn->opened = 0;
+	
+	return(conn);
+}
+
+
+// add a server to the list.
+stash_result_t stash_addserver(stash_t *stash, const char *host, int priority)
+{
+	conn_t *conn;
+	char *copy;
+	char *first;
+	char *next;
+	
+	assert(stash);
+	assert(host);
+	
+	conn = conn_new();
+	assert(conn);
+	
 	// parse the host string, to remove the port part.
 	copy = strdup(host);
 	assert(copy);
@@ -585,6 +947,14 @@ void stash_connstr(stash_t *stash, const char *connstr)
 
 
 
+// return the transport that was selected when the stash object was initialised.
+int stash_transport(stash_t *stash)
+{
+	assert(stash);
+	return(stash->uring ? STASH_TRANSPORT_IOURING : STASH_TRANSPORT_SOCKET);
+}
+
+
 const char * stash_err_text(stash_result_t res)
 {
 	const char *text = NULL;
@@ -616,6 +986,18 @@ const char * stash_err_text(stash_result_t res)
 			text = "Table name already exists";
 			break;
 			
+		case STASH_ERR_VALUEMISMATCH:
+			text = "Value did not match the expected value";
+			break;
+			
+		case STASH_ERR_LOCKED:
+			text = "Row is locked";
+			break;
+			
+		case STASH_ERR_LOCKNOTHELD:
+			text = "Locks are not held";
+			break;
+			
 		default:
 			text = "Unknown error code";
 			break;
@@ -665,11 +1047,27 @@ int sock_connect(char *szHost, int nPort)
 {
 	int nSocket = -1;
 	struct sockaddr_in sin;
+	struct sockaddr_un sun;
 	
 	assert(szHost != NULL);
 	assert(nPort > 0);
 	
-	if (sock_resolve(szHost,nPort,&sin) >= 0) {
+	if (szHost[0] == '/') {
+		// a path, so connect to a unix socket (the port is not used).
+		if (strlen(szHost) < sizeof(sun.sun_path)) {
+			memset(&sun, 0, sizeof(sun));
+			sun.sun_family = AF_UNIX;
+			strcpy(sun.sun_path, szHost);
+			nSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (nSocket >= 0) {
+				if (connect(nSocket, (struct sockaddr*)&sun, sizeof(sun)) < 0) {
+					close(nSocket);
+					nSocket = -1;
+				}
+			}
+		}
+	}
+	else if (sock_resolve(szHost,nPort,&sin) >= 0) {
 		// CJW: Create the socket
 		nSocket = socket(AF_INET,SOCK_STREAM,0);
 		if (nSocket >= 0) {
@@ -704,6 +1102,22 @@ static void reply_clear(stash_reply_t *reply)
 	reply->kid = 0;
 	reply->row_count = 0;
 	reply->curr_row = -1;
+	reply->aggregate = 0;
+	reply->created = 0;
+	reply->lockid = 0;
+	reply->cached = 0;
+	reply->refs = 0;
+	reply->shared = NULL;
+	reply->version = 0;
+	reply->not_modified = 0;
+	memset(&reply->profile, 0, sizeof(reply->profile));
+	
+	if (reply->cont) {
+		assert(reply->cont_len > 0);
+		free(reply->cont);
+		reply->cont = NULL;
+		reply->cont_len = 0;
+	}
 	
 	assert(reply->rows);
 	assert(ll_count(reply->rows) == 0);
@@ -794,146 +1208,2015 @@ static stash_reply_t * parsereply(stash_t *stash, risp_t *risp)
 
 
 //-----------------------------------------------------------------------------
-// TODO: This function needs a lot of work.   It should be worked a little bit 
-//       better.   Not sure exactly of the best way, just know that what we 
-//       have already doesn't look very good.
-static stash_reply_t * send_request(stash_t *stash, risp_command_t cmd, expbuf_t *data)
+// Low-latency receive mode.
+//
+// Instead of blocking in recv() and waiting for the kernel to wake us up, we 
+// poll the socket for a short window first.  The window adapts to how long 
+// we are actually waiting for data.  It is twice the average wait, so if 
+// replies normally arrive quickly we spin only for as long as we need to, and 
+// if the average wait is longer than the maximum window, we dont spin at all 
+// (but keep measuring, so that spinning resumes when the server speeds up).
+
+#define SPIN_MIN_WINDOW  (5)
+
+#define SPIN_HIT      1
+#define SPIN_MISS     2
+#define SPIN_SKIPPED  3
+
+static long long now_usec(void)
 {
-	stash_reply_t *reply = NULL;
-	conn_t *conn;
-	ssize_t sent;
-	risp_t *risp;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(((long long)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
+
+static long long now_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(((long long)ts.tv_sec * 1000000000) + ts.tv_nsec);
+}
+
+
+static void sock_busy_poll(int handle, int busy_poll)
+{
+	assert(handle >= 0);
+	assert(busy_poll >= 0);
+#ifdef SO_BUSY_POLL
+	if (busy_poll > 0) {
+		setsockopt(handle, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll));
+	}
+#endif
+}
+
+
+// open the connection to its server, and count the attempt.  Returns the 
+// handle, or -1 if it could not connect.
+static int conn_open(stash_t *stash, conn_t *conn)
+{
+	assert(stash && conn);
+	assert(conn->handle < 0);
+	assert(conn->host && conn->port > 0);
 	
-	assert(stash && cmd > 0 && data);
-	assert(stash->next_reqid > 0);
+	conn->handle = sock_connect(conn->host, conn->port);
+	if (conn->handle < 0) {
+		stash->stats.connect_failures ++;
+	}
+	else {
+		sock_busy_poll(conn->handle, stash->busy_poll);
+		stash->stats.connects ++;
+		if (conn->opened > 0) { stash->stats.reconnects ++; }
+		conn->opened ++;
+	}
+	
+	return(conn->handle);
+}
 
-	assert(stash->buf_payload);
-	assert(BUF_LENGTH(stash->buf_payload) == 0);
+
+// mark the start of a wait, and return the window we should spin for (0 if we shouldn't spin).
+static int spin_start(stash_t *stash)
+{
+	assert(stash && stash->spin_max > 0);
+	stash->spin_start = now_usec();
+	return(stash->spinstats.window);
+}
+
+static int spin_expired(stash_t *stash, int window)
+{
+	assert(stash && window > 0);
+	return((now_usec() - stash->spin_start) >= window);
+}
+
+// the wait for the start of a reply has finished, so count how the last wait 
+// ended, and update the adaptive window.  This is done once per reply, however 
+// many reads the reply takes.  'arrived' is 0 if the connection was lost 
+// instead, which is counted but says nothing about how long replies take.
+static void spin_done(stash_t *stash, int arrived)
+{
+	int waited;
+	int result;
+	stash_spinstats_t *stats;
 	
-	assert(stash->buf_request);
-	assert(BUF_LENGTH(stash->buf_request) == 0);
+	assert(stash && stash->spin_max > 0);
+	stats = &stash->spinstats;
 	
-	// build the operation that will contain the data, based on the command range.
-	rispbuf_addInt(stash->buf_payload, STASH_CMD_REQUEST_ID, stash->next_reqid);
-	rispbuf_addBuffer(stash->buf_payload, cmd, data);
-	rispbuf_addBuffer(stash->buf_request, STASH_CMD_REQUEST, stash->buf_payload);
+	// nothing to count if we didn't have to wait.
+	result = stash->spin_result;
+	stash->spin_result = 0;
+	if (result == 0) { return; }
 	
-	stash->next_reqid++;
-	assert(stash->next_reqid > 0);
+	if (result == SPIN_HIT)       { stats->spin_hits ++; }
+	else if (result == SPIN_MISS) { stats->spin_misses ++; }
+	else                          { assert(result == SPIN_SKIPPED); stats->spin_skipped ++; }
 	
-	// clear the buffer we dont need anymore.
-	expbuf_clear(stash->buf_payload);
+	if (arrived == 0) { return; }
 	
-	// ensure we are connected.
-	assert(stash->connlist);
-	conn = ll_get_head(stash->connlist);
-	assert(conn);
-	if (conn->active == 0) {
-		// we dont have an active connection... we need to try and make one.
-		assert(0);
-	}
-	assert(conn->closing == 0);
-	assert(conn->shutdown == 0);
-	assert(conn->handle > 0);
+	waited = now_usec() - stash->spin_start;
+	assert(waited >= 0);
+	stats->avg_wait += (waited - stats->avg_wait) / 8;
 	
-	// send the data
-	reply = NULL;
-	while (BUF_LENGTH(stash->buf_request) > 0) {
-		sent = send(conn->handle, BUF_DATA(stash->buf_request), BUF_LENGTH(stash->buf_request), 0);
-		assert(sent != 0);
-		assert(sent <= BUF_LENGTH(stash->buf_request));
-		if (sent < 0) {
-			// connection to the server has closed....
-			expbuf_clear(stash->buf_request);
-			
-			conn->handle = -1;
-			conn->active = 0;
-			ll_move_tail(stash->connlist, conn);
-		}
-		else {
-			expbuf_purge(stash->buf_request, sent);
+	stats->window = stats->avg_wait * 2;
+	if (stats->window > stash->spin_max) { stats->window = 0; }
+	else if (stats->window < SPIN_MIN_WINDOW) { stats->window = SPIN_MIN_WINDOW; }
+}
+
+
+void stash_lowlatency(stash_t *stash, int max_spin, int busy_poll)
+{
+	conn_t *conn;
+	
+	assert(stash);
+	assert(max_spin >= 0 && busy_poll >= 0);
+	
+	stash->spin_max = max_spin;
+	stash->busy_poll = busy_poll;
+	
+	// start out optimistic, with the full window.
+	stash->spinstats.window = max_spin;
+	stash->spinstats.avg_wait = max_spin / 2;
+	
+	// apply the busy-poll setting to any connections we already have.
+	assert(stash->connlist);
+	ll_start(stash->connlist);
+	while ((conn = ll_next(stash->connlist))) {
+		if (conn->active && conn->handle >= 0) {
+			sock_busy_poll(conn->handle, busy_poll);
 		}
 	}
-	
-	// now that we have sent everything (or tried to), we can clear the request buffer.
-	expbuf_clear(stash->buf_request);
+	ll_finish(stash->connlist);
+}
 
-	if (conn->active == 0) {
-		// we lost connection.  make sure we will return a NULL.
-		assert(reply == NULL);
+
+void stash_get_spinstats(stash_t *stash, stash_spinstats_t *stats)
+{
+	assert(stash && stats);
+	memcpy(stats, &stash->spinstats, sizeof(*stats));
+}
+
+
+// receive whatever data is available on the socket.  In low-latency mode, we 
+// spin for a while before blocking, and note how the wait ended (see spin_done).
+static ssize_t sock_recv(stash_t *stash, conn_t *conn, char *ptr, int avail)
+{
+	ssize_t got;
+	int window;
+	
+	assert(stash && conn && ptr && avail > 0);
+	
+	if (stash->spin_max <= 0) {
+		got = recv(conn->handle, ptr, avail, 0);
 	}
 	else {
-		
-		int done;
-		int avail;
-		risp_length_t processed;
-		
-		risp = risp_init(NULL);
-	
-		// read data from the socket
-		// while not everything has been received (because we cant process it with risp), read more data.
-		assert(stash->readbuf);
-		assert(BUF_MAX(stash->readbuf) > 0);
-		assert(BUF_LENGTH(stash->readbuf) == 0);
-		done = 0;
-		while (done == 0) {
-			
-			avail = BUF_MAX(stash->readbuf) - BUF_LENGTH(stash->readbuf);
-			assert(avail > 0);
-			sent = recv(conn->handle, BUF_DATA(stash->readbuf)+BUF_LENGTH(stash->readbuf), avail, 0);
-			if (sent <= 0) {
-				// socket has shutdown
-				assert(0);
-			}
-			else {
-				assert(sent <= avail);
-				BUF_LENGTH(stash->readbuf) += sent;
-				
-				// now that we have more data, attempt to parse it into risp.  
-				// If it succeeds, then we have all we need to get.
-				processed = risp_process(risp, NULL, BUF_LENGTH(stash->readbuf), BUF_DATA(stash->readbuf));
-				if (processed > 0) {
-					assert(processed == BUF_LENGTH(stash->readbuf));
-					done = 1;
-				}
-				else {
-					assert(processed == 0);
-					assert(done == 0);
-					
-					// if we dont have more room in the buffer, then increase its size by 1k.
-					if ((BUF_MAX(stash->readbuf) - BUF_LENGTH(stash->readbuf)) < 1024) {
-						expbuf_shrink(stash->readbuf, 1024);
-					}
+		window = spin_start(stash);
+		if (window > 0) {
+			do {
+				got = recv(conn->handle, ptr, avail, MSG_DONTWAIT);
+				if (got >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+					// the connection closing is not a hit.
+					stash->spin_result = (got > 0) ? SPIN_HIT : SPIN_MISS;
+					return(got);
 				}
-			}
+			} while (spin_expired(stash, window) == 0);
 		}
 		
-		expbuf_clear(stash->readbuf);
-		
-		if (processed <= 0) {
-			// failed to receive reply.
-			assert(reply == NULL);
-		}
+		got = recv(conn->handle, ptr, avail, 0);
+		stash->spin_result = (window > 0) ? SPIN_MISS : SPIN_SKIPPED;
+	}
+	
+	return(got);
+}
+
+
+//-----------------------------------------------------------------------------
+// the connection has been lost (or closed by the other side).  Mark it as 
+// inactive and move it to the bottom of the list so that another one will be 
+// tried next.
+static void conn_lost(stash_t *stash, conn_t *conn)
+{
+	assert(stash && conn);
+	assert(stash->connlist);
+	
+	stash->stats.disconnects ++;
+	
+	if (conn->handle >= 0) {
+#ifdef STASH_IOURING
+		if (stash->uring) {
+			uring_cancel(stash->uring, conn);
+		}
+#endif
+		close(conn->handle);
+	}
+	
+	conn->handle = -1;
+	conn->active = 0;
+	conn->discard = 0;
+	expbuf_clear(conn->readbuf);
+	
+	ll_move_tail(stash->connlist, conn);
+}
+
+
+// read-only requests can go to any server when read balancing is on.
+static int cmd_readonly(risp_command_t cmd)
+{
+	return(cmd == STASH_CMD_QUERY || cmd == STASH_CMD_GETID);
+}
+
+
+// each time a read is balanced, the servers that were not picked close this 
+// fraction of the gap between their latency and the one that was.
+#define BALANCE_DRIFT  (32)
+
+// the load on a server is its average latency.  A handle only sends one 
+// request at a time, so the only requests that can still be waiting on a 
+// server are hedged ones that it lost.  Their replies have to be read (and 
+// discarded) before the next one, so the latency is scaled by them.
+static long conn_load(conn_t *conn)
+{
+	assert(conn);
+	assert(conn->latency >= 0 && conn->discard >= 0);
+	return((long)(conn->latency + 1) * (conn->discard + 1));
+}
+
+
+// pick the connection to send the next request on.  Writes always go to the 
+// connection at the head of the list (the preferred server).  If read 
+// balancing is on, read-only requests go to the connected server with the 
+// lowest load (see conn_load).
+static conn_t * conn_select(stash_t *stash, risp_command_t cmd)
+{
+	conn_t *conn, *best;
+	
+	assert(stash);
+	assert(stash->connlist);
+	conn = ll_get_head(stash->connlist);
+	assert(conn);
+	if (conn->active == 0) {
+		// we dont have an active connection... we need to try and make one.
+		assert(0);
+	}
+	
+	best = conn;
+	if (stash->balance_reads && cmd_readonly(cmd)) {
+		ll_start(stash->connlist);
+		while ((conn = ll_next(stash->connlist))) {
+			if (conn->active && conn_load(conn) < conn_load(best)) {
+				best = conn;
+			}
+		}
+		ll_finish(stash->connlist);
+		
+		// the latency of a server is only measured when it is used, so a server 
+		// that was slow for a while would never be tried again.  The servers that 
+		// were not picked drift towards the one that was, so that they get an 
+		// occasional request, and their latency is measured again.
+		ll_start(stash->connlist);
+		while ((conn = ll_next(stash->connlist))) {
+			if (conn != best && conn->active && conn->latency > best->latency) {
+				conn->latency -= (conn->latency - best->latency + BALANCE_DRIFT - 1) / BALANCE_DRIFT;
+			}
+		}
+		ll_finish(stash->connlist);
+	}
+	
+	return(best);
+}
+
+
+// a request has completed on the server.  Update its moving average latency.
+static void server_done(conn_t *server, long long elapsed)
+{
+	assert(server);
+	assert(elapsed >= 0);
+	
+	if (server->latency == 0) { server->latency = elapsed; }
+	else { server->latency += (elapsed - server->latency) / 8; }
+}
+
+
+//-----------------------------------------------------------------------------
+// Latency histogram.  Values below 8 microseconds get a bucket each, above that 
+// there are 4 buckets for each power of two, so the error is under 25%.  When 
+// the histogram gets full, all the counts are halved so that it follows 
+// changes in latency.
+
+#define HIST_BUCKETS  (STASH_HIST_BUCKETS)
+#define HIST_DECAY    (4096)
+
+typedef struct {
+	unsigned int counts[HIST_BUCKETS];
+	unsigned int total;
+} lathist_t;
+
+
+static int hist_bucket(long long usec)
+{
+	int msb;
+	int idx;
+	
+	if (usec < 8) { return(usec < 0 ? 0 : usec); }
+	
+	msb = 63 - __builtin_clzll(usec);
+	assert(msb >= 3);
+	idx = 8 + ((msb - 3) * 4) + ((usec >> (msb - 2)) & 3);
+	return(idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1);
+}
+
+// the highest value that would go in the bucket.
+static long long hist_value(int idx)
+{
+	int msb, sub;
+	
+	assert(idx >= 0 && idx < HIST_BUCKETS);
+	if (idx < 8) { return(idx); }
+	
+	msb = ((idx - 8) / 4) + 3;
+	sub = (idx - 8) % 4;
+	return((((long long)(5 + sub)) << (msb - 2)) - 1);
+}
+
+static void hist_record(lathist_t *hist, long long usec)
+{
+	int i;
+	
+	assert(hist);
+	
+	hist->counts[hist_bucket(usec)] ++;
+	hist->total ++;
+	
+	if (hist->total >= HIST_DECAY) {
+		hist->total = 0;
+		for (i=0; i<HIST_BUCKETS; i++) {
+			hist->counts[i] /= 2;
+			hist->total += hist->counts[i];
+		}
+	}
+}
+
+// return the value at the percentile (0 to 100).
+static long long hist_percentile(lathist_t *hist, int percentile)
+{
+	unsigned int target, count;
+	int i;
+	
+	assert(hist);
+	assert(percentile >= 0 && percentile <= 100);
+	
+	target = ((unsigned long long) hist->total * percentile) / 100;
+	count = 0;
+	for (i=0; i<HIST_BUCKETS; i++) {
+		count += hist->counts[i];
+		if (count >= target && count > 0) {
+			return(hist_value(i));
+		}
+	}
+	
+	return(0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Client statistics.  The counters are only ever incremented on the request 
+// path, so keeping them costs very little.  The histograms use the same 
+// buckets as the latency histogram above, but are never decayed.
+
+static void stats_hist_record(stash_hist_t *hist, long long value)
+{
+	assert(hist);
+	hist->counts[hist_bucket(value)] ++;
+	hist->total ++;
+}
+
+// return the value at the percentile (0 to 100, eg 99.9).
+long long stash_hist_percentile(const stash_hist_t *hist, double percentile)
+{
+	unsigned long long target, count;
+	int i;
+	
+	assert(hist);
+	assert(percentile >= 0 && percentile <= 100);
+	
+	target = (unsigned long long) ((hist->total * percentile) / 100);
+	count = 0;
+	for (i=0; i<STASH_HIST_BUCKETS; i++) {
+		count += hist->counts[i];
+		if (count >= target && count > 0) {
+			return(hist_value(i));
+		}
+	}
+	
+	return(0);
+}
+
+void stash_get_stats(stash_t *stash, stash_stats_t *stats)
+{
+	assert(stash && stats);
+	memcpy(stats, &stash->stats, sizeof(*stats));
+}
+
+void stash_reset_stats(stash_t *stash)
+{
+	assert(stash);
+	memset(&stash->stats, 0, sizeof(stash->stats));
+}
+
+
+//-----------------------------------------------------------------------------
+// Request tracing.  A callback can be registered to be told about each stage 
+// of every request, so that libstash activity can be matched up with the 
+// application's own tracing.  When built with STASH_USDT, the same points are 
+// also static tracepoints (provider 'libstash') for perf and bpftrace.  When 
+// neither is used, each stage costs a single test.
+
+#ifdef STASH_USDT
+// perf and bpftrace raise a probe's semaphore while they are attached to it, 
+// so the events are only filled in when something is listening.
+#define USDT_SEMAPHORE(name)  __extension__ unsigned short libstash_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+USDT_SEMAPHORE(request_build);
+USDT_SEMAPHORE(send_start);
+USDT_SEMAPHORE(send_end);
+USDT_SEMAPHORE(first_byte);
+USDT_SEMAPHORE(parse_end);
+#define USDT_ENABLED()  (libstash_request_build_semaphore || libstash_send_start_semaphore || \
+	libstash_send_end_semaphore || libstash_first_byte_semaphore || libstash_parse_end_semaphore)
+#define TRACING(s)  ((s)->trace_fn != NULL || __builtin_expect(USDT_ENABLED(), 0))
+#else
+#define TRACING(s)  ((s)->trace_fn != NULL)
+#endif
+
+void stash_trace(stash_t *stash, stash_trace_fn fn, void *arg)
+{
+	assert(stash);
+	stash->trace_fn = fn;
+	stash->trace_arg = fn ? arg : NULL;
+}
+
+static void trace_event(stash_t *stash, int event)
+{
+	stash_trace_t *req;
+	
+	assert(stash);
+	assert(event >= STASH_TRACE_BUILD && event <= STASH_TRACE_PARSE_END);
+	
+	req = &stash->trace_req;
+	req->event = event;
+	req->time = now_nsec();
+	
+#ifdef STASH_USDT
+	switch (event) {
+		case STASH_TRACE_BUILD:      DTRACE_PROBE3(libstash, request_build, req->reqid, req->cmd, req->request_bytes); break;
+		case STASH_TRACE_SEND_START: DTRACE_PROBE2(libstash, send_start, req->reqid, req->cmd);                       break;
+		case STASH_TRACE_SEND_END:   DTRACE_PROBE2(libstash, send_end, req->reqid, req->cmd);                         break;
+		case STASH_TRACE_FIRST_BYTE: DTRACE_PROBE2(libstash, first_byte, req->reqid, req->cmd);                       break;
+		case STASH_TRACE_PARSE_END:  
+			DTRACE_PROBE5(libstash, parse_end, req->reqid, req->cmd, req->reply_bytes, req->rows, req->resultcode);
+			break;
+	}
+#endif
+	
+	if (stash->trace_fn) {
+		(*stash->trace_fn)(req, stash->trace_arg);
+	}
+}
+
+
+// the phases of a request are timed for the profile and the slow request log.
+#define TIMING(s)  ((s)->profiling || (s)->slow_usec > 0)
+
+
+// when profiling is on, every reply has the time spent in each phase of its 
+// request in reply->profile.  It costs a few clock reads per request.
+void stash_profile(stash_t *stash, int enable)
+{
+	assert(stash);
+	assert(enable == 0 || enable == 1);
+	stash->profiling = enable;
+}
+
+
+// send the contents of the request buffer over the connection, blocking until 
+// it has all been sent.  If the connection is lost, the connection will be 
+// marked as inactive.
+//
+// The request buffer is left intact, so that a hedged request can be sent to 
+// another server too.
+static void sock_send_request(stash_t *stash, conn_t *conn)
+{
+	ssize_t sent;
+	int offset = 0;
+	
+	assert(stash && conn);
+	assert(stash->buf_request);
+	
+	while (conn->active && offset < BUF_LENGTH(stash->buf_request)) {
+		sent = send(conn->handle, BUF_DATA(stash->buf_request) + offset, BUF_LENGTH(stash->buf_request) - offset, 0);
+		assert(sent != 0);
+		assert(sent <= BUF_LENGTH(stash->buf_request) - offset);
+		if (sent < 0) {
+			// connection to the server has closed....
+			conn_lost(stash, conn);
+		}
+		else {
+			offset += sent;
+		}
+	}
+}
+
+
+// return the length of the first complete reply in the buffer, or 0 if it is 
+// not complete yet.  risp does the work, the handler just notes where the 
+// first reply ends.
+static risp_length_t reply_length(stash_t *stash, const unsigned char *data, risp_length_t length)
+{
+	frame_t frame;
+	
+	assert(stash && data);
+	assert(stash->risp_frame);
+	
+	if (length == 0) { return(0); }
+	
+	frame.start = data;
+	frame.length = 0;
+	risp_process(stash->risp_frame, &frame, length, data);
+	
+	assert(frame.length <= length);
+	return(frame.length);
+}
+
+
+// get the request id out of a complete reply message.
+static int reply_reqid(stash_t *stash, const unsigned char *data, risp_length_t length)
+{
+	risp_t *rr;
+	risp_length_t processed;
+	int reqid = 0;
+	
+	assert(stash && data && length > 0);
+	assert(stash->risp_reqid);
+	
+	rr = stash->risp_reqid;
+	risp_clear_all(rr);
+	processed = risp_process(rr, NULL, length, data);
+	assert(processed == length);
+	
+	if (risp_isset(rr, STASH_CMD_REPLY) || risp_isset(rr, STASH_CMD_FAILED)) {
+		risp_command_t cmd = risp_isset(rr, STASH_CMD_REPLY) ? STASH_CMD_REPLY : STASH_CMD_FAILED;
+		length = risp_getlength(rr, cmd);
+		data = risp_getdata(rr, cmd);
+		if (length > 0) {
+			risp_clear_all(rr);
+			processed = risp_process(rr, NULL, length, data);
+			assert(processed == length);
+			if (risp_isset(rr, STASH_CMD_REQUEST_ID)) {
+				reqid = risp_getvalue(rr, STASH_CMD_REQUEST_ID);
+			}
+		}
+	}
+	
+	return(reqid);
+}
+
+
+// remove any stale replies (for requests that were hedged to another server) 
+// from the front of the buffer.  Returns non-zero if there are still stale 
+// replies to come, so the buffer cant be processed yet.
+static int discard_stale(stash_t *stash, conn_t *conn, expbuf_t *buf)
+{
+	risp_length_t length;
+	
+	assert(stash && conn && buf);
+	
+	while (conn->discard > 0 && (length = reply_length(stash, (unsigned char *) BUF_DATA(buf), BUF_LENGTH(buf))) > 0) {
+		if (reply_reqid(stash, (unsigned char *) BUF_DATA(buf), length) == conn->lastused) {
+			// this is the one we want, so there must not be any more stale ones.
+			conn->discard = 0;
+		}
+		else {
+			expbuf_purge(buf, length);
+			conn->discard --;
+		}
+	}
+	
+	return(conn->discard);
+}
+
+
+// attempt to process the data in the read buffer.  Returns the number of bytes 
+// processed, which will be 0 if we dont have a complete reply yet.
+static risp_length_t sock_process(stash_t *stash, conn_t *conn, risp_t *risp)
+{
+	risp_length_t processed = 0;
+	
+	assert(stash && conn && risp);
+	
+	if (discard_stale(stash, conn, stash->readbuf) == 0 && BUF_LENGTH(stash->readbuf) > 0) {
+		// If it succeeds, then we have all we need to get.
+		processed = risp_process(risp, NULL, BUF_LENGTH(stash->readbuf), BUF_DATA(stash->readbuf));
+		if (processed > 0) {
+			assert(processed == BUF_LENGTH(stash->readbuf));
+		}
+	}
+	
+	return(processed);
+}
+
+
+// read data from the socket until a complete reply has been received (which 
+// is when risp is able to process it).  Returns the number of bytes processed.
+static risp_length_t sock_recv_reply(stash_t *stash, conn_t *conn, risp_t *risp)
+{
+	ssize_t sent;
+	int avail;
+	int first = 0;
+	risp_length_t processed = 0;
+	
+	assert(stash && conn && risp);
+	
+	// while not everything has been received (because we cant process it with risp), read more data.
+	assert(stash->readbuf);
+	assert(BUF_MAX(stash->readbuf) > 0);
+	assert(BUF_LENGTH(stash->readbuf) == 0);
+	
+	// anything left over from a hedged request will be in the connection's buffer.
+	if (BUF_LENGTH(conn->readbuf) > 0) {
+		first = 1;
+		if (TIMING(stash)) { stash->first_byte = now_nsec(); }
+		if (TRACING(stash)) { trace_event(stash, STASH_TRACE_FIRST_BYTE); }
+		expbuf_add(stash->readbuf, BUF_DATA(conn->readbuf), BUF_LENGTH(conn->readbuf));
+		expbuf_clear(conn->readbuf);
+		processed = sock_process(stash, conn, risp);
+	}
+	
+	while (processed == 0) {
+		
+		// if we dont have more room in the buffer, then increase its size by 1k.
+		if ((BUF_MAX(stash->readbuf) - BUF_LENGTH(stash->readbuf)) < 1024) {
+			expbuf_shrink(stash->readbuf, 1024);
+		}
+		
+		avail = BUF_MAX(stash->readbuf) - BUF_LENGTH(stash->readbuf);
+		assert(avail > 0);
+		sent = sock_recv(stash, conn, BUF_DATA(stash->readbuf)+BUF_LENGTH(stash->readbuf), avail);
+		if (sent <= 0) {
+			// socket has shutdown
+			if (first == 0 && stash->spin_max > 0) { spin_done(stash, 0); }
+			assert(0);
+		}
+		else {
+			assert(sent <= avail);
+			if (first == 0) {
+				first = 1;
+				if (stash->spin_max > 0) { spin_done(stash, 1); }
+				if (TIMING(stash)) { stash->first_byte = now_nsec(); }
+				if (TRACING(stash)) { trace_event(stash, STASH_TRACE_FIRST_BYTE); }
+			}
+			BUF_LENGTH(stash->readbuf) += sent;
+			
+			// now that we have more data, attempt to parse it into risp.  
+			processed = sock_process(stash, conn, risp);
+		}
+	}
+	
+	return(processed);
+}
+
+
+//-----------------------------------------------------------------------------
+// Hedged reads.
+//
+// The request is sent to the first server, and if it hasn't started to reply 
+// within the hedge delay, the same request is sent to a second server.  
+// Whichever one replies completely first wins.  The other one will have its 
+// reply discarded (by request id) when it arrives.  The delay is a percentile 
+// of the latency of recent read requests.
+
+// the number of read requests we need to have seen before we start hedging.
+#define HEDGE_WARMUP  (32)
+
+// pick the server to hedge the request to.  This is the connected server with 
+// the lowest load, other than the one the request is already going to.  Returns NULL if 
+// there isn't one.
+static conn_t * hedge_select(stash_t *stash, conn_t *conn)
+{
+	conn_t *best = NULL, *curr;
+	
+	assert(stash && conn);
+	
+	assert(stash->connlist);
+	ll_start(stash->connlist);
+	while ((curr = ll_next(stash->connlist))) {
+		if (curr != conn && curr->active) {
+			if (best == NULL || conn_load(curr) < conn_load(best)) {
+				best = curr;
+			}
+		}
+	}
+	ll_finish(stash->connlist);
+	
+	return(best);
+}
+
+
+// the delay before hedging a request (microseconds), or -1 if we shouldn't hedge.
+static long long hedge_delay(stash_t *stash)
+{
+	long long delay;
+	lathist_t *hist;
+	
+	assert(stash);
+	assert(stash->hedge_percentile > 0);
+	
+	hist = stash->hedge_hist;
+	assert(hist);
+	if (hist->total < HEDGE_WARMUP) {
+		delay = -1;
+	}
+	else {
+		delay = hist_percentile(hist, stash->hedge_percentile);
+		if (delay < stash->hedge_min) { delay = stash->hedge_min; }
+	}
+	
+	stash->hedgestats.delay = delay;
+	return(delay);
+}
+
+
+// read whatever is available on the connection into its own read buffer.  
+// Returns non-zero when it holds a complete reply for the current request.
+static int hedge_read(stash_t *stash, conn_t *conn)
+{
+	char chunk[16384];
+	ssize_t got;
+	
+	assert(stash && conn);
+	
+	got = recv(conn->handle, chunk, sizeof(chunk), 0);
+	if (got <= 0) {
+		conn_lost(stash, conn);
+		return(0);
+	}
+	
+	expbuf_add(conn->readbuf, chunk, got);
+	if (discard_stale(stash, conn, conn->readbuf) > 0) {
+		return(0);
+	}
+	
+	return(BUF_LENGTH(conn->readbuf) > 0 && 
+		reply_length(stash, (unsigned char *) BUF_DATA(conn->readbuf), BUF_LENGTH(conn->readbuf)) == BUF_LENGTH(conn->readbuf));
+}
+
+
+// send the request to the connection, and if it has not started replying 
+// within the hedge delay, to a second server as well.  Returns the connection 
+// that the reply was received from, and sets 'processed' to the number of 
+// bytes processed (0 if the reply could not be received).
+static conn_t * sock_hedged(stash_t *stash, conn_t *conn, risp_t *risp, risp_length_t *processed)
+{
+	struct pollfd fds[2];
+	struct timespec ts;
+	conn_t *hedge, *winner = NULL, *loser;
+	conn_t *conns[2];
+	long long delay;
+	int i;
+	
+	assert(stash && conn && risp && processed);
+	assert(stash->hedge_percentile > 0);
+	
+	stash->hedgestats.reads ++;
+	*processed = 0;
+	
+	sock_send_request(stash, conn);
+	if (conn->active == 0) {
+		return(conn);
+	}
+	
+	// if we have a delay and another server, wait for the first server to start replying.
+	delay = hedge_delay(stash);
+	hedge = (delay >= 0) ? hedge_select(stash, conn) : NULL;
+	if (hedge && BUF_LENGTH(conn->readbuf) == 0) {
+		fds[0].fd = conn->handle;
+		fds[0].events = POLLIN;
+		ts.tv_sec = delay / 1000000;
+		ts.tv_nsec = (delay % 1000000) * 1000;
+		if (ppoll(fds, 1, &ts, NULL) != 0) {
+			// it has started replying (or something went wrong), so no need to hedge.
+			hedge = NULL;
+		}
+	}
+	else {
+		hedge = NULL;
+	}
+	
+	if (hedge == NULL) {
+		*processed = sock_recv_reply(stash, conn, risp);
+		return(conn);
+	}
+	
+	// send the same request to the other server.
+	stash->hedgestats.hedged ++;
+	hedge->lastused = conn->lastused;
+	sock_send_request(stash, hedge);
+	if (hedge->active == 0) {
+		*processed = sock_recv_reply(stash, conn, risp);
+		return(conn);
+	}
+	
+	// read from both until one of them has the complete reply.  The partial 
+	// data is kept in each connection's read buffer.
+	conns[0] = conn;
+	conns[1] = hedge;
+	while (winner == NULL && (conn->active || hedge->active)) {
+		for (i=0; i<2; i++) {
+			fds[i].fd = conns[i]->active ? conns[i]->handle : -1;
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+		}
+		
+		if (poll(fds, 2, -1) > 0) {
+			for (i=0; i<2 && winner == NULL; i++) {
+				if (fds[i].revents && conns[i]->active && hedge_read(stash, conns[i])) {
+					winner = conns[i];
+				}
+			}
+		}
+	}
+	
+	if (winner) {
+		loser = (winner == conn) ? hedge : conn;
+		if (winner == hedge) {
+			stash->hedgestats.hedge_wins ++;
+		}
+		
+		// the other one will still reply, so it needs to be discarded when it arrives.
+		if (loser->active) {
+			loser->discard ++;
+		}
+		
+		assert(BUF_LENGTH(stash->readbuf) == 0);
+		expbuf_add(stash->readbuf, BUF_DATA(winner->readbuf), BUF_LENGTH(winner->readbuf));
+		expbuf_clear(winner->readbuf);
+		*processed = risp_process(risp, NULL, BUF_LENGTH(stash->readbuf), BUF_DATA(stash->readbuf));
+		assert(*processed == BUF_LENGTH(stash->readbuf));
+	}
+	
+	return(winner ? winner : conn);
+}
+
+
+// defined with the rest of the connection handling below.
+static void conn_open_servers(stash_t *stash);
+
+void stash_hedge_reads(stash_t *stash, int percentile, int min_delay)
+{
+	conn_t *conn;
+	
+	assert(stash);
+	assert(percentile >= 0 && percentile <= 100);
+	assert(min_delay >= 0);
+	
+	stash->hedge_percentile = percentile;
+	stash->hedge_min = min_delay;
+	
+	if (percentile > 0 && stash->hedge_hist == NULL) {
+		stash->hedge_hist = calloc(1, sizeof(lathist_t));
+		assert(stash->hedge_hist);
+	}
+	
+	// requests can only be hedged to servers we are connected to.
+	assert(stash->connlist);
+	conn = ll_get_head(stash->connlist);
+	if (percentile > 0 && conn && conn->active) {
+		conn_open_servers(stash);
+	}
+}
+
+
+void stash_get_hedgestats(stash_t *stash, stash_hedgestats_t *stats)
+{
+	assert(stash && stats);
+	memcpy(stats, &stash->hedgestats, sizeof(*stats));
+}
+
+
+#ifdef STASH_IOURING
+//-----------------------------------------------------------------------------
+// io_uring transport.  
+//
+// When the library is built with STASH_IOURING, stash_init() will attempt to 
+// setup an io_uring instance.  If that fails (old kernel, or io_uring 
+// disabled), then uring will be left NULL and the blocking socket calls are 
+// used instead.
+//
+// Requests are copied into a registered send buffer, and the send and the 
+// first receive are submitted together so that a small request/reply only 
+// needs a single system call to send and wait.  If the kernel supports 
+// provided buffer rings, then a multishot receive is armed on the connection 
+// and stays armed between requests, so we dont need to submit a receive at 
+// all.  Otherwise a read into a registered receive buffer is linked to the send.
+
+// The user-data on each submission is the tag in the low bits, and the 
+// sequence number of the request above it.  Completions that do not belong to 
+// the current request (for example, from a request that failed part-way 
+// through) are ignored.  Multishot receives stay armed across requests, so 
+// they carry the id of the receive on their connection instead of a sequence 
+// number.
+#define URING_TAG_MASK        (0x3)
+#define URING_DATA(tag, seq)  ((((__u64)(seq)) << 8) | (tag))
+#define URING_MS_DATA(id)     URING_DATA(URING_TAG_MULTISHOT, id)
+
+// find the connection that has the multishot receive armed.  NULL if it has 
+// since been cancelled.
+static conn_t * uring_ms_conn(stash_t *stash, unsigned int id)
+{
+	conn_t *conn, *found = NULL;
+	
+	assert(stash && stash->connlist && id > 0);
+	
+	ll_start(stash->connlist);
+	while (found == NULL && (conn = ll_next(stash->connlist))) {
+		if (conn->ms_armed && conn->ms_id == id) {
+			found = conn;
+		}
+	}
+	ll_finish(stash->connlist);
+	
+	return(found);
+}
+
+static struct io_uring_sqe * uring_queue_send(uring_t *ur, conn_t *conn, expbuf_t *buf, int offset)
+{
+	struct io_uring_sqe *sqe;
+	int length;
+	
+	assert(ur && conn && buf);
+	assert(offset >= 0 && offset < BUF_LENGTH(buf));
+	
+	length = BUF_LENGTH(buf) - offset;
+	sqe = io_uring_get_sqe(&ur->ring);
+	assert(sqe);
+	
+	if (offset == 0 && length <= URING_BUFSIZE) {
+		// small enough to go in the registered buffer.
+		memcpy(ur->sendbuf, BUF_DATA(buf), length);
+		io_uring_prep_write_fixed(sqe, conn->handle, ur->sendbuf, length, 0, 0);
+	}
+	else {
+		io_uring_prep_send(sqe, conn->handle, BUF_DATA(buf) + offset, length, 0);
+	}
+	io_uring_sqe_set_data64(sqe, URING_DATA(URING_TAG_SEND, ur->seq));
+	
+	return(sqe);
+}
+
+
+static struct io_uring_sqe * uring_queue_recv(uring_t *ur, conn_t *conn)
+{
+	struct io_uring_sqe *sqe;
+	
+	assert(ur && conn);
+	
+	sqe = io_uring_get_sqe(&ur->ring);
+	assert(sqe);
+	
+	if (ur->br) {
+		io_uring_prep_recv_multishot(sqe, conn->handle, NULL, 0, 0);
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_MS_GROUP;
+		conn->ms_id = ++ur->ms_seq;
+		if (conn->ms_id == 0) { conn->ms_id = ++ur->ms_seq; }
+		io_uring_sqe_set_data64(sqe, URING_MS_DATA(conn->ms_id));
+		conn->ms_armed = 1;
+	}
+	else {
+		io_uring_prep_read_fixed(sqe, conn->handle, ur->recvbuf, URING_BUFSIZE, 0, 1);
+		io_uring_sqe_set_data64(sqe, URING_DATA(URING_TAG_RECV, ur->seq));
+	}
+	
+	return(sqe);
+}
+
+
+// wait for the next completion.  In low-latency mode, we spin on the 
+// completion queue before blocking, and note how the wait ended (see spin_done).
+static int uring_wait(stash_t *stash, uring_t *ur, struct io_uring_cqe **cqe)
+{
+	int window;
+	int res;
+	
+	assert(stash && ur && cqe);
+	
+	if (stash->spin_max <= 0) {
+		res = io_uring_wait_cqe(&ur->ring, cqe);
+	}
+	else {
+		window = spin_start(stash);
+		if (window > 0) {
+			do {
+				if (io_uring_peek_cqe(&ur->ring, cqe) == 0) {
+					stash->spin_result = SPIN_HIT;
+					return(0);
+				}
+			} while (spin_expired(stash, window) == 0);
+		}
+		
+		res = io_uring_wait_cqe(&ur->ring, cqe);
+		stash->spin_result = (window > 0) ? SPIN_MISS : SPIN_SKIPPED;
+	}
+	
+	return(res);
+}
+
+
+// send the request buffer and receive the complete reply.  Returns the number 
+// of bytes processed by risp (0 if the connection was lost).
+static risp_length_t uring_transact(stash_t *stash, conn_t *conn, risp_t *risp)
+{
+	uring_t *ur;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	conn_t *other;
+	risp_length_t processed = 0;
+	int sent = 0;
+	int sending = 1;
+	int failed = 0;
+	int first = 0;
+	int tag, res, bid, mask;
+	unsigned int flags;
+	__u64 data;
+	
+	assert(stash && conn && risp);
+	assert(stash->uring);
+	assert(BUF_LENGTH(stash->buf_request) > 0);
+	assert(BUF_LENGTH(stash->readbuf) == 0);
+	
+	ur = stash->uring;
+	ur->seq++;
+	
+	if (ur->br) {
+		// the multishot receive stays armed for the connection, so we only need 
+		// to arm it if it isn't already.
+		if (conn->ms_armed == 0) {
+			uring_queue_recv(ur, conn);
+		}
+		
+		// anything that was received on this connection while we were waiting 
+		// on another one is waiting for us in the connection's read buffer.
+		if (BUF_LENGTH(conn->readbuf) > 0) {
+			expbuf_add(stash->readbuf, BUF_DATA(conn->readbuf), BUF_LENGTH(conn->readbuf));
+			expbuf_clear(conn->readbuf);
+		}
+		uring_queue_send(ur, conn, stash->buf_request, 0);
+	}
+	else {
+		// link the receive to the send, so that they can go in together.
+		sqe = uring_queue_send(ur, conn, stash->buf_request, 0);
+		assert(sqe);
+		sqe->flags |= IOSQE_IO_LINK;
+		uring_queue_recv(ur, conn);
+	}
+	
+	// a single system call to submit the send (and receive), and wait for the first completion.
+	io_uring_submit_and_wait(&ur->ring, 1);
+	
+	while (failed == 0 && (processed == 0 || sending)) {
+		
+		if (uring_wait(stash, ur, &cqe) < 0) {
+			failed = 1;
+			continue;
+		}
+		
+		data = io_uring_cqe_get_data64(cqe);
+		res = cqe->res;
+		flags = cqe->flags;
+		tag = data & URING_TAG_MASK;
+		io_uring_cqe_seen(&ur->ring, cqe);
+		
+		if (tag == URING_TAG_CANCEL) {
+			continue;
+		}
+		else if (tag == URING_TAG_MULTISHOT) {
+			
+			// NULL if the receive was cancelled when its connection was closed.
+			other = uring_ms_conn(stash, data >> 8);
+			
+			if ((flags & IORING_CQE_F_BUFFER) && ur->br) {
+				// copy the data out of the provided buffer, and give it back to 
+				// the ring.  Data for a connection other than the one we are 
+				// waiting on is kept with that connection until it is next used.
+				bid = flags >> IORING_CQE_BUFFER_SHIFT;
+				assert(bid >= 0 && bid < URING_MS_BUFFERS);
+				if (res > 0 && other) {
+					expbuf_add(other == conn ? stash->readbuf : other->readbuf, ur->ms_bufs + (bid * URING_MS_BUFSIZE), res);
+				}
+				mask = io_uring_buf_ring_mask(URING_MS_BUFFERS);
+				io_uring_buf_ring_add(ur->br, ur->ms_bufs + (bid * URING_MS_BUFSIZE), URING_MS_BUFSIZE, bid, mask, 0);
+				io_uring_buf_ring_advance(ur->br, 1);
+			}
+			
+			if (other == NULL) {
+				continue;
+			}
+			
+			if ((flags & IORING_CQE_F_MORE) == 0) {
+				// the multishot receive has terminated.
+				other->ms_armed = 0;
+			}
+			
+			if (res == -EINVAL) {
+				// the kernel has provided buffer rings, but not multishot receives.  
+				// Use a single receive for each read from now on.
+				uring_no_multishot(ur);
+				if (other == conn) {
+					uring_queue_recv(ur, conn);
+					io_uring_submit(&ur->ring);
+				}
+				continue;
+			}
+			
+			if (other != conn) {
+				continue;
+			}
+			
+			if (res == -ENOBUFS) {
+				// we ran out of provided buffers, but we've given them back now, so re-arm.
+				assert(conn->ms_armed == 0);
+				uring_queue_recv(ur, conn);
+				io_uring_submit(&ur->ring);
+				continue;
+			}
+			else if (res <= 0) {
+				failed = 1;
+				continue;
+			}
+			else if (conn->ms_armed == 0) {
+				uring_queue_recv(ur, conn);
+				io_uring_submit(&ur->ring);
+			}
+		}
+		else if ((data >> 8) != ur->seq) {
+			// a completion from an earlier request, ignore it.
+			continue;
+		}
+		else if (tag == URING_TAG_SEND) {
+			if (res <= 0) {
+				failed = 1;
+			}
+			else {
+				sent += res;
+				assert(sent <= BUF_LENGTH(stash->buf_request));
+				if (sent < BUF_LENGTH(stash->buf_request)) {
+					uring_queue_send(ur, conn, stash->buf_request, sent);
+					io_uring_submit(&ur->ring);
+				}
+				else {
+					sending = 0;
+				}
+			}
+			continue;
+		}
+		else {
+			assert(tag == URING_TAG_RECV);
+			if (res == -ECANCELED) {
+				// a short send breaks the link, so the receive was cancelled.
+				uring_queue_recv(ur, conn);
+				io_uring_submit(&ur->ring);
+				continue;
+			}
+			else if (res <= 0) {
+				failed = 1;
+				continue;
+			}
+			expbuf_add(stash->readbuf, ur->recvbuf, res);
+		}
+		
+		// now that we have more data, attempt to parse it into risp.  
+		// If it succeeds, then we have all we need to get.
+		assert(BUF_LENGTH(stash->readbuf) > 0);
+		if (first == 0) {
+			// the spin stats are kept per reply, not per completion.
+			first = 1;
+			if (stash->spin_max > 0) { spin_done(stash, 1); }
+		}
+		processed = risp_process(risp, NULL, BUF_LENGTH(stash->readbuf), BUF_DATA(stash->readbuf));
+		if (processed > 0) {
+			assert(processed == BUF_LENGTH(stash->readbuf));
+		}
+		else if (ur->br == NULL) {
+			// need more data, and we're not using multishot, so queue another read.
+			uring_queue_recv(ur, conn);
+			io_uring_submit(&ur->ring);
+		}
+	}
+	
+	if (failed) {
+		if (first == 0 && stash->spin_max > 0) { spin_done(stash, 0); }
+		processed = 0;
+		conn_lost(stash, conn);
+	}
+	
+	return(processed);
+}
+#endif
+
+
+//-----------------------------------------------------------------------------
+// Traffic capture.  Every request and every reply is written to a file exactly 
+// as it went over the wire, so that the traffic can be replayed later (see 
+// tools/stash-replay.c).  The file starts with the 8 byte magic and a version 
+// byte, followed by a record for each message:
+//
+//    type       1 byte   (CAPTURE_REQUEST or CAPTURE_REPLY)
+//    time       8 bytes  (microseconds since the capture started)
+//    length     4 bytes
+//    data       'length' bytes
+//
+// Integers are big-endian, the same as RISP.
+
+#define CAPTURE_MAGIC    "STASHCAP"
+#define CAPTURE_VERSION  (1)
+#define CAPTURE_REQUEST  ('Q')
+#define CAPTURE_REPLY    ('R')
+
+
+// requests that carry a password are left out of the capture (along with 
+// their replies) and the slow request log's dump file.
+static int cmd_secret(risp_command_t cmd)
+{
+	return(cmd == STASH_CMD_LOGIN || cmd == STASH_CMD_CREATE_USER || cmd == STASH_CMD_SET_PASSWORD);
+}
+
+
+// start capturing to the file (replacing anything already in it), or stop if 
+// path is NULL.  A new file is only readable by its owner.  Returns 0 on 
+// success, or -1 if the file could not be opened.
+int stash_capture(stash_t *stash, const char *path)
+{
+	FILE *fp;
+	int fd;
+	
+	assert(stash);
+	
+	if (stash->capture) {
+		fclose(stash->capture);
+		stash->capture = NULL;
+	}
+	
+	if (path == NULL) { return(0); }
+	
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) { return(-1); }
+	fp = fdopen(fd, "wb");
+	if (fp == NULL) {
+		close(fd);
+		return(-1);
+	}
+	
+	fwrite(CAPTURE_MAGIC, 1, 8, fp);
+	fputc(CAPTURE_VERSION, fp);
+	
+	stash->capture = fp;
+	stash->capture_start = now_usec();
+	
+	return(0);
+}
+
+
+static void capture_write(FILE *fp, char type, long long time, const char *data, int length)
+{
+	unsigned char hdr[13];
+	int i;
+	
+	assert(fp);
+	assert(data && length > 0);
+	
+	hdr[0] = type;
+	for (i=0; i<8; i++) { hdr[1+i] = (time >> (56 - (i*8))) & 0xff; }
+	for (i=0; i<4; i++) { hdr[9+i] = (length >> (24 - (i*8))) & 0xff; }
+	
+	fwrite(hdr, 1, sizeof(hdr), fp);
+	fwrite(data, 1, length, fp);
+}
+
+static void capture_record(stash_t *stash, char type, const char *data, int length)
+{
+	assert(stash && stash->capture);
+	capture_write(stash->capture, type, now_usec() - stash->capture_start, data, length);
+}
+
+
+//-----------------------------------------------------------------------------
+// Slow request log.  Requests that take longer than the threshold are logged 
+// to stderr with their phase timings.  If a path was given, the encoded 
+// request is also appended to that file, in the capture format, so that it 
+// can be played back with stash-replay.  When the file gets bigger than the 
+// maximum size, it is renamed with a '.1' on the end and a new one started.
+
+void stash_slowlog(stash_t *stash, int usec, const char *path, long max_size)
+{
+	assert(stash);
+	assert(usec >= 0 && max_size >= 0);
+	
+	stash->slow_usec = usec;
+	stash->slow_max = max_size;
+	if (stash->slow_path) { free(stash->slow_path); stash->slow_path = NULL; }
+	if (path) {
+		stash->slow_path = strdup(path);
+		assert(stash->slow_path);
+	}
+}
+
+
+// return the integer value of a top level command in the request data, or 0 
+// if it isn't there.
+static int request_value(stash_t *stash, expbuf_t *data, risp_command_t cmd)
+{
+	risp_t *rr;
+	risp_length_t processed;
+	
+	assert(stash && data && cmd >= 64 && cmd < 160);
+	assert(stash->risp_reqid);
+	
+	rr = stash->risp_reqid;
+	risp_clear_all(rr);
+	processed = risp_process(rr, NULL, BUF_LENGTH(data), BUF_DATA(data));
+	if (processed != BUF_LENGTH(data) || risp_isset(rr, cmd) == 0) { return(0); }
+	return(risp_getvalue(rr, cmd));
+}
+
+
+// open the slow request log for appending, positioned at the end so that 
+// ftell() gives its size.  A new file is only readable by its owner.
+static FILE * slowlog_open(const char *path)
+{
+	FILE *fp;
+	int fd;
+	
+	assert(path);
+	
+	fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if (fd < 0) { return(NULL); }
+	fp = fdopen(fd, "ab");
+	if (fp == NULL) {
+		close(fd);
+		return(NULL);
+	}
+	
+	fseek(fp, 0, SEEK_END);
+	return(fp);
+}
+
+
+static void slowlog_dump(stash_t *stash)
+{
+	FILE *fp;
+	char *old;
+	
+	assert(stash && stash->slow_path);
+	assert(BUF_LENGTH(stash->buf_request) > 0);
+	
+	fp = slowlog_open(stash->slow_path);
+	if (fp == NULL) { return; }
+	
+	if (stash->slow_max > 0 && ftell(fp) >= stash->slow_max) {
+		fclose(fp);
+		old = malloc(strlen(stash->slow_path) + 3);
+		assert(old);
+		sprintf(old, "%s.1", stash->slow_path);
+		rename(stash->slow_path, old);
+		free(old);
+		
+		fp = slowlog_open(stash->slow_path);
+		if (fp == NULL) { return; }
+	}
+	
+	if (ftell(fp) == 0) {
+		fwrite(CAPTURE_MAGIC, 1, 8, fp);
+		fputc(CAPTURE_VERSION, fp);
+	}
+	
+	// the times in the file are not meaningful, each request stands alone.
+	capture_write(fp, CAPTURE_REQUEST, 0, BUF_DATA(stash->buf_request), BUF_LENGTH(stash->buf_request));
+	fclose(fp);
+}
+
+
+static void slowlog_request(stash_t *stash, risp_command_t cmd, expbuf_t *data, stash_reply_t *reply, const stash_profile_t *prof, long long elapsed)
+{
+	assert(stash && cmd > 0 && data && prof);
+	assert(stash->slow_usec > 0);
+	
+	fprintf(stderr, 
+		"libstash: slow request: %lld usec, cmd=%d nsid=%d tid=%d request=%d reply=%d rows=%d result=%d"
+		" (send=%lld wait=%lld receive=%lld decode=%lld usec)\n",
+		elapsed, cmd, 
+		request_value(stash, data, STASH_CMD_NAMESPACE_ID),
+		request_value(stash, data, STASH_CMD_TABLE_ID),
+		prof->request_bytes, prof->reply_bytes, 
+		reply ? reply->row_count : 0,
+		reply ? reply->resultcode : STASH_ERR_NOTCONNECTED,
+		prof->send / 1000, prof->wait / 1000, prof->receive / 1000, prof->decode / 1000);
+	
+	// requests with a password in them are logged, but not dumped.
+	if (stash->slow_path && cmd_secret(cmd) == 0) {
+		slowlog_dump(stash);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Query result cache.  When it is turned on, the replies from 
+// stash_query_execute() are kept, keyed by the encoded query, and their rows 
+// are handed out again while they are still fresh.  The least recently used 
+// entries are dropped when the cache goes over its budget.  A write through 
+// this handle drops the entries for that table, but writes from other clients 
+// are not seen, so the ttl is how stale a cached reply can be.
+//
+// The cache is a list with the most recently used entry at the head.  Each 
+// entry keeps the hash of its key so that most of them can be skipped without 
+// comparing the whole key.
+
+typedef struct {
+	unsigned int hash;
+	char *key;
+	int key_len;
+	stash_tableid_t tid;
+	long long expires;		// usec
+	long size;				// estimated memory used by the entry and its reply.
+	stash_reply_t *reply;
+} cache_entry_t;
+
+
+// FNV-1a
+static unsigned int cache_hash(const char *data, int length)
+{
+	unsigned int hash = 2166136261u;
+	int i;
+	
+	assert(data && length > 0);
+	for (i=0; i<length; i++) {
+		hash ^= (unsigned char) data[i];
+		hash *= 16777619u;
+	}
+	return(hash);
+}
+
+
+static long cache_size(stash_reply_t *reply, int key_len)
+{
+	replyrow_t *row;
+	attr_t *attr;
+	long size;
+	
+	assert(reply && key_len > 0);
+	
+	size = sizeof(cache_entry_t) + sizeof(stash_reply_t) + key_len + reply->cont_len;
+	
+	ll_start(reply->rows);
+	while ((row = ll_next(reply->rows))) {
+		size += sizeof(replyrow_t);
+		ll_start(row->attrlist);
+		while ((attr = ll_next(row->attrlist))) {
+			assert(attr->value);
+			size += sizeof(attr_t) + sizeof(stash_value_t) + attr->value->datalen;
+		}
+		ll_finish(row->attrlist);
+	}
+	ll_finish(reply->rows);
+	
+	return(size);
+}
+
+
+// free an entry that has already been taken off the list.  The reply is only 
+// returned to the pool if no replies are still reading its rows, otherwise that 
+// happens when the last of them is returned.
+static void cache_drop(stash_t *stash, cache_entry_t *entry)
+{
+	assert(stash && entry);
+	assert(entry->reply && entry->reply->cached);
+	assert(stash->cache_bytes >= entry->size);
+	
+	stash->cache_bytes -= entry->size;
+	
+	entry->reply->cached = 0;
+	if (entry->reply->refs == 0) {
+		stash_return_reply(entry->reply);
+	}
+	
+	free(entry->key);
+	free(entry);
+}
+
+
+static void cache_remove(stash_t *stash, cache_entry_t *entry)
+{
+	cache_entry_t *removed;
+	
+	assert(stash && stash->cache && entry);
+	
+	// entries can only be taken off the ends of the list.
+	ll_move_tail(stash->cache, entry);
+	removed = ll_pop_tail(stash->cache);
+	assert(removed == entry);
+	
+	cache_drop(stash, entry);
+}
+
+
+// hand out a cached reply.  Each caller gets a reply of their own, with its 
+// own place in the rows, so they can be read (or sorted) without getting in 
+// the way of each other.  The rows themselves are not copied, they belong to 
+// the cached reply, which counts the replies that are reading them.
+static stash_reply_t * cache_share(stash_t *stash, stash_reply_t *cached)
+{
+	stash_reply_t *reply;
+	replyrow_t *row;
+	
+	assert(stash && cached);
+	assert(cached->cached && cached->shared == NULL);
+	assert(cached->resultcode == STASH_ERR_OK && cached->cont == NULL);
+	
+	reply = getreply(stash);
+	assert(reply && reply != cached);
+	assert(reply->shared == NULL && ll_count(reply->rows) == 0);
+	
+	reply->operation = cached->operation;
+	reply->uid = cached->uid;
+	reply->nsid = cached->nsid;
+	reply->tid = cached->tid;
+	reply->kid = cached->kid;
+	reply->aggregate = cached->aggregate;
+	reply->version = cached->version;
+	
+	ll_start(cached->rows);
+	while ((row = ll_next(cached->rows))) {
+		ll_push_tail(reply->rows, row);
+	}
+	ll_finish(cached->rows);
+	reply->row_count = cached->row_count;
+	reply->curr_row = -1;
+	
+	reply->shared = cached;
+	cached->refs ++;
+	
+	return(reply);
+}
+
+
+static stash_reply_t * cache_lookup(stash_t *stash, expbuf_t *key)
+{
+	cache_entry_t *entry;
+	unsigned int hash;
+	
+	assert(stash && stash->cache && key);
+	assert(BUF_LENGTH(key) > 0);
+	
+	hash = cache_hash(BUF_DATA(key), BUF_LENGTH(key));
+	
+	ll_start(stash->cache);
+	while ((entry = ll_next(stash->cache))) {
+		if (entry->hash == hash && entry->key_len == BUF_LENGTH(key) && memcmp(entry->key, BUF_DATA(key), entry->key_len) == 0) {
+			break;
+		}
+	}
+	ll_finish(stash->cache);
+	
+	if (entry && entry->expires <= now_usec()) {
+		cache_remove(stash, entry);
+		entry = NULL;
+	}
+	
+	if (entry == NULL) {
+		stash->stats.cache_misses ++;
+		return(NULL);
+	}
+	
+	stash->stats.cache_hits ++;
+	ll_move_head(stash->cache, entry);
+	
+	return(cache_share(stash, entry->reply));
+}
+
+
+// keep the reply that has just arrived, and return the one to hand to the 
+// caller instead (see cache_share).  It is shared before anything is evicted, 
+// so the rows stay until the caller returns it, even if the reply is too big 
+// to stay in the cache.
+static stash_reply_t * cache_insert(stash_t *stash, expbuf_t *key, stash_tableid_t tid, stash_reply_t *reply)
+{
+	stash_reply_t *shared;
+	cache_entry_t *entry;
+	
+	assert(stash && stash->cache && key && tid > 0 && reply);
+	assert(BUF_LENGTH(key) > 0);
+	assert(reply->cached == 0 && reply->refs == 0);
+	
+	entry = calloc(1, sizeof(cache_entry_t));
+	assert(entry);
+	entry->key_len = BUF_LENGTH(key);
+	entry->key = malloc(entry->key_len);
+	assert(entry->key);
+	memcpy(entry->key, BUF_DATA(key), entry->key_len);
+	entry->hash = cache_hash(entry->key, entry->key_len);
+	entry->tid = tid;
+	entry->expires = now_usec() + ((long long) stash->cache_ttl * 1000);
+	entry->size = cache_size(reply, entry->key_len);
+	entry->reply = reply;
+	
+	reply->cached = 1;
+	shared = cache_share(stash, reply);
+	
+	ll_push_head(stash->cache, entry);
+	stash->cache_bytes += entry->size;
+	
+	while (stash->cache_bytes > stash->cache_max) {
+		entry = ll_pop_tail(stash->cache);
+		assert(entry);
+		stash->stats.cache_evictions ++;
+		cache_drop(stash, entry);
+	}
+	
+	return(shared);
+}
+
+
+// drop the entries for a table, or all of them if the table isn't known.
+static void cache_invalidate(stash_t *stash, stash_tableid_t tid)
+{
+	cache_entry_t *entry;
+	int count;
+	
+	assert(stash && stash->cache && tid >= 0);
+	
+	// go round the whole list once, putting back the ones that are kept, so 
+	// that they stay in the same order.
+	count = ll_count(stash->cache);
+	while (count > 0) {
+		entry = ll_pop_head(stash->cache);
+		assert(entry);
+		if (tid == 0 || entry->tid == tid) {
+			stash->stats.cache_invalidations ++;
+			cache_drop(stash, entry);
+		}
 		else {
-			// when we have everything, get a fresh reply structure.
-			assert(risp);
-			reply = parsereply(stash, risp);
-			assert(reply);
+			ll_push_tail(stash->cache, entry);
 		}
-			
-		// we dont need the RISP object anymore... we can remove it.
-		risp_shutdown(risp);
-		risp = NULL;
+		count --;
+	}
+}
+
+
+// requests that change the rows in a table.
+static int cmd_writes(risp_command_t cmd)
+{
+	return(cmd == STASH_CMD_SET || cmd == STASH_CMD_UPDATE || cmd == STASH_CMD_SET_EXPIRY || 
+		cmd == STASH_CMD_DELETE || cmd == STASH_CMD_DELETE_WHERE || cmd == STASH_CMD_EXPIRE_WHERE);
+}
+
+
+void stash_cache(stash_t *stash, int ttl_ms, long max_bytes)
+{
+	cache_entry_t *entry;
+	
+	assert(stash);
+	assert(ttl_ms >= 0 && max_bytes >= 0);
+	
+	// changing the settings starts with an empty cache.
+	if (stash->cache) {
+		while ((entry = ll_pop_head(stash->cache))) {
+			cache_drop(stash, entry);
+		}
+		assert(stash->cache_bytes == 0);
+		
+		if (ttl_ms == 0 || max_bytes == 0) {
+			stash->cache = ll_free(stash->cache);
+			assert(stash->cache == NULL);
+		}
+	}
+	else if (ttl_ms > 0 && max_bytes > 0) {
+		stash->cache = ll_init(NULL);
+		assert(stash->cache);
+	}
+	
+	stash->cache_ttl = ttl_ms;
+	stash->cache_max = max_bytes;
+}
+
+
+//-----------------------------------------------------------------------------
+// TODO: This function needs a lot of work.   It should be worked a little bit 
+//       better.   Not sure exactly of the best way, just know that what we 
+//       have already doesn't look very good.
+static stash_reply_t * send_request_on(stash_t *stash, conn_t *conn, risp_command_t cmd, expbuf_t *data, int hedged)
+{
+	stash_reply_t *reply = NULL;
+	risp_t *risp;
+	risp_length_t processed;
+	long long started, elapsed;
+	long long p_start = 0, p_sent = 0, p_done = 0;
+	int request_bytes;
+	unsigned long long attributes;
+	stash_profile_t prof;
+	int timing;
+	
+	assert(stash && conn && cmd > 0 && data);
+	assert(stash->next_reqid > 0);
+
+	assert(stash->buf_payload);
+	assert(BUF_LENGTH(stash->buf_payload) == 0);
+	
+	assert(stash->buf_request);
+	assert(BUF_LENGTH(stash->buf_request) == 0);
+	
+	// build the operation that will contain the data, based on the command range.
+	rispbuf_addInt(stash->buf_payload, STASH_CMD_REQUEST_ID, stash->next_reqid);
+	rispbuf_addBuffer(stash->buf_payload, cmd, data);
+	rispbuf_addBuffer(stash->buf_request, STASH_CMD_REQUEST, stash->buf_payload);
+	
+	stash->next_reqid++;
+	assert(stash->next_reqid > 0);
+	
+	// clear the buffer we dont need anymore.
+	expbuf_clear(stash->buf_payload);
+	
+	if (TRACING(stash)) {
+		memset(&stash->trace_req, 0, sizeof(stash->trace_req));
+		stash->trace_req.reqid = stash->next_reqid - 1;
+		stash->trace_req.cmd = cmd;
+		stash->trace_req.request_bytes = BUF_LENGTH(stash->buf_request);
+		trace_event(stash, STASH_TRACE_BUILD);
+	}
+	
+	// ensure we are connected.
+	assert(conn->active);
+	assert(conn->closing == 0);
+	assert(conn->shutdown == 0);
+	assert(conn->handle > 0);
+	
+	conn->lastused = stash->next_reqid - 1;
+	
+	stash->stats.requests ++;
+	stash->stats.bytes_sent += BUF_LENGTH(stash->buf_request);
+	stash->stats.commands[cmd].requests ++;
+	stash->stats.commands[cmd].bytes_sent += BUF_LENGTH(stash->buf_request);
+	
+	if (stash->capture && cmd_secret(cmd) == 0) {
+		capture_record(stash, CAPTURE_REQUEST, BUF_DATA(stash->buf_request), BUF_LENGTH(stash->buf_request));
+	}
+	
+	started = now_usec();
+	
+	reply = NULL;
+	risp = risp_init(NULL);
+	assert(risp);
+	
+	// the phases are timed for the profile and the slow request log.
+	request_bytes = BUF_LENGTH(stash->buf_request);
+	timing = TIMING(stash);
+	if (timing) {
+		stash->first_byte = 0;
+		p_start = now_nsec();
+	}
+	
+	if (TRACING(stash)) { trace_event(stash, STASH_TRACE_SEND_START); }
+	
+	// send the data and read the reply using whichever transport was selected 
+	// when the stash object was initialised.
+#ifdef STASH_IOURING
+	if (stash->uring) {
+		processed = uring_transact(stash, conn, risp);
+	}
+	else
+#endif
+	if (hedged) {
+		// the reply could come from another server.
+		conn = sock_hedged(stash, conn, risp, &processed);
+	}
+	else {
+		sock_send_request(stash, conn);
+		if (timing) { p_sent = now_nsec(); }
+		if (TRACING(stash)) { trace_event(stash, STASH_TRACE_SEND_END); }
+		if (conn->active == 0) {
+			// we lost connection.  make sure we will return a NULL.
+			processed = 0;
+		}
+		else {
+			processed = sock_recv_reply(stash, conn, risp);
+		}
+	}
+	
+	if (timing) { p_done = now_nsec(); }
+	
+	if (stash->capture && processed > 0 && cmd_secret(cmd) == 0) {
+		capture_record(stash, CAPTURE_REPLY, BUF_DATA(stash->readbuf), processed);
+	}
+	
+	// now that we have sent everything (or tried to), we can clear the read 
+	// buffer.  The request is kept until the end in case it is slow and needs 
+	// to be dumped.
+	expbuf_clear(stash->readbuf);
+	
+	if (processed <= 0) {
+		// failed to receive reply.
+		assert(reply == NULL);
+		stash->stats.lost ++;
+		stash->stats.commands[cmd].failed ++;
+	}
+	else {
+		// when we have everything, get a fresh reply structure.
+		elapsed = now_usec() - started;
+		server_done(conn, elapsed);
+		if (stash->hedge_hist && cmd_readonly(cmd)) {
+			hist_record(stash->hedge_hist, elapsed);
+		}
+		
+		stash->stats.replies ++;
+		stash->stats.bytes_received += processed;
+		stash->stats.commands[cmd].bytes_received += processed;
+		stash->stats.commands[cmd].usec += elapsed;
+		stats_hist_record(&stash->stats.latency, elapsed);
+		stats_hist_record(&stash->stats.reply_size, processed);
+		
+		attributes = stash->stats.attributes;
+		reply = parsereply(stash, risp);
+		assert(reply);
+		
+		if (reply->resultcode != STASH_ERR_OK) {
+			stash->stats.failed ++;
+			stash->stats.commands[cmd].failed ++;
+		}
+		
 	}
 	
+	if (timing) {
+		// the io_uring and hedged transports dont separate the send from the 
+		// wait, so all of it is counted as waiting.
+		if (p_sent == 0) { p_sent = p_start; }
+		if (stash->first_byte == 0 || stash->first_byte < p_sent) { stash->first_byte = p_done; }
+		
+		memset(&prof, 0, sizeof(prof));
+		prof.send = p_sent - p_start;
+		prof.wait = stash->first_byte - p_sent;
+		prof.receive = p_done - stash->first_byte;
+		prof.request_bytes = request_bytes;
+		if (reply) {
+			prof.decode = now_nsec() - p_done;
+			prof.reply_bytes = processed;
+			prof.rows = reply->row_count;
+			prof.attributes = stash->stats.attributes - attributes;
+			if (stash->profiling) { reply->profile = prof; }
+		}
+		
+		elapsed = (p_done - p_start + prof.decode) / 1000;
+		if (stash->slow_usec > 0 && elapsed >= stash->slow_usec) {
+			slowlog_request(stash, cmd, data, reply, &prof, elapsed);
+		}
+	}
+	
+	expbuf_clear(stash->buf_request);
+	
+	if (TRACING(stash)) {
+		stash->trace_req.reply_bytes = processed > 0 ? processed : 0;
+		stash->trace_req.rows = reply ? reply->row_count : 0;
+		stash->trace_req.resultcode = reply ? reply->resultcode : STASH_ERR_NOTCONNECTED;
+		trace_event(stash, STASH_TRACE_PARSE_END);
+	}
+		
+	// we dont need the RISP object anymore... we can remove it.
+	risp_shutdown(risp);
+	risp = NULL;
+	
 	assert(BUF_LENGTH(stash->readbuf) == 0);
 	
 	return(reply);
 }
 
 
-
-
+// send the request on the best connection we have, and return the reply.
+static stash_reply_t * send_request(stash_t *stash, risp_command_t cmd, expbuf_t *data)
+{
+	conn_t *conn;
+	
+	assert(stash && cmd > 0 && data);
+	
+	conn = conn_select(stash, cmd);
+	assert(conn);
+	
+	if (stash->cache && cmd_writes(cmd)) {
+		cache_invalidate(stash, request_value(stash, data, STASH_CMD_TABLE_ID));
+	}
+	
+	// read-only requests can be hedged to another server (not supported on the io_uring transport).
+	return(send_request_on(stash, conn, cmd, data, 
+		stash->hedge_percentile > 0 && stash->uring == NULL && cmd_readonly(cmd)));
+}
+
+
+
+
+// send a login over a connection that has just been established.  If the 
+// login fails, the connection is marked as inactive.
+static stash_result_t conn_login(stash_t *stash, conn_t *conn)
+{
+	stash_result_t res;
+	stash_reply_t *reply;
+	
+	assert(stash && conn);
+	assert(conn->active == 1);
+	assert(stash->username && stash->password);
+	
+	// get a buffer and bui
+	assert(stash->buf_set);
+	assert(BUF_LENGTH(stash->buf_set) == 0);
+	rispbuf_addStr(stash->buf_set, STASH_CMD_USERNAME, strlen(stash->username), stash->username);
+	rispbuf_addStr(stash->buf_set, STASH_CMD_PASSWORD, strlen(stash->password), stash->password);
+	
+	// send the request and receive the reply.
+	reply = send_request_on(stash, conn, STASH_CMD_LOGIN, stash->buf_set, 0);
+	
+	expbuf_clear(stash->buf_set);
+	
+	// if the connection was lost, it has already been dealt with.
+	if (reply == NULL) {
+		assert(conn->active == 0);
+		return(STASH_ERR_NOTCONNECTED);
+	}
+	
+	// process the reply and store the results in the data pointers that was provided.
+	res = reply->resultcode;
+	if (res == STASH_ERR_OK) {
+		assert(reply->uid > 0);
+		assert(stash->uid == 0 || stash->uid == reply->uid);
+		stash->uid = reply->uid;
+		assert(conn->active == 1);
+	}
+	else {
+		// close it, so that it can be opened again later.
+		conn_lost(stash, conn);
+	}
+	
+	reply_free(reply);
+	
+	return(res);
+}
+
+
+// connect to all the servers in the list that are not already connected.  
+// Used when read-only requests are balanced across servers.  Servers that 
+// cant be connected are skipped.
+static void conn_open_servers(stash_t *stash)
+{
+	conn_t *conn;
+	list_t *closed;
+	
+	assert(stash);
+	assert(stash->connlist);
+	
+	// a failed login moves the connection to the end of the list, so collect 
+	// the ones to open before logging in to any of them.
+	closed = ll_init(NULL);
+	assert(closed);
+	ll_start(stash->connlist);
+	while ((conn = ll_next(stash->connlist))) {
+		if (conn->active == 0) {
+			ll_push_tail(closed, conn);
+		}
+	}
+	ll_finish(stash->connlist);
+	
+	while ((conn = ll_pop_head(closed))) {
+		assert(conn->handle < 0);
+		assert(conn->host && conn->port > 0);
+		if (conn_open(stash, conn) >= 0) {
+			conn->active = 1;
+			conn_login(stash, conn);
+		}
+	}
+	closed = ll_free(closed);
+	assert(closed == NULL);
+}
+
+
+// Balance read-only requests (queries and id lookups) across all the servers 
+// that were added, sending each to the one with the lowest average latency.  Writes 
+// still go to the preferred server.  If we are already connected, then the 
+// other servers are connected straight away.
+void stash_balance_reads(stash_t *stash, int enable)
+{
+	conn_t *conn;
+	
+	assert(stash);
+	assert(enable == 0 || enable == 1);
+	stash->balance_reads = enable;
+	
+	assert(stash->connlist);
+	conn = ll_get_head(stash->connlist);
+	if (enable && conn && conn->active) {
+		conn_open_servers(stash);
+	}
+}
+
+
 // do nothing if we are already connected.  If we are not connected, then go 
 // through the list for the best one and connect to it.  Since we are setup 
 // for blocking acticity, we will wait until the connect succeeds or fails.
@@ -941,7 +3224,6 @@ stash_result_t stash_connect(stash_t *stash)
 {
 	stash_result_t res = STASH_ERR_OK;
 	conn_t *conn;
-	stash_reply_t *reply = NULL;
 	
 	// TODO: need to go thru the list for the best candidate.
 	
@@ -967,7 +3249,7 @@ stash_result_t stash_connect(stash_t *stash)
 		assert(conn->host);
 		assert(conn->port > 0);
 		if (conn->handle < 0) {
-			conn->handle = sock_connect(conn->host, conn->port);
+			conn_open(stash, conn);
 			assert(res == STASH_ERR_OK);
 		}
 		
@@ -980,35 +3262,14 @@ stash_result_t stash_connect(stash_t *stash)
 			conn->active = 1;
 			
 			// if we have authority (which we should), we need to send off a login.
-			assert(stash->username && stash->password);
 			assert(stash->uid == 0);
+			res = conn_login(stash, conn);
 			
-			// get a buffer and bui
-			assert(stash->buf_set);
-			assert(BUF_LENGTH(stash->buf_set) == 0);
-			rispbuf_addStr(stash->buf_set, STASH_CMD_USERNAME, strlen(stash->username), stash->username);
-			rispbuf_addStr(stash->buf_set, STASH_CMD_PASSWORD, strlen(stash->password), stash->password);
-			
-			// send the request and receive the reply.
-			reply = send_request(stash, STASH_CMD_LOGIN, stash->buf_set);
-			
-			expbuf_clear(stash->buf_set);
-			
-			// process the reply and store the results in the data pointers that was provided.
-			if (reply->resultcode == STASH_ERR_OK) {
-				assert(reply->uid > 0);
-				stash->uid = reply->uid;
+			// if reads are balanced or hedged across the servers, connect to the others too.
+			if (res == STASH_ERR_OK && (stash->balance_reads || stash->hedge_percentile > 0)) {
 				assert(conn->active == 1);
-				assert(res == STASH_ERR_OK);
-			}
-			else {
-				res = reply->resultcode;
-				conn->active = 0;
+				conn_open_servers(stash);
 			}
-			
-			reply_free(reply);
-			
-			
 		}
 		
 		
@@ -1385,12 +3646,11 @@ void stash_free_value(stash_value_t *value)
 }
 
 
-void stash_build_value(expbuf_t *buf, stash_value_t *value)
+// add the value to the end of the buffer.
+static void append_value(expbuf_t *buf, stash_value_t *value)
 {
 	assert(buf && value);
 	
-	assert(BUF_LENGTH(buf) == 0);
-	
 	switch (value->valtype) {
 		
 		case STASH_VALTYPE_INT:
@@ -1428,16 +3688,23 @@ void stash_build_value(expbuf_t *buf, stash_value_t *value)
 		// 						...
 			break;
 	}
+}
+
+
+void stash_build_value(expbuf_t *buf, stash_value_t *value)
+{
+	assert(buf && value);
+	
+	assert(BUF_LENGTH(buf) == 0);
+	append_value(buf, value);
 	
 // 	printf("value len - %d\n", BUF_LENGTH(buf));
 }
 
 
-//-----------------------------------------------------------------------------
-// This is a pretty important function.  It needs to add a row into a table, 
-// and set the initial attributes.
-stash_reply_t *
-	stash_create_row(
+// build the request to create a row (with its initial attributes) into 
+// stash->buf_set.
+static void build_create_row(
 		stash_t *stash, 
 		stash_tableid_t tid, 
 		stash_nameid_t nameid, 
@@ -1445,7 +3712,6 @@ stash_reply_t *
 		stash_attrlist_t *alist,
 		stash_expiry_t expires)
 {
-	stash_reply_t *reply;
 	attr_t *attr;
 	
 	assert(stash);
@@ -1506,6 +3772,63 @@ stash_reply_t *
 	if (expires > 0) {
 		rispbuf_addInt(stash->buf_set, STASH_CMD_EXPIRES, expires);
 	}
+}
+
+
+//-----------------------------------------------------------------------------
+// This is a pretty important function.  It needs to add a row into a table, 
+// and set the initial attributes.
+stash_reply_t *
+	stash_create_row(
+		stash_t *stash, 
+		stash_tableid_t tid, 
+		stash_nameid_t nameid, 
+		const char *name, 
+		stash_attrlist_t *alist,
+		stash_expiry_t expires)
+{
+	stash_reply_t *reply;
+	
+	assert(stash);
+	
+	build_create_row(stash, tid, nameid, name, alist, expires);
+	
+	// send the request and receive the reply.
+	reply = send_request(stash, STASH_CMD_SET, stash->buf_set);
+	
+	expbuf_clear(stash->buf_set);
+	expbuf_clear(stash->buf_value);
+	expbuf_clear(stash->buf_attr);
+	
+	assert(reply);
+	return(reply);
+}
+
+
+//-----------------------------------------------------------------------------
+// Create the row, or if a row with that name already exists, set the 
+// attributes on it instead.  It is done on the server in one request.  The 
+// rowid is returned, and 'created' is set to 1 if the row was created, or 0 if 
+// an existing row was updated.
+stash_result_t 
+	stash_upsert(
+		stash_t *stash, 
+		stash_tableid_t tid, 
+		stash_nameid_t nameid, 
+		const char *name, 
+		stash_attrlist_t *alist,
+		stash_expiry_t expires,
+		stash_rowid_t *rowid,
+		int *created)
+{
+	stash_reply_t *reply;
+	stash_result_t res;
+	
+	assert(stash);
+	assert(rowid);
+	
+	build_create_row(stash, tid, nameid, name, alist, expires);
+	rispbuf_addCmd(stash->buf_set, STASH_CMD_OVERWRITE);
 	
 	// send the request and receive the reply.
 	reply = send_request(stash, STASH_CMD_SET, stash->buf_set);
@@ -1513,6 +3836,81 @@ stash_reply_t *
 	expbuf_clear(stash->buf_set);
 	expbuf_clear(stash->buf_value);
 	expbuf_clear(stash->buf_attr);
+	assert(reply);
+	
+	res = reply->resultcode;
+	if (res == STASH_ERR_OK) {
+		// the reply contains the row that was created or updated.
+		*rowid = 0;
+		if (stash_nextrow(reply) > 0) {
+			*rowid = stash_rowid(reply);
+		}
+		if (created) { *created = reply->created; }
+	}
+	stash_return_reply(reply);
+	
+	return(res);
+}
+
+
+//-----------------------------------------------------------------------------
+// Change the value of a key in a row on the server, without having to read it 
+// first.  The reply contains the row with the new value of the key.
+//
+//   STASH_UPDATE_INCREMENT      add the (integer) value.
+//   STASH_UPDATE_DECREMENT      subtract the (integer) value.
+//   STASH_UPDATE_APPEND         append the (string) value.
+//   STASH_UPDATE_SET_IF_ABSENT  set the value only if the key is not set.  If 
+//                               it is, the existing value is returned.
+//   STASH_UPDATE_COMPARE_SET    set the value only if the current value is 
+//                               'expected'.  Otherwise it fails with 
+//                               STASH_ERR_VALUEMISMATCH.
+//
+// The values are freed when the request has been sent.
+stash_reply_t * stash_update(stash_t *stash, stash_tableid_t tid, stash_rowid_t rowid, stash_keyid_t kid, int op, stash_value_t *value, stash_value_t *expected)
+{
+	stash_reply_t *reply;
+	
+	assert(stash);
+	assert(stash->curr_nsid > 0 && tid > 0 && rowid > 0 && kid > 0);
+	assert(value);
+	assert((op == STASH_UPDATE_COMPARE_SET && expected) || (op != STASH_UPDATE_COMPARE_SET && expected == NULL));
+	
+	assert(stash->buf_set);
+	assert(BUF_LENGTH(stash->buf_set) == 0);
+	assert(stash->buf_value);
+	assert(BUF_LENGTH(stash->buf_value) == 0);
+	
+	rispbuf_addInt(stash->buf_set, STASH_CMD_NAMESPACE_ID, stash->curr_nsid);
+	rispbuf_addInt(stash->buf_set, STASH_CMD_TABLE_ID, tid);
+	rispbuf_addInt(stash->buf_set, STASH_CMD_ROW_ID, rowid);
+	rispbuf_addInt(stash->buf_set, STASH_CMD_KEY_ID, kid);
+	
+	switch (op) {
+		case STASH_UPDATE_INCREMENT:     rispbuf_addCmd(stash->buf_set, STASH_CMD_OP_INCREMENT);     break;
+		case STASH_UPDATE_DECREMENT:     rispbuf_addCmd(stash->buf_set, STASH_CMD_OP_DECREMENT);     break;
+		case STASH_UPDATE_APPEND:        rispbuf_addCmd(stash->buf_set, STASH_CMD_OP_APPEND);        break;
+		case STASH_UPDATE_SET_IF_ABSENT: rispbuf_addCmd(stash->buf_set, STASH_CMD_OP_SET_IF_ABSENT); break;
+		case STASH_UPDATE_COMPARE_SET:   rispbuf_addCmd(stash->buf_set, STASH_CMD_OP_COMPARE_SET);   break;
+		default: assert(0); break;
+	}
+	
+	stash_build_value(stash->buf_value, value);
+	rispbuf_addBuffer(stash->buf_set, STASH_CMD_VALUE, stash->buf_value);
+	expbuf_clear(stash->buf_value);
+	
+	if (expected) {
+		stash_build_value(stash->buf_value, expected);
+		rispbuf_addBuffer(stash->buf_set, STASH_CMD_EXPECTED, stash->buf_value);
+		expbuf_clear(stash->buf_value);
+	}
+	
+	// send the request and receive the reply.
+	reply = send_request(stash, STASH_CMD_UPDATE, stash->buf_set);
+	expbuf_clear(stash->buf_set);
+	
+	stash_free_value(value);
+	if (expected) { stash_free_value(expected); }
 	
 	assert(reply);
 	return(reply);
@@ -1604,14 +4002,34 @@ static void free_row(replyrow_t *row)
 void stash_return_reply(stash_reply_t *reply)
 {
 	replyrow_t *row;
+	stash_reply_t *cached;
 	
 	assert(reply);
 	assert(reply->stash);
-	
 	assert(reply->rows);
-	while((row = ll_pop_head(reply->rows))) {
-		free_row(row);
-		free(row);
+	
+	if (reply->shared) {
+		// a reply from the query cache only has its own list of the cached 
+		// rows.  The cached reply stays until it has been dropped from the 
+		// cache and every reply reading its rows has been returned.
+		cached = reply->shared;
+		assert(cached->refs > 0);
+		while ((row = ll_pop_head(reply->rows))) {
+			assert(row->identifier == 0x1234);
+		}
+		reply->shared = NULL;
+		
+		cached->refs --;
+		if (cached->cached == 0 && cached->refs == 0) {
+			stash_return_reply(cached);
+		}
+	}
+	else {
+		assert(reply->cached == 0 && reply->refs == 0);
+		while((row = ll_pop_head(reply->rows))) {
+			free_row(row);
+			free(row);
+		}
 	}
 	
 	// put the reply back on the reply pool.
@@ -1745,7 +4163,8 @@ stash_cond_t * __cond_key_equals(stash_keyid_t kid, stash_value_t *value)
 	return(cond);
 }
 
-stash_cond_t * __cond_key_gt(stash_keyid_t kid, stash_value_t *value)
+// the ordered comparisons all have the same form, just a different condtype.
+static stash_cond_t * cond_compare(short int condtype, stash_keyid_t kid, stash_value_t *value)
 {
 	stash_cond_t *cond;
 	
@@ -1754,13 +4173,97 @@ stash_cond_t * __cond_key_gt(stash_keyid_t kid, stash_value_t *value)
 	cond = calloc(1, sizeof(*cond));
 	assert(cond);
 	
-	cond->condtype = STASH_CONDTYPE_GT;
+	cond->condtype = condtype;
 	cond->kid = kid;
 	cond->value = value;
 	
 	return(cond);
 }
 
+stash_cond_t * __cond_key_gt(stash_keyid_t kid, stash_value_t *value)
+{
+	return(cond_compare(STASH_CONDTYPE_GT, kid, value));
+}
+
+stash_cond_t * __cond_key_lt(stash_keyid_t kid, stash_value_t *value)
+{
+	return(cond_compare(STASH_CONDTYPE_LT, kid, value));
+}
+
+stash_cond_t * __cond_key_ge(stash_keyid_t kid, stash_value_t *value)
+{
+	return(cond_compare(STASH_CONDTYPE_GE, kid, value));
+}
+
+stash_cond_t * __cond_key_le(stash_keyid_t kid, stash_value_t *value)
+{
+	return(cond_compare(STASH_CONDTYPE_LE, kid, value));
+}
+
+// low and high are both inclusive.
+stash_cond_t * __cond_key_between(stash_keyid_t kid, stash_value_t *low, stash_value_t *high)
+{
+	stash_cond_t *cond;
+	
+	assert(kid > 0 && low && high);
+	
+	cond = cond_compare(STASH_CONDTYPE_BETWEEN, kid, low);
+	assert(cond);
+	cond->upper = high;
+	
+	return(cond);
+}
+
+
+
+// match any row where the key has one of the values.  The condition takes 
+// ownership of the values (but not the array).
+stash_cond_t * __cond_key_in(stash_keyid_t kid, stash_value_t *values[], int n)
+{
+	stash_cond_t *cond;
+	int i;
+	
+	assert(kid > 0 && values && n > 0);
+	
+	cond = calloc(1, sizeof(*cond));
+	assert(cond);
+	
+	cond->condtype = STASH_CONDTYPE_IN;
+	cond->kid = kid;
+	cond->count = n;
+	cond->values = malloc(sizeof(stash_value_t *) * n);
+	assert(cond->values);
+	for (i=0; i<n; i++) {
+		assert(values[i]);
+		cond->values[i] = values[i];
+	}
+	
+	return(cond);
+}
+
+
+// match any row that has one of the names.  The names are copied.
+stash_cond_t * __cond_name_in(const char *names[], int n)
+{
+	stash_cond_t *cond;
+	int i;
+	
+	assert(names && n > 0);
+	
+	cond = calloc(1, sizeof(*cond));
+	assert(cond);
+	
+	cond->condtype = STASH_CONDTYPE_NAME_IN;
+	cond->count = n;
+	cond->names = malloc(sizeof(char *) * n);
+	assert(cond->names);
+	for (i=0; i<n; i++) {
+		assert(names[i]);
+		cond->names[i] = strdup(names[i]);
+	}
+	
+	return(cond);
+}
 
 
 stash_cond_t * __cond_key_exists(stash_keyid_t kid)
@@ -1849,19 +4352,49 @@ stash_cond_t * __cond_not(stash_cond_t *aa)
 // Free a compound condition.  Recursively free the condition structure.
 void stash_cond_free(stash_cond_t *cond)
 {
+	int i;
+	
 	assert(cond);
 	
 	switch(cond->condtype) {
 		case STASH_CONDTYPE_EQUALS:
+		case STASH_CONDTYPE_GT:
+		case STASH_CONDTYPE_LT:
+		case STASH_CONDTYPE_GE:
+		case STASH_CONDTYPE_LE:
 			assert(cond->kid > 0);
 			assert(cond->value);
+			assert(cond->upper == NULL);
+			stash_free_value(cond->value);
+			break;
+			
+		case STASH_CONDTYPE_BETWEEN:
+			assert(cond->kid > 0);
+			assert(cond->value && cond->upper);
 			stash_free_value(cond->value);
+			stash_free_value(cond->upper);
 			break;
 			
 		case STASH_CONDTYPE_NAME:
 			if (cond->name) free(cond->name);
 			break;
 			
+		case STASH_CONDTYPE_IN:
+			assert(cond->count > 0 && cond->values);
+			for (i=0; i<cond->count; i++) {
+				stash_free_value(cond->values[i]);
+			}
+			free(cond->values);
+			break;
+			
+		case STASH_CONDTYPE_NAME_IN:
+			assert(cond->count > 0 && cond->names);
+			for (i=0; i<cond->count; i++) {
+				free(cond->names[i]);
+			}
+			free(cond->names);
+			break;
+			
 		case STASH_CONDTYPE_AND:
 		case STASH_CONDTYPE_OR:
 			assert(cond->ca);
@@ -1869,6 +4402,12 @@ void stash_cond_free(stash_cond_t *cond)
 			stash_cond_free(cond->ca);
 			stash_cond_free(cond->cb);
 			break;
+			
+		case STASH_CONDTYPE_NOT:
+			assert(cond->ca);
+			assert(cond->cb == NULL);
+			stash_cond_free(cond->ca);
+			break;
 
 		case STASH_CONDTYPE_EXISTS:
 			assert(cond->kid > 0);
@@ -1892,11 +4431,14 @@ static void build_condition(expbuf_t *buffer, stash_cond_t *condition)
 {
 	expbuf_t *buf;
 	expbuf_t *buf_value;
+	int i;
 	assert(buffer && condition);
 
 	buf = expbuf_init(NULL, 64);
 	
-	if (condition->condtype == STASH_CONDTYPE_EQUALS) {
+	if (condition->condtype == STASH_CONDTYPE_EQUALS 
+		|| condition->condtype == STASH_CONDTYPE_GT || condition->condtype == STASH_CONDTYPE_LT 
+		|| condition->condtype == STASH_CONDTYPE_GE || condition->condtype == STASH_CONDTYPE_LE) {
 		
 		assert(condition->kid > 0);
 		rispbuf_addInt(buf, STASH_CMD_KEY_ID, condition->kid);
@@ -1908,8 +4450,32 @@ static void build_condition(expbuf_t *buffer, stash_cond_t *condition)
 		buf_value = expbuf_free(buf_value);
 		assert(buf_value == NULL);
 		
-		rispbuf_addBuffer(buffer, STASH_CMD_COND_EQUALS, buf);
+		switch (condition->condtype) {
+			case STASH_CONDTYPE_EQUALS: rispbuf_addBuffer(buffer, STASH_CMD_COND_EQUALS, buf); break;
+			case STASH_CONDTYPE_GT:     rispbuf_addBuffer(buffer, STASH_CMD_COND_GT, buf);     break;
+			case STASH_CONDTYPE_LT:     rispbuf_addBuffer(buffer, STASH_CMD_COND_LT, buf);     break;
+			case STASH_CONDTYPE_GE:     rispbuf_addBuffer(buffer, STASH_CMD_COND_GE, buf);     break;
+			case STASH_CONDTYPE_LE:     rispbuf_addBuffer(buffer, STASH_CMD_COND_LE, buf);     break;
+			default: assert(0); break;
+		}
+	}
+	else if (condition->condtype == STASH_CONDTYPE_BETWEEN) {
+		
+		// the low value goes in COND_A, and the high value in COND_B.
+		assert(condition->kid > 0);
+		rispbuf_addInt(buf, STASH_CMD_KEY_ID, condition->kid);
+		
+		assert(condition->value && condition->upper);
+		buf_value = expbuf_init(NULL, 0);
+		stash_build_value(buf_value, condition->value);
+		rispbuf_addBuffer(buf, STASH_CMD_COND_A, buf_value);
+		expbuf_clear(buf_value);
+		stash_build_value(buf_value, condition->upper);
+		rispbuf_addBuffer(buf, STASH_CMD_COND_B, buf_value);
+		buf_value = expbuf_free(buf_value);
+		assert(buf_value == NULL);
 		
+		rispbuf_addBuffer(buffer, STASH_CMD_COND_BETWEEN, buf);
 	}
 	else if (condition->condtype == STASH_CONDTYPE_NAME) {
 		
@@ -1957,6 +4523,26 @@ static void build_condition(expbuf_t *buffer, stash_cond_t *condition)
 		build_condition(buf, condition->ca);
 		rispbuf_addBuffer(buffer, STASH_CMD_COND_NOT, buf);
 	}
+	else if (condition->condtype == STASH_CONDTYPE_IN) {
+		
+		// a flat list.  The values are added directly (without a VALUE 
+		// wrapper around each one) to keep it compact.
+		assert(condition->kid > 0);
+		assert(condition->count > 0 && condition->values);
+		rispbuf_addInt(buf, STASH_CMD_KEY_ID, condition->kid);
+		for (i=0; i<condition->count; i++) {
+			append_value(buf, condition->values[i]);
+		}
+		rispbuf_addBuffer(buffer, STASH_CMD_COND_IN, buf);
+	}
+	else if (condition->condtype == STASH_CONDTYPE_NAME_IN) {
+		
+		assert(condition->count > 0 && condition->names);
+		for (i=0; i<condition->count; i++) {
+			rispbuf_addStr(buf, STASH_CMD_NAME, strlen(condition->names[i]), condition->names[i]);
+		}
+		rispbuf_addBuffer(buffer, STASH_CMD_COND_NAME_IN, buf);
+	}
 	else if (condition->condtype == STASH_CONDTYPE_EXISTS) {
 		
 		assert(condition->kid > 0);
@@ -2099,6 +4685,10 @@ void stash_sort(stash_reply_t *reply, stash_sortentry_t *sort)
 	
 	assert(reply && sort);
 	
+	// the cached reply itself is never handed out.  Replies from the cache have 
+	// their own list of its rows, so they can be sorted without changing it.
+	assert(reply->cached == 0);
+	
 	if (reply->rows) {
 		total = ll_count(reply->rows);
 		if (total > 0) {
@@ -2130,10 +4720,6 @@ void stash_sort(stash_reply_t *reply, stash_sortentry_t *sort)
 			// put the rows back into the list.
 			for (i=0; i<total; i++) {
 				assert(list[i]);
-				
-				// reset the 'done' marker because it has been sorted, and we start iterating through the list again.
-				list[i]->done = 0;
-				
 				ll_push_tail(reply->rows, list[i]);
 			}
 			
@@ -2178,6 +4764,10 @@ stash_query_t * stash_query_new(stash_tableid_t tid)
 	assert(query->limit == 0);
 	assert(query->condition == NULL);
 	assert(query->sort == NULL);
+	assert(query->select == NULL && query->select_count == 0);
+	assert(query->agg_op == STASH_AGG_NONE);
+	assert(query->cont == NULL);
+	assert(query->previous == NULL);
 	
 	return(query);
 }
@@ -2202,6 +4792,16 @@ void stash_query_free(stash_query_t *query)
 {
 	assert(query);
 	stash_query_sort_clear(query);
+	if (query->select) {
+		assert(query->select_count > 0);
+		free(query->select);
+	}
+	if (query->cont) {
+		free(query->cont);
+	}
+	if (query->previous) {
+		stash_return_reply(query->previous);
+	}
 	free(query);
 }
 
@@ -2249,7 +4849,156 @@ void stash_query_sort(stash_query_t *query, stash_keyid_t kid, int desc)
 }
 
 
-
+
+
+
+// add a key to the list of attributes that will be returned for each row.  If 
+// no keys are selected, then all the attributes are returned.
+void stash_query_select(stash_query_t *query, stash_keyid_t kid)
+{
+	int i;
+	
+	assert(query && kid > 0);
+	
+	// dont add the same key twice.
+	for (i=0; i<query->select_count; i++) {
+		if (query->select[i] == kid) { return; }
+	}
+	
+	query->select = realloc(query->select, sizeof(stash_keyid_t) * (query->select_count + 1));
+	assert(query->select);
+	query->select[query->select_count] = kid;
+	query->select_count ++;
+}
+
+
+// instead of returning the matching rows, the server will calculate an 
+// aggregate over them, and only return that.  For STASH_AGG_COUNT the key is 
+// optional (if supplied, only rows that have the key are counted).  The 
+// results come back as one row per group (see stash_query_group_by), with the 
+// number of rows it was calculated over (stash_getcount) and the aggregate as 
+// an attribute with the same key.  The group rows are not stored rows, so they 
+// have no rowid or name (the format is described in stash.h).
+void stash_query_aggregate(stash_query_t *query, int op, stash_keyid_t kid)
+{
+	assert(query);
+	assert(op == STASH_AGG_COUNT || op == STASH_AGG_SUM || op == STASH_AGG_MIN || op == STASH_AGG_MAX);
+	assert((op == STASH_AGG_COUNT && kid >= 0) || kid > 0);
+	
+	query->agg_op = op;
+	query->agg_kid = kid;
+}
+
+
+// group the aggregate by the values of the key.  Each group row will have the 
+// group key as an attribute.
+void stash_query_group_by(stash_query_t *query, stash_keyid_t kid)
+{
+	assert(query && kid > 0);
+	query->agg_group = kid;
+}
+
+
+// after executing a query with a limit, this will set the query to fetch the 
+// next page, resuming after the last row that was returned.  Returns 1 if there 
+// are more rows to get, and 0 if that was the last page (in which case the 
+// query is reset to start from the beginning again).
+//
+// The token is opaque to the client.  The server records the position in it as 
+// the sort values and rowid of the last row, rather than a count of rows, so 
+// rows that are added or removed before that point don't shift the next page.
+int stash_query_continue(stash_query_t *query, stash_reply_t *reply)
+{
+	assert(query && reply);
+	assert(query->limit > 0);
+	
+	if (query->cont) {
+		assert(query->cont_len > 0);
+		free(query->cont);
+		query->cont = NULL;
+		query->cont_len = 0;
+	}
+	
+	if (reply->cont == NULL) {
+		assert(reply->cont_len == 0);
+		return(0);
+	}
+	else {
+		// take the token from the reply rather than copying it.
+		assert(reply->cont_len > 0);
+		query->cont = reply->cont;
+		query->cont_len = reply->cont_len;
+		reply->cont = NULL;
+		reply->cont_len = 0;
+		return(1);
+	}
+}
+
+
+// give the query the reply from the last time it was executed.  The server 
+// is asked to only send the rows again if the result has changed, and if it 
+// hasn't, stash_query_execute() hands back this same reply.  Either way the 
+// query takes the reply, and the caller only has the one that is returned.
+void stash_query_if_modified(stash_query_t *query, stash_reply_t *reply)
+{
+	assert(query && reply);
+	assert(reply != query->previous);
+	assert(reply->cached == 0);
+	
+	if (query->previous) {
+		stash_return_reply(query->previous);
+	}
+	query->previous = reply;
+}
+
+
+// internal function that will build the aggregate details.
+static void build_aggregate(expbuf_t *buf, stash_query_t *query)
+{
+	assert(buf && query);
+	
+	switch (query->agg_op) {
+		case STASH_AGG_COUNT: rispbuf_addCmd(buf, STASH_CMD_AGG_COUNT); break;
+		case STASH_AGG_SUM:   rispbuf_addCmd(buf, STASH_CMD_AGG_SUM);   break;
+		case STASH_AGG_MIN:   rispbuf_addCmd(buf, STASH_CMD_AGG_MIN);   break;
+		case STASH_AGG_MAX:   rispbuf_addCmd(buf, STASH_CMD_AGG_MAX);   break;
+		default: assert(0); break;
+	}
+	
+	if (query->agg_kid > 0) {
+		rispbuf_addInt(buf, STASH_CMD_KEY_ID, query->agg_kid);
+	}
+	if (query->agg_group > 0) {
+		rispbuf_addInt(buf, STASH_CMD_GROUP_KEY_ID, query->agg_group);
+	}
+}
+
+
+// internal function that will build the list of keys that should be returned.  
+// If the rows will be sorted on the client side, then the sort keys need to 
+// come back as well, even if they were not selected.
+static void build_select(expbuf_t *buf, stash_query_t *query)
+{
+	stash_sortentry_t *curr;
+	int i;
+	
+	assert(buf && query);
+	assert(query->select && query->select_count > 0);
+	
+	for (i=0; i<query->select_count; i++) {
+		assert(query->select[i] > 0);
+		rispbuf_addInt(buf, STASH_CMD_KEY_ID, query->select[i]);
+	}
+	
+	if (query->limit <= 0) {
+		for (curr=query->sort; curr; curr=curr->next) {
+			for (i=0; i<query->select_count && query->select[i] != curr->kid; i++) {}
+			if (i == query->select_count) {
+				rispbuf_addInt(buf, STASH_CMD_KEY_ID, curr->kid);
+			}
+		}
+	}
+}
 
 
 // internal function that will take a sort structure and create RISP commands 
@@ -2292,12 +5041,19 @@ stash_reply_t * stash_query_execute(stash_t *stash, stash_query_t *query)
 	stash_reply_t *reply;
 	expbuf_t *buf_cond = NULL;
 	expbuf_t *buf_sort = NULL;
+	expbuf_t *buf_select = NULL;
+	expbuf_t *buf_agg = NULL;
 	expbuf_t *buf_query = NULL;
+	expbuf_t *buf_key;
+	stash_reply_t *previous;
+	long long started = 0, encoded = 0;
 	
 	
 	assert(stash && query);
 	assert(stash->curr_nsid > 0 && query->tid > 0 && query->limit >= 0);
 	
+	if (stash->profiling) { started = now_nsec(); }
+	
 	buf_query = expbuf_init(NULL, 0);
 	
 	// build the rest of the message.
@@ -2318,6 +5074,30 @@ stash_reply_t * stash_query_execute(stash_t *stash, stash_query_t *query)
 		assert(buf_cond == NULL);
 	}
 	
+	assert(query->agg_group == 0 || query->agg_op != STASH_AGG_NONE);
+	if (query->agg_op != STASH_AGG_NONE) {
+		// the server does the work, and only the aggregate values come back.  
+		// The rows are not returned, so there is nothing to select.
+		buf_agg = expbuf_init(NULL, 32);
+		build_aggregate(buf_agg, query);
+		
+		rispbuf_addBuffer(buf_query, STASH_CMD_AGGREGATE, buf_agg);
+		
+		buf_agg = expbuf_free(buf_agg);
+		assert(buf_agg == NULL);
+	}
+	else if (query->select_count > 0) {
+		// only the selected keys will be returned, so less to send and decode.
+		buf_select = expbuf_init(NULL, 32);
+		build_select(buf_select, query);
+		assert(BUF_LENGTH(buf_select) > 0);
+		
+		rispbuf_addBuffer(buf_query, STASH_CMD_SELECT, buf_select);
+		
+		buf_select = expbuf_free(buf_select);
+		assert(buf_select == NULL);
+	}
+	
 	if (query->limit > 0) {
 	
 		rispbuf_addInt(buf_query, STASH_CMD_LIMIT, query->limit);
@@ -2338,14 +5118,63 @@ stash_reply_t * stash_query_execute(stash_t *stash, stash_query_t *query)
 			buf_sort = expbuf_free(buf_sort);
 			assert(buf_sort == NULL);
 		}
+		
+		if (query->cont) {
+			// continue from where the previous page finished.
+			assert(query->cont_len > 0);
+			rispbuf_addStr(buf_query, STASH_CMD_CONTINUE, query->cont_len, query->cont);
+		}
+	}
+	
+	// the previous result is only any use if the server versioned it.
+	previous = query->previous;
+	query->previous = NULL;
+	if (previous && previous->version > 0 && query->cont == NULL) {
+		rispbuf_addInt(buf_query, STASH_CMD_IF_VERSION, previous->version);
+	}
+	
+	if (stash->profiling) { encoded = now_nsec(); }
+	
+	// a sort done on the client changes the reply without changing the 
+	// request, so the cache needs it added to the key.
+	buf_key = buf_query;
+	if (stash->cache && query->sort && query->limit <= 0) {
+		buf_key = expbuf_init(NULL, BUF_LENGTH(buf_query) + 64);
+		expbuf_add(buf_key, BUF_DATA(buf_query), BUF_LENGTH(buf_query));
+		
+		assert(buf_sort == NULL);
+		buf_sort = expbuf_init(NULL, 64);
+		build_sort(buf_sort, query->sort);
+		rispbuf_addBuffer(buf_key, STASH_CMD_SORT, buf_sort);
+		buf_sort = expbuf_free(buf_sort);
+		assert(buf_sort == NULL);
+	}
+	
+	// pages of a larger result are not cached, and a conditional query 
+	// already has its own copy of the result.
+	if (stash->cache && query->cont == NULL && previous == NULL) {
+		reply = cache_lookup(stash, buf_key);
+		if (reply) {
+			if (buf_key != buf_query) {
+				buf_key = expbuf_free(buf_key);
+				assert(buf_key == NULL);
+			}
+			buf_query = expbuf_free(buf_query);
+			assert(buf_query == NULL);
+			return(reply);
+		}
 	}
 	
 	// send it.
 	reply = send_request(stash, STASH_CMD_QUERY, buf_query);
 	assert(reply);
-
-	buf_query = expbuf_free(buf_query);
-	assert(buf_query == NULL);
+	
+	if (stash->profiling) { reply->profile.encode = encoded - started; }
+	
+	// aggregate group rows do not have names or rowids.
+	if (query->agg_op != STASH_AGG_NONE) {
+		reply->aggregate = 1;
+	}
 	
 	
 	if (query->sort && query->limit <= 0) {
@@ -2353,9 +5182,37 @@ stash_reply_t * stash_query_execute(stash_t *stash, stash_query_t *query)
 		// the client side, and did not send sorting information to the server.  
 		// Therefore, we have to do the sort here, now that we have all the data.
 		
+		if (stash->profiling) { started = now_nsec(); }
 		stash_sort(reply, query->sort);
+		if (stash->profiling) { reply->profile.sort = now_nsec() - started; }
+	}
+	
+	if (previous) {
+		if (reply->resultcode == STASH_ERR_OK && reply->not_modified) {
+			// nothing has changed, so the rows we already have are handed back, 
+			// with the profile of the request that was just made.
+			assert(reply->row_count == 0);
+			stash->stats.not_modified ++;
+			memcpy(&previous->profile, &reply->profile, sizeof(previous->profile));
+			stash_return_reply(reply);
+			reply = previous;
+			stash_reply_reset(reply);
+			reply->not_modified = 1;
+		}
+		else {
+			stash_return_reply(previous);
+		}
+	}
+	else if (stash->cache && query->cont == NULL && reply->resultcode == STASH_ERR_OK && reply->cont == NULL) {
+		reply = cache_insert(stash, buf_key, query->tid, reply);
 	}
 	
+	if (buf_key != buf_query) {
+		buf_key = expbuf_free(buf_key);
+		assert(buf_key == NULL);
+	}
+	buf_query = expbuf_free(buf_query);
+	assert(buf_query == NULL);
 	
 	// return the reply;
 	return(reply);
@@ -2388,6 +5245,127 @@ stash_reply_t * stash_query(stash_t *stash, stash_tableid_t tid, int limit, stas
 }
 
 
+static int rowid_fn(const void *a, const void *b)
+{
+	replyrow_t * const *ra = a;
+	replyrow_t * const *rb = b;
+	
+	assert(a && b);
+	return((*ra)->rid - (*rb)->rid);
+}
+
+
+// the server returns the rows in whatever order it finds them.  Put them in 
+// the order that the rowids were asked for.  Rows that were asked for more 
+// than once are only returned once.
+static void reply_order(stash_reply_t *reply, stash_rowid_t rowids[], int n)
+{
+	int total, i;
+	replyrow_t **list;
+	replyrow_t key, *keyptr, **found;
+	
+	assert(reply && rowids && n > 0);
+	assert(reply->rows);
+	
+	total = ll_count(reply->rows);
+	if (total == 0) { return; }
+	
+	list = calloc(total, sizeof(replyrow_t *));
+	assert(list);
+	for (i=0; i<total; i++) {
+		list[i] = ll_pop_head(reply->rows);
+		assert(list[i]);
+		assert(list[i]->identifier == 0x1234);
+	}
+	assert(ll_count(reply->rows) == 0);
+	
+	qsort(list, total, sizeof(replyrow_t *), rowid_fn);
+	
+	// the rows are sorted by rowid, so each one can be found quickly.  Once a 
+	// row has been put back in the list, the 'done' marker is set so that it 
+	// isn't added twice.
+	keyptr = &key;
+	for (i=0; i<n; i++) {
+		key.rid = rowids[i];
+		found = bsearch(&keyptr, list, total, sizeof(replyrow_t *), rowid_fn);
+		if (found && (*found)->done == 0) {
+			(*found)->done = 1;
+			ll_push_tail(reply->rows, *found);
+		}
+	}
+	
+	// reset the markers, and free any rows that weren't asked for.
+	for (i=0; i<total; i++) {
+		if (list[i]->done) {
+			list[i]->done = 0;
+		}
+		else {
+			free_row(list[i]);
+			free(list[i]);
+		}
+	}
+	free(list);
+	
+	reply->row_count = ll_count(reply->rows);
+	reply->curr_row = -1;
+}
+
+
+//-----------------------------------------------------------------------------
+// get a number of rows by their rowid in one request.  If keys are supplied, 
+// only those attributes are returned.  The rows in the reply are in the same 
+// order as the rowids (rows that do not exist are skipped).
+stash_reply_t * stash_get_rows(stash_t *stash, stash_tableid_t tid, stash_rowid_t rowids[], int n, stash_keyid_t keys[], int nkeys)
+{
+	stash_reply_t *reply;
+	expbuf_t *buf_query;
+	expbuf_t *buf_list;
+	int i;
+	
+	assert(stash);
+	assert(stash->curr_nsid > 0 && tid > 0);
+	assert(rowids && n > 0);
+	assert((keys && nkeys > 0) || (keys == NULL && nkeys == 0));
+	
+	buf_query = expbuf_init(NULL, 0);
+	buf_list = expbuf_init(NULL, n * 5);
+	
+	rispbuf_addInt(buf_query, STASH_CMD_NAMESPACE_ID, stash->curr_nsid);
+	rispbuf_addInt(buf_query, STASH_CMD_TABLE_ID, tid);
+	
+	for (i=0; i<n; i++) {
+		assert(rowids[i] > 0);
+		rispbuf_addInt(buf_list, STASH_CMD_ROW_ID, rowids[i]);
+	}
+	rispbuf_addBuffer(buf_query, STASH_CMD_ROW_LIST, buf_list);
+	
+	if (nkeys > 0) {
+		expbuf_clear(buf_list);
+		for (i=0; i<nkeys; i++) {
+			assert(keys[i] > 0);
+			rispbuf_addInt(buf_list, STASH_CMD_KEY_ID, keys[i]);
+		}
+		rispbuf_addBuffer(buf_query, STASH_CMD_SELECT, buf_list);
+	}
+	
+	buf_list = expbuf_free(buf_list);
+	assert(buf_list == NULL);
+	
+	// it is a query, so it can go to any server.
+	reply = send_request(stash, STASH_CMD_QUERY, buf_query);
+	assert(reply);
+	
+	buf_query = expbuf_free(buf_query);
+	assert(buf_query == NULL);
+	
+	if (reply->resultcode == STASH_ERR_OK) {
+		reply_order(reply, rowids, n);
+	}
+	
+	return(reply);
+}
+
+
 stash_result_t stash_get_user_id(stash_t *stash, const char *username, stash_userid_t *uid)
 {
 	stash_result_t res;
@@ -2456,7 +5434,8 @@ stash_result_t stash_get_table_id(stash_t *stash, const char *tablename, stash_t
 //-----------------------------------------------------------------------------
 // given a fully fleshed out reply object.  Go to the next row in the list.  
 // If there are no rows, then return 0.  If there is an available row, then 
-// return the rowid (non-zero).
+// return the rowid (non-zero).  Aggregate groups are not stored rows and have 
+// no rowid, so for them it is the position of the group in the reply instead.
 int stash_nextrow(stash_reply_t *reply)
 {
 	replyrow_t *row;
@@ -2479,10 +5458,8 @@ int stash_nextrow(stash_reply_t *reply)
 			assert(reply->rows);
 			row = ll_get_head(reply->rows);
 			assert(row);
-			assert(row->nid > 0);
-			assert(row->rid > 0);
-			rowid = row->rid;
-			row->done = 1;
+			assert((row->nid > 0 && row->rid > 0) || reply->aggregate);
+			rowid = reply->aggregate ? 1 : row->rid;
 			
 			reply->curr_row = 1;
 		}
@@ -2500,19 +5477,16 @@ int stash_nextrow(stash_reply_t *reply)
 		assert(reply->rows);
 		row = ll_pop_head(reply->rows);
 		assert(row);
-		assert(row->done == 1);
 		ll_push_tail(reply->rows, row);
 		
-		// now look at the row at the top of the list and mark it so that we know that we've seen this row.
+		// now look at the row at the top of the list.  The rows are not marked, 
+		// because the rows of a cached reply are read through more than one reply.
 		row = ll_get_head(reply->rows);
 		assert(row);
-		assert(row->done == 0);
-		row->done = 1;
-		assert(row->nid > 0);
-		assert(row->rid > 0);
-		rowid = row->rid;
+		assert((row->nid > 0 && row->rid > 0) || reply->aggregate);
 		
 		reply->curr_row ++;
+		rowid = reply->aggregate ? reply->curr_row : row->rid;
 		assert(reply->curr_row > 0 && reply->curr_row <= reply->row_count);
 	}
 	
@@ -2532,8 +5506,7 @@ const char * stash_getstr(stash_reply_t *reply, stash_keyid_t key)
 	
 	assert(reply->rows);
 	row = ll_get_head(reply->rows);
-	assert(row->rid > 0);
-	assert(row->done == 1);
+	assert(row->rid > 0 || reply->aggregate);
 	assert(row->attrlist);
 	
 	ll_start(row->attrlist);
@@ -2572,8 +5545,7 @@ int stash_getlength(stash_reply_t *reply, stash_keyid_t key)
 	
 	assert(reply->rows);
 	row = ll_get_head(reply->rows);
-	assert(row->rid > 0);
-	assert(row->done == 1);
+	assert(row->rid > 0 || reply->aggregate);
 	assert(row->attrlist);
 	
 	ll_start(row->attrlist);
@@ -2613,8 +5585,7 @@ int stash_getint(stash_reply_t *reply, stash_keyid_t key)
 	
 	assert(reply->rows);
 	row = ll_get_head(reply->rows);
-	assert(row->rid > 0);
-	assert(row->done == 1);
+	assert(row->rid > 0 || reply->aggregate);
 	assert(row->attrlist);
 	
 	ll_start(row->attrlist);
@@ -2642,7 +5613,28 @@ int stash_getint(stash_reply_t *reply, stash_keyid_t key)
 }
 
 
-// returns the rowid for the current row in the reply.
+// returns the number of stored rows that the current row represents.  For an 
+// aggregate query, this is the number of rows in the group that the aggregate 
+// was calculated over.
+int stash_getcount(stash_reply_t *reply)
+{
+	replyrow_t *row;
+	
+	assert(reply);
+	assert(reply->row_count > 0);
+	assert(reply->curr_row > 0 && reply->curr_row <= reply->row_count);
+	
+	assert(reply->rows);
+	row = ll_get_head(reply->rows);
+	assert(row->rid > 0 || reply->aggregate);
+	assert(row->count >= 0);
+	
+	return(row->count);
+}
+
+
+// returns the rowid for the current row in the reply.  Aggregate groups don't 
+// have one, so it will be 0.
 stash_rowid_t stash_rowid(stash_reply_t *reply)
 {
 	replyrow_t *row;
@@ -2653,7 +5645,7 @@ stash_rowid_t stash_rowid(stash_reply_t *reply)
 	
 	assert(reply->rows);
 	row = ll_get_head(reply->rows);
-	assert(row->rid > 0);
+	assert(row->rid > 0 || reply->aggregate);
 	
 	return(row->rid);
 }
@@ -2706,7 +5698,6 @@ stash_reply_t * stash_delete(stash_t *stash, stash_tableid_t tid, stash_rowid_t
 	rispbuf_addInt(stash->buf_set, STASH_CMD_KEY_ID, keyid);
 	
 	// send the request and receive the reply.
-	printf("sending DELETE cmd\n");
 	reply = send_request(stash, STASH_CMD_DELETE, stash->buf_set);
 	expbuf_clear(stash->buf_set);
 	assert(reply);
@@ -2716,15 +5707,306 @@ stash_reply_t * stash_delete(stash_t *stash, stash_tableid_t tid, stash_rowid_t
 
 
 
+// send a request that acts on all the rows that match the condition.  If 
+// 'count' is not NULL, it is set to the number of rows affected.
+static stash_result_t send_where(stash_t *stash, risp_command_t cmd, stash_tableid_t tid, stash_cond_t *cond, stash_keyid_t keyid, stash_expiry_t expires, int *count)
+{
+	stash_reply_t *reply;
+	stash_result_t res;
+	expbuf_t *buf_cond;
+	
+	assert(stash && cond);
+	assert(stash->curr_nsid > 0 && tid > 0);
+	assert(cmd == STASH_CMD_DELETE_WHERE || cmd == STASH_CMD_EXPIRE_WHERE);
+	
+	assert(stash->buf_set);
+	assert(BUF_LENGTH(stash->buf_set) == 0);
+	
+	rispbuf_addInt(stash->buf_set, STASH_CMD_NAMESPACE_ID, stash->curr_nsid);
+	rispbuf_addInt(stash->buf_set, STASH_CMD_TABLE_ID, tid);
+	if (keyid > 0) {
+		rispbuf_addInt(stash->buf_set, STASH_CMD_KEY_ID, keyid);
+	}
+	if (cmd == STASH_CMD_EXPIRE_WHERE) {
+		rispbuf_addInt(stash->buf_set, STASH_CMD_EXPIRES, expires);
+	}
+	
+	buf_cond = expbuf_init(NULL, 0);
+	build_condition(buf_cond, cond);
+	assert(BUF_LENGTH(buf_cond) > 0);
+	rispbuf_addBuffer(stash->buf_set, STASH_CMD_CONDITION, buf_cond);
+	buf_cond = expbuf_free(buf_cond);
+	assert(buf_cond == NULL);
+	
+	// send the request and receive the reply.  The number of rows affected 
+	// comes back as the COUNT, and there are no rows.
+	reply = send_request(stash, cmd, stash->buf_set);
+	expbuf_clear(stash->buf_set);
+	assert(reply);
+	
+	res = reply->resultcode;
+	if (res == STASH_ERR_OK) {
+		assert(reply->rows && ll_count(reply->rows) == 0);
+		if (count) { *count = reply->row_count; }
+	}
+	stash_return_reply(reply);
+	
+	return(res);
+}
+
+
+// delete all the rows in the table that match the condition.  If 'count' is 
+// not NULL, it is set to the number of rows deleted.
+stash_result_t stash_delete_where(stash_t *stash, stash_tableid_t tid, stash_cond_t *cond, int *count)
+{
+	assert(stash && tid > 0 && cond);
+	return(send_where(stash, STASH_CMD_DELETE_WHERE, tid, cond, 0, 0, count));
+}
+
+
+// set the expiry on all the rows in the table that match the condition (or 
+// just on the key within those rows if keyid is not 0).  If 'count' is not 
+// NULL, it is set to the number of rows affected.
+stash_result_t stash_expire_where(stash_t *stash, stash_tableid_t tid, stash_cond_t *cond, stash_keyid_t keyid, stash_expiry_t expires, int *count)
+{
+	assert(stash && tid > 0 && cond);
+	assert(keyid >= 0 && expires >= 0);
+	return(send_where(stash, STASH_CMD_EXPIRE_WHERE, tid, cond, keyid, expires, count));
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Locksets.  A number of rows are locked together in one request, and the locks 
+// are held for a lease period.  The lease can be renewed, and all the locks 
+// are released together.  The server gives back a single lockid for the set.
+
+stash_lockset_t * stash_lockset_new(stash_t *stash, stash_expiry_t lease)
+{
+	stash_lockset_t *lockset;
+	
+	assert(stash && lease > 0);
+	
+	lockset = calloc(1, sizeof(*lockset));
+	assert(lockset);
+	lockset->stash = stash;
+	lockset->lease = lease;
+	assert(lockset->lockid == 0);
+	assert(lockset->count == 0 && lockset->entries == NULL);
+	
+	return(lockset);
+}
+
+
+// free the lockset.  If the locks are still held, they are released first.
+void stash_lockset_free(stash_lockset_t *lockset)
+{
+	assert(lockset);
+	
+	if (lockset->lockid > 0) {
+		stash_lockset_release(lockset);
+	}
+	
+	if (lockset->entries) {
+		assert(lockset->max > 0);
+		free(lockset->entries);
+	}
+	free(lockset);
+}
+
+
+// add a row to the set.  Rows can not be added while the locks are held.
+void stash_lockset_add(stash_lockset_t *lockset, stash_tableid_t tid, stash_rowid_t rowid)
+{
+	assert(lockset && tid > 0 && rowid > 0);
+	assert(lockset->lockid == 0);
+	assert(lockset->count <= lockset->max);
+	
+	if (lockset->count == lockset->max) {
+		lockset->max = lockset->max ? lockset->max * 2 : 8;
+		lockset->entries = realloc(lockset->entries, sizeof(stash_lockentry_t) * lockset->max);
+		assert(lockset->entries);
+	}
+	
+	lockset->entries[lockset->count].tid = tid;
+	lockset->entries[lockset->count].rowid = rowid;
+	lockset->count ++;
+}
+
+
+static int lockentry_fn(const void *a, const void *b)
+{
+	const stash_lockentry_t *ea = a;
+	const stash_lockentry_t *eb = b;
+	
+	assert(a && b);
+	if (ea->tid != eb->tid) { return(ea->tid - eb->tid); }
+	else { return(ea->rowid - eb->rowid); }
+}
+
+
+// send a lock request for the set.  'op' is 0 for acquire, or the renew or 
+// release flag.
+static stash_result_t lockset_send(stash_lockset_t *lockset, risp_command_t op)
+{
+	stash_t *stash;
+	stash_reply_t *reply;
+	stash_result_t res;
+	expbuf_t *entry;
+	int i;
+	
+	assert(lockset);
+	stash = lockset->stash;
+	assert(stash && stash->curr_nsid > 0);
+	
+	assert(stash->buf_set);
+	assert(BUF_LENGTH(stash->buf_set) == 0);
+	
+	rispbuf_addInt(stash->buf_set, STASH_CMD_NAMESPACE_ID, stash->curr_nsid);
+	
+	if (op == 0) {
+		// acquire all the locks.
+		rispbuf_addInt(stash->buf_set, STASH_CMD_EXPIRES, lockset->lease);
+		entry = expbuf_init(NULL, 16);
+		for (i=0; i<lockset->count; i++) {
+			assert(BUF_LENGTH(entry) == 0);
+			rispbuf_addInt(entry, STASH_CMD_TABLE_ID, lockset->entries[i].tid);
+			rispbuf_addInt(entry, STASH_CMD_ROW_ID, lockset->entries[i].rowid);
+			rispbuf_addBuffer(stash->buf_set, STASH_CMD_LOCK_ENTRY, entry);
+			expbuf_clear(entry);
+		}
+		entry = expbuf_free(entry);
+		assert(entry == NULL);
+	}
+	else {
+		// the server knows which rows are in the set.
+		assert(op == STASH_CMD_LOCK_RENEW || op == STASH_CMD_LOCK_RELEASE);
+		assert(lockset->lockid > 0);
+		rispbuf_addInt(stash->buf_set, STASH_CMD_LOCK_ID, lockset->lockid);
+		rispbuf_addCmd(stash->buf_set, op);
+		if (op == STASH_CMD_LOCK_RENEW) {
+			rispbuf_addInt(stash->buf_set, STASH_CMD_EXPIRES, lockset->lease);
+		}
+	}
+	
+	reply = send_request(stash, STASH_CMD_LOCKSET, stash->buf_set);
+	expbuf_clear(stash->buf_set);
+	assert(reply);
+	
+	res = reply->resultcode;
+	if (res == STASH_ERR_OK && op == 0) {
+		assert(reply->lockid > 0);
+		lockset->lockid = reply->lockid;
+	}
+	stash_return_reply(reply);
+	
+	return(res);
+}
+
+
+// acquire all the locks in the set in one request.  The rows are sorted first 
+// so that every client asks for them in the same order.  Either all the locks 
+// are acquired, or none are (and STASH_ERR_LOCKED is returned).
+stash_result_t stash_lockset_acquire(stash_lockset_t *lockset)
+{
+	stash_result_t res;
+	long long start;
+	int i, j;
+	
+	assert(lockset);
+	assert(lockset->lockid == 0);
+	assert(lockset->count > 0 && lockset->entries);
+	
+	// sort, and remove any rows that were added more than once.
+	qsort(lockset->entries, lockset->count, sizeof(stash_lockentry_t), lockentry_fn);
+	for (i=1, j=0; i<lockset->count; i++) {
+		if (lockentry_fn(&lockset->entries[i], &lockset->entries[j]) != 0) {
+			j++;
+			lockset->entries[j] = lockset->entries[i];
+		}
+	}
+	lockset->count = j + 1;
+	
+	// the lease is counted from before the request was sent, so that we never 
+	// think we hold it for longer than the server does.
+	start = now_usec();
+	res = lockset_send(lockset, 0);
+	if (res == STASH_ERR_OK) {
+		assert(lockset->lockid > 0);
+		lockset->lease_end = start + ((long long)lockset->lease * 1000000);
+	}
+	
+	return(res);
+}
+
+
+// extend the lease on all the locks in the set.
+stash_result_t stash_lockset_renew(stash_lockset_t *lockset)
+{
+	stash_result_t res;
+	long long start;
+	
+	assert(lockset);
+	assert(lockset->lockid > 0);
+	
+	start = now_usec();
+	res = lockset_send(lockset, STASH_CMD_LOCK_RENEW);
+	if (res == STASH_ERR_OK) {
+		lockset->lease_end = start + ((long long)lockset->lease * 1000000);
+	}
+	else if (res == STASH_ERR_LOCKNOTHELD) {
+		// the lease ran out before it was renewed.
+		lockset->lockid = 0;
+		lockset->lease_end = 0;
+	}
+	
+	return(res);
+}
+
+
+// release all the locks in the set.  The set can be acquired again.
+stash_result_t stash_lockset_release(stash_lockset_t *lockset)
+{
+	stash_result_t res;
+	
+	assert(lockset);
+	assert(lockset->lockid > 0);
+	
+	res = lockset_send(lockset, STASH_CMD_LOCK_RELEASE);
+	
+	// whether it worked or not, the locks are not held anymore.
+	lockset->lockid = 0;
+	lockset->lease_end = 0;
+	
+	return(res);
+}
+
+
+
+
 // reset the reply so that it can be iterated from the start again.  Normally used after resorting
 void stash_reply_reset(stash_reply_t *reply) 
 {
+	replyrow_t *row;
+	int visited, i;
+	
 	assert(reply);
+	assert(reply->rows);
 	
-	reply->curr_row = 0;
+	if (reply->curr_row > 0) {
+		// stash_nextrow() moves each row it has finished with to the end of the 
+		// list, so turn the list the rest of the way round to get back to the 
+		// original order.
+		visited = reply->curr_row < reply->row_count ? reply->curr_row : reply->row_count;
+		for (i = visited - 1; i < reply->row_count; i++) {
+			row = ll_pop_head(reply->rows);
+			assert(row);
+			ll_push_tail(reply->rows, row);
+		}
+	}
 	
-	// incomplete.  Need to go trhough the list of rows, and reset the 'done' flag.
-	assert(0);
+	reply->curr_row = -1;
 }
 
 
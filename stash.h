@@ -11,8 +11,8 @@
 // services can ensure that the correct version is installed.
 // This version number should be incremented with every change that would
 // effect logic.
-#define LIBSTASH_VERSION 0x00000700
-#define LIBSTASH_VERSION_NAME "v0.07.00"
+#define LIBSTASH_VERSION 0x00000800
+#define LIBSTASH_VERSION_NAME "v0.08.00"
 
 
 #if (EXPBUF_VERSION < 0x00010200)
@@ -70,6 +70,19 @@
 #define STASH_CMD_NULL             (46)
 #define STASH_CMD_SORTASC          (47)
 #define STASH_CMD_SORTDESC         (48)
+#define STASH_CMD_AGG_COUNT        (49)
+#define STASH_CMD_AGG_SUM          (50)
+#define STASH_CMD_AGG_MIN          (51)
+#define STASH_CMD_AGG_MAX          (52)
+#define STASH_CMD_OP_INCREMENT     (53)
+#define STASH_CMD_OP_DECREMENT     (54)
+#define STASH_CMD_OP_APPEND        (55)
+#define STASH_CMD_OP_SET_IF_ABSENT (56)
+#define STASH_CMD_OP_COMPARE_SET   (57)
+#define STASH_CMD_CREATED          (58)
+#define STASH_CMD_LOCK_RENEW       (59)
+#define STASH_CMD_LOCK_RELEASE     (60)
+#define STASH_CMD_NOT_MODIFIED     (61)
 													/// byte integer 8-bit (64 to 95)
 													/// integer 16-bit (96 to 127)
 #define STASH_CMD_FILE_SEQ         (96)
@@ -92,6 +105,9 @@
 #define STASH_CMD_DATETIME         (141)
 #define STASH_CMD_LIMIT            (142)
 #define STASH_CMD_BLOB             (143)
+#define STASH_CMD_GROUP_KEY_ID     (144)
+#define STASH_CMD_VERSION          (145)
+#define STASH_CMD_IF_VERSION       (146)
 
 													/// short string (160 to 191)
 #define STASH_CMD_USERNAME         (160)
@@ -121,6 +137,15 @@
 #define STASH_CMD_CREATE_NAME      (207)
 #define STASH_CMD_CREATE_KEY       (208)
 #define STASH_CMD_SORT             (209)
+#define STASH_CMD_COND_GT          (210)
+#define STASH_CMD_COND_LT          (211)
+#define STASH_CMD_COND_GE          (212)
+#define STASH_CMD_COND_LE          (213)
+#define STASH_CMD_COND_BETWEEN     (214)
+#define STASH_CMD_SELECT           (215)
+#define STASH_CMD_AGGREGATE        (216)
+#define STASH_CMD_CONTINUE         (217)
+#define STASH_CMD_LOCK_ENTRY       (219)
 
 #define STASH_CMD_COND_NAME        (222)
 #define STASH_CMD_COND_EQUALS      (223)
@@ -146,6 +171,13 @@
 #define STASH_CMD_COND_A           (242)
 #define STASH_CMD_COND_B           (243)
 #define STASH_CMD_COND_NOT         (244)
+#define STASH_CMD_COND_IN          (245)
+#define STASH_CMD_COND_NAME_IN     (246)
+#define STASH_CMD_DELETE_WHERE     (247)
+#define STASH_CMD_EXPIRE_WHERE     (248)
+#define STASH_CMD_EXPECTED         (249)
+#define STASH_CMD_ROW_LIST         (250)
+#define STASH_CMD_LOCKSET          (251)
 
 
 // stash error codes.
@@ -163,6 +195,9 @@
 #define STASH_ERR_NOTSTRICT          (11)
 #define STASH_ERR_ROWEXISTS          (12)
 #define STASH_ERR_KEYNOTEXIST        (13)
+#define STASH_ERR_VALUEMISMATCH      (14)
+#define STASH_ERR_LOCKED             (15)
+#define STASH_ERR_LOCKNOTHELD        (16)
 
 #define STASH_TABOPT_UNIQUE          (1)
 #define STASH_TABOPT_STRICT          (2)
@@ -190,15 +225,123 @@ typedef int stash_nameid_t;
 typedef int stash_keyid_t;
 typedef int stash_rowid_t;
 typedef int stash_expiry_t;
+typedef int stash_lockid_t;
+typedef unsigned int stash_version_t;
 
 
 
+// statistics for the low-latency receive mode (see stash_lowlatency).
+typedef struct {
+	unsigned long spin_hits;	// data arrived while spinning.
+	unsigned long spin_misses;	// spun for the whole window, then had to block.
+	unsigned long spin_skipped;	// replies are slower than the max window, so didn't spin.
+	int window;					// current adaptive spin window (microseconds).
+	int avg_wait;				// average time waiting for a reply to start (microseconds).
+} stash_spinstats_t;
+
+
+// statistics for hedged reads (see stash_hedge_reads).
+typedef struct {
+	unsigned long reads;		// read-only requests that were candidates for hedging.
+	unsigned long hedged;		// requests that were also sent to a second server.
+	unsigned long hedge_wins;	// hedged requests where the second server replied first.
+	int delay;					// current hedge delay (microseconds), -1 while warming up.
+} stash_hedgestats_t;
+
+
+// a latency (or size) histogram.  Values below 8 get a bucket each, above that 
+// there are 4 buckets for each power of two.  Use stash_hist_percentile() to 
+// read it.
+#define STASH_HIST_BUCKETS  (128)
+
+typedef struct {
+	unsigned long long counts[STASH_HIST_BUCKETS];
+	unsigned long long total;
+} stash_hist_t;
+
+// counts for one request command (see stash_get_stats).
+typedef struct {
+	unsigned long long requests;	// requests sent.
+	unsigned long long failed;		// FAILED replies, or no reply at all.
+	unsigned long long bytes_sent;
+	unsigned long long bytes_received;
+	unsigned long long usec;		// total time waiting for the replies.
+} stash_cmdstats_t;
+
+// where the time went for a single request (see stash_profile).  Times are in 
+// nanoseconds.
+typedef struct {
+	long long encode;		// building the query (condition, sort, select).
+	long long send;			// writing the request to the socket.
+	long long wait;			// from the end of the send to the first byte of the reply.
+	long long receive;		// from the first byte to the complete reply.
+	long long decode;		// parsing the reply, rows and attributes.
+	long long sort;			// sorting on the client (a sorted query without a limit).
+	int request_bytes;
+	int reply_bytes;
+	int rows;
+	int attributes;
+} stash_profile_t;
+
+// request lifecycle events (see stash_trace).
+#define STASH_TRACE_BUILD       (1)
+#define STASH_TRACE_SEND_START  (2)
+#define STASH_TRACE_SEND_END    (3)
+#define STASH_TRACE_FIRST_BYTE  (4)
+#define STASH_TRACE_PARSE_END   (5)
+
+typedef struct {
+	int event;				// STASH_TRACE_*
+	long long time;			// CLOCK_MONOTONIC, in nanoseconds.
+	int reqid;
+	risp_command_t cmd;		// the request command (eg, STASH_CMD_QUERY)
+	int request_bytes;
+	int reply_bytes;		// from STASH_TRACE_PARSE_END.
+	int rows;				// from STASH_TRACE_PARSE_END.
+	stash_result_t resultcode;	// from STASH_TRACE_PARSE_END.
+} stash_trace_t;
+
+typedef void (*stash_trace_fn)(const stash_trace_t *event, void *arg);
+
+// client statistics (see stash_get_stats).  Everything counts from when the 
+// stash object was initialised.
+typedef struct {
+	unsigned long long requests;
+	unsigned long long replies;
+	unsigned long long failed;		// FAILED replies.
+	unsigned long long lost;		// requests that got no reply (connection lost).
+	unsigned long long bytes_sent;
+	unsigned long long bytes_received;
+	unsigned long long rows;		// rows decoded from replies.
+	unsigned long long attributes;	// attributes decoded from those rows.
+	
+	unsigned long long connects;	// successful connections.
+	unsigned long long reconnects;	// connections re-opened after being lost.
+	unsigned long long connect_failures;
+	unsigned long long disconnects;	// connections lost.
+	
+	unsigned long long cache_hits;		// see stash_cache.
+	unsigned long long cache_misses;
+	unsigned long long cache_evictions;		// dropped to keep within the budget.
+	unsigned long long cache_invalidations;	// dropped because of a write to the table.
+	unsigned long long not_modified;	// conditional queries answered with the previous reply.
+	
+	stash_hist_t latency;			// microseconds from sending to the complete reply.
+	stash_hist_t reply_size;		// bytes.
+	
+	// indexed by the request command (eg, STASH_CMD_QUERY).
+	stash_cmdstats_t commands[256];
+} stash_stats_t;
+
+
 typedef struct {
 	risp_t *risp;
 	risp_t *risp_reply;
 	risp_t *risp_failed;
 	risp_t *risp_row;
 	risp_t *risp_attr;
+	risp_t *risp_reqid;
+	risp_t *risp_frame;
 	
 	// linked-list of our connections.  Only the one at the head is likely to be
 	// active (although it might not be).  When a connection is dropped or is
@@ -226,6 +369,56 @@ typedef struct {
 	
 	stash_nsid_t curr_nsid;
 	
+	// send read-only requests to the fastest server (see stash_balance_reads).
+	int balance_reads;
+	
+	// hedged reads (see stash_hedge_reads).
+	int hedge_percentile;
+	int hedge_min;
+	void *hedge_hist;
+	stash_hedgestats_t hedgestats;
+	
+	// io_uring transport state.  NULL if the blocking socket calls are being 
+	// used (either not built with STASH_IOURING, or io_uring not available).
+	void *uring;
+	
+	// low-latency receive mode.  When spin_max is set, the socket is polled 
+	// for up to an adaptive window before blocking.
+	int spin_max;
+	int busy_poll;
+	long long spin_start;
+	int spin_result;
+	stash_spinstats_t spinstats;
+	
+	// client statistics (see stash_get_stats).
+	stash_stats_t stats;
+	
+	// per-request profiling (see stash_profile).  first_byte is the time the 
+	// reply started arriving, for the request in progress.
+	int profiling;
+	long long first_byte;
+	
+	// request tracing (see stash_trace).  trace_req holds the details of the 
+	// request in progress.
+	stash_trace_fn trace_fn;
+	void *trace_arg;
+	stash_trace_t trace_req;
+	
+	// slow request log (see stash_slowlog).  0 when off.
+	int slow_usec;
+	char *slow_path;
+	long slow_max;
+	
+	// traffic capture (see stash_capture).  NULL when not capturing.
+	void *capture;
+	long long capture_start;
+	
+	// query result cache (see stash_cache).  NULL when off.
+	list_t *cache;			/// cache_entry_t
+	int cache_ttl;			// msec
+	long cache_max;
+	long cache_bytes;
+	
 } stash_t;
 
 
@@ -234,7 +427,7 @@ typedef struct {
 
 
 // this complicated structure is used for the replies.  
-typedef struct {
+typedef struct __stash_reply_t {
 	stash_t        *stash;
 	int             reqid;
 	stash_result_t  resultcode;
@@ -246,6 +439,17 @@ typedef struct {
 	int             row_count;
 	list_t         *rows;		// replyrow_t
 	int             curr_row;
+	short int       aggregate;	// rows are aggregate groups rather than stored rows.
+	void           *cont;		// continuation token if there are more rows (see stash_query_continue)
+	int             cont_len;
+	short int       created;	// the row was created rather than updated (see stash_upsert)
+	stash_lockid_t  lockid;
+	stash_profile_t profile;	// only filled in when profiling (see stash_profile)
+	short int       cached;		// held by the query cache (see stash_cache)
+	int             refs;		// replies from the cache that are reading these rows.
+	struct __stash_reply_t *shared;	// the cached reply that owns the rows, if this came from the cache.
+	stash_version_t version;	// version of the query result, 0 if the server doesn't give one
+	short int       not_modified;	// the previous reply was reused (see stash_query_if_modified)
 } stash_reply_t;
 
 typedef list_t stash_attrlist_t;
@@ -274,11 +478,22 @@ typedef struct {
 #define STASH_CONDTYPE_NOT    5
 #define STASH_CONDTYPE_EXISTS 6
 #define STASH_CONDTYPE_GT     7
+#define STASH_CONDTYPE_LT     8
+#define STASH_CONDTYPE_GE     9
+#define STASH_CONDTYPE_LE     10
+#define STASH_CONDTYPE_BETWEEN 11
+#define STASH_CONDTYPE_IN      12
+#define STASH_CONDTYPE_NAME_IN 13
 typedef struct __stash_cond_t {
 	short int condtype;
 	stash_keyid_t kid;
 	void *key_ptr;
 	stash_value_t *value;
+	stash_value_t *upper;		// STASH_CONDTYPE_BETWEEN
+	int count;					// STASH_CONDTYPE_IN, STASH_CONDTYPE_NAME_IN
+	stash_value_t **values;
+	char **names;
+
 	stash_nameid_t nameid;
 	char *name;
 	void *name_ptr;
@@ -311,6 +526,16 @@ void stash_connstr(stash_t *stash, const char *connstr);
 // using the host info and authority already specified, connect to the database if not already connected.
 stash_result_t stash_connect(stash_t *stash);
 
+// send read-only requests to the server with the lowest average latency.  Writes stay on the preferred server.
+void stash_balance_reads(stash_t *stash, int enable);
+
+// if a read-only request has not started to get a reply within the given 
+// percentile of recent read latency (but at least min_delay microseconds), 
+// send it to a second server as well, and use whichever reply arrives first.  
+// A percentile of 0 turns hedging off.
+void stash_hedge_reads(stash_t *stash, int percentile, int min_delay);
+void stash_get_hedgestats(stash_t *stash, stash_hedgestats_t *stats);
+
 // set the namespace.  All subsequent operations will be on the specified namespace.
 stash_result_t stash_set_namespace(stash_t *stash, const char *namespace);
 stash_result_t stash_get_namespace_id(stash_t *stash, const char *namespace, stash_nsid_t *nsid);
@@ -318,6 +543,37 @@ stash_result_t stash_get_namespace_id(stash_t *stash, const char *namespace, sta
 
 const char *stash_err_text(stash_result_t res);
 
+// the transport selected by stash_init().
+#define STASH_TRANSPORT_SOCKET   1
+#define STASH_TRANSPORT_IOURING  2
+int stash_transport(stash_t *stash);
+
+// low-latency receive mode.  Spin for up to max_spin microseconds waiting for 
+// a reply before blocking.  busy_poll (microseconds) sets SO_BUSY_POLL on the 
+// connections if non-zero.  A max_spin of 0 disables the mode.
+void stash_lowlatency(stash_t *stash, int max_spin, int busy_poll);
+void stash_get_spinstats(stash_t *stash, stash_spinstats_t *stats);
+
+// record every request and reply to a file, for stash-replay.  NULL stops.
+int stash_capture(stash_t *stash, const char *path);
+
+// counters and histograms for the requests made on the handle.
+void stash_get_stats(stash_t *stash, stash_stats_t *stats);
+void stash_reset_stats(stash_t *stash);
+long long stash_hist_percentile(const stash_hist_t *hist, double percentile);
+
+// record the phase timings of each request in reply->profile.
+void stash_profile(stash_t *stash, int enable);
+
+// call 'fn' at each stage of every request.  NULL removes it.
+void stash_trace(stash_t *stash, stash_trace_fn fn, void *arg);
+
+// log requests that take longer than 'usec', optionally saving them to a file.
+void stash_slowlog(stash_t *stash, int usec, const char *path, long max_size);
+
+// keep query results for up to ttl_ms, within max_bytes.  0 turns it off.
+void stash_cache(stash_t *stash, int ttl_ms, long max_bytes);
+
 stash_result_t stash_create_username(stash_t *stash, const char *newuser, stash_userid_t *uid);
 stash_result_t stash_set_password(stash_t *stash, stash_userid_t uid, const char *username, const char *newpass);
 
@@ -347,8 +603,43 @@ void stash_free_value(stash_value_t *value);
 
 stash_reply_t * stash_create_row(stash_t *stash, stash_tableid_t tid, stash_nameid_t nameid, const char *name, stash_attrlist_t *alist, stash_expiry_t expires);
 stash_reply_t * stash_set(stash_t *stash, stash_tableid_t tid, stash_rowid_t rowid, stash_attrlist_t *alist);
+stash_result_t stash_upsert(stash_t *stash, stash_tableid_t tid, stash_nameid_t nameid, const char *name, stash_attrlist_t *alist, stash_expiry_t expires, stash_rowid_t *rowid, int *created);
+
+// operations for stash_update().
+#define STASH_UPDATE_INCREMENT      1
+#define STASH_UPDATE_DECREMENT      2
+#define STASH_UPDATE_APPEND         3
+#define STASH_UPDATE_SET_IF_ABSENT  4
+#define STASH_UPDATE_COMPARE_SET    5
+stash_reply_t * stash_update(stash_t *stash, stash_tableid_t tid, stash_rowid_t rowid, stash_keyid_t kid, int op, stash_value_t *value, stash_value_t *expected);
 stash_reply_t * stash_expire(stash_t *stash, stash_tableid_t tid, stash_rowid_t rowid, stash_keyid_t keyid, stash_expiry_t expires);
 stash_reply_t * stash_delete(stash_t *stash, stash_tableid_t tid, stash_rowid_t rowid, stash_keyid_t keyid);
+stash_result_t stash_delete_where(stash_t *stash, stash_tableid_t tid, stash_cond_t *cond, int *count);
+stash_result_t stash_expire_where(stash_t *stash, stash_tableid_t tid, stash_cond_t *cond, stash_keyid_t keyid, stash_expiry_t expires, int *count);
+
+
+// a set of row locks that are acquired, renewed and released together.
+typedef struct {
+	stash_tableid_t tid;
+	stash_rowid_t rowid;
+} stash_lockentry_t;
+
+typedef struct {
+	stash_t *stash;
+	stash_lockid_t lockid;		// 0 if the locks are not held.
+	stash_expiry_t lease;		// seconds
+	long long lease_end;		// when the lease runs out (monotonic microseconds).
+	int count;
+	int max;
+	stash_lockentry_t *entries;
+} stash_lockset_t;
+
+stash_lockset_t * stash_lockset_new(stash_t *stash, stash_expiry_t lease);
+void stash_lockset_free(stash_lockset_t *lockset);
+void stash_lockset_add(stash_lockset_t *lockset, stash_tableid_t tid, stash_rowid_t rowid);
+stash_result_t stash_lockset_acquire(stash_lockset_t *lockset);
+stash_result_t stash_lockset_renew(stash_lockset_t *lockset);
+stash_result_t stash_lockset_release(stash_lockset_t *lockset);
 
 void stash_return_reply(stash_reply_t *reply);
 
@@ -361,6 +652,12 @@ stash_result_t stash_grant(stash_t *stash, stash_userid_t uid, stash_nsid_t nsid
 
 stash_cond_t * __cond_key_equals(stash_keyid_t kid, stash_value_t *value);
 stash_cond_t * __cond_key_gt(stash_keyid_t kid, stash_value_t *value);
+stash_cond_t * __cond_key_lt(stash_keyid_t kid, stash_value_t *value);
+stash_cond_t * __cond_key_ge(stash_keyid_t kid, stash_value_t *value);
+stash_cond_t * __cond_key_le(stash_keyid_t kid, stash_value_t *value);
+stash_cond_t * __cond_key_between(stash_keyid_t kid, stash_value_t *low, stash_value_t *high);
+stash_cond_t * __cond_key_in(stash_keyid_t kid, stash_value_t *values[], int n);
+stash_cond_t * __cond_name_in(const char *names[], int n);
 stash_cond_t * __cond_key_exists(stash_keyid_t kid);
 stash_cond_t * __cond_name(stash_nameid_t nameid, const char *name);
 stash_cond_t * __cond_and(stash_cond_t *aa, stash_cond_t *bb);
@@ -390,19 +687,60 @@ typedef struct {
 	
 	/* first sort requirement. */
 	stash_sortentry_t *sort;
+	
+	/* keys to return.  If none, all the attributes are returned. */
+	stash_keyid_t *select;
+	int select_count;
+	
+	/* aggregate to calculate on the server instead of returning the rows. */
+	int agg_op;
+	stash_keyid_t agg_kid;
+	stash_keyid_t agg_group;
+	
+	/* continuation token from the previous page. */
+	void *cont;
+	int cont_len;
+	
+	/* previous result, to be reused if it hasn't changed. */
+	stash_reply_t *previous;
 } stash_query_t;
 
+// aggregates (see stash_query_aggregate).  The QUERY carries
+//    AGGREGATE { AGG_COUNT|AGG_SUM|AGG_MIN|AGG_MAX, [KEY_ID], [GROUP_KEY_ID] }
+// and the reply has the COUNT of groups followed by one ROW for each:
+//    ROW { COUNT, [ATTRIBUTE { KEY_ID=group key, VALUE }],
+//                 [ATTRIBUTE { KEY_ID=aggregate key, VALUE }] }
+// A group row has no ROW_ID or NAME_ID, because it is not a stored row.  The
+// COUNT is the number of matching rows in the group that have the aggregate key
+// (or all of them if there is no key), and the aggregate attribute is left out
+// when that is 0.  For AGG_COUNT with a key, the aggregate value is that same
+// count.  Rows that don't have the group key form a group of their own, without
+// the group attribute.  Without a group key there is always exactly one row.
+// SUM only adds integer values.  MIN and MAX compare the way sorting does.
+#define STASH_AGG_NONE   0
+#define STASH_AGG_COUNT  1
+#define STASH_AGG_SUM    2
+#define STASH_AGG_MIN    3
+#define STASH_AGG_MAX    4
+
 stash_query_t * stash_query_new(stash_tableid_t tid);
 void stash_query_free(stash_query_t *query);
 void stash_query_condition(stash_query_t *query, stash_cond_t *condition);
 void stash_query_limit(stash_query_t *query, int limit);
 void stash_query_sort(stash_query_t *query, stash_keyid_t kid, int desc);
 void stash_query_sort_clear(stash_query_t *query);
+void stash_query_select(stash_query_t *query, stash_keyid_t kid);
+void stash_query_aggregate(stash_query_t *query, int op, stash_keyid_t kid);
+void stash_query_group_by(stash_query_t *query, stash_keyid_t kid);
+int stash_query_continue(stash_query_t *query, stash_reply_t *reply);
+void stash_query_if_modified(stash_query_t *query, stash_reply_t *reply);
 stash_reply_t * stash_query_execute(stash_t *stash, stash_query_t *query);
 
 // the stash_query function is deprecated, and may not be supported in future versions.
 stash_reply_t * stash_query(stash_t *stash, stash_tableid_t tid, int limit, stash_cond_t *condition);
 
+stash_reply_t * stash_get_rows(stash_t *stash, stash_tableid_t tid, stash_rowid_t rowids[], int n, stash_keyid_t keys[], int nkeys);
+
 /////////////////////////////////////////////////////////////////////
 
 stash_result_t stash_get_user_id(stash_t *stash, const char *username, stash_userid_t *uid);
@@ -412,6 +750,7 @@ int stash_nextrow(stash_reply_t *reply);
 const char * stash_getstr(stash_reply_t *reply, stash_keyid_t key);
 int stash_getint(stash_reply_t *reply, stash_keyid_t key);
 stash_rowid_t stash_rowid(stash_reply_t *reply);
+int stash_getcount(stash_reply_t *reply);
 int stash_getlength(stash_reply_t *reply, stash_keyid_t key);
 
 void stash_reply_reset(stash_reply_t *reply); 
@@ -0,0 +1,1092 @@
+//-----------------------------------------------------------------------------
+// stash-check
+// Runs a set of behaviour checks against a stash server (normally
+// tools/stash-standin), through the public interface.  Each check gets a
+// fresh handle and its own table, and prints 'ok' or 'FAIL' with the reason.
+// The exit code is the number of checks that failed.
+//
+// Checks:
+//    cache-sort   a query sorted on the client is cached apart from the same
+//                 query with a different sort, and keeps its order when hit.
+//    cache-if-modified
+//                 a cached reply given to stash_query_if_modified() leaves the
+//                 cache, so later hits are not marked as not modified.
+//    cache-shared two hits on the same query can be read alternately, and
+//                 sorting one doesn't change the other.
+//    aggregate    counts, sums and maximums come back as group rows, without
+//                 rowids, and grouped on a key.
+//    continue     paging through a sorted query, while rows are added before
+//                 and after the position, returns every row once.
+//    lockset-acquire
+//                 a lock set is sorted and de-duplicated, and is acquired
+//                 completely or not at all.
+//    lockset-renew
+//                 renewing a lock set extends its lease, and fails once the
+//                 lease has run out.
+//    lockset-release
+//                 released (and freed) lock sets can be locked by others.
+//    conditions   ranges, BETWEEN, IN and AND conditions match the right rows.
+//    select       only the selected keys are returned.
+//    get-rows     rows by rowid come back in the order asked for, once each.
+//    where        delete and expire by condition, with the count of rows, and
+//                 an error (rather than a count) when it fails.
+//    update       each of the update operations, including a compare and set
+//                 that doesn't match.
+//    upsert       the first upsert creates the row, the second updates it.
+//    not-modified without the cache, an unchanged result isn't sent again,
+//                 and a changed one is.
+//
+// Usage: stash-check [options] [filter]
+//    where only the checks with 'filter' in their name are run.
+
+#include <stash.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+static const char *_host = "127.0.0.1";
+static const char *_username = "check";
+static const char *_password = "check";
+static const char *_namespace = "check";
+static long _nonce = 0;
+
+
+static stash_t * check_connect(void)
+{
+	stash_t *stash;
+	stash_result_t res;
+
+	stash = stash_init(NULL);
+	assert(stash);
+	stash_authority(stash, _username, _password);
+	stash_addserver(stash, _host, 10);
+
+	res = stash_connect(stash);
+	if (res == STASH_ERR_OK) { res = stash_set_namespace(stash, _namespace); }
+	if (res != STASH_ERR_OK) {
+		fprintf(stderr, "Unable to connect to %s: %s\n", _host, stash_err_text(res));
+		exit(255);
+	}
+
+	return(stash);
+}
+
+
+// create a table for a check, named after it so that runs don't collide.
+static stash_tableid_t check_table(stash_t *stash, const char *name)
+{
+	stash_tableid_t tid = 0;
+	stash_result_t res;
+	char tablename[64];
+
+	assert(stash && name);
+
+	sprintf(tablename, "%s-%ld-%d", name, _nonce, (int) getpid());
+	res = stash_create_table(stash, tablename, STASH_TABOPT_UNIQUE, &tid);
+	if (res != STASH_ERR_OK) {
+		fprintf(stderr, "Unable to create table '%s': %s\n", tablename, stash_err_text(res));
+		exit(255);
+	}
+
+	return(tid);
+}
+
+
+// create a row with the attributes (if any), which are freed.  Returns the rowid.
+static stash_rowid_t check_row(stash_t *stash, stash_tableid_t tid, const char *name, stash_attrlist_t *alist)
+{
+	stash_reply_t *reply;
+	stash_rowid_t rid = 0;
+
+	assert(stash && tid > 0 && name);
+
+	reply = stash_create_row(stash, tid, 0, name, alist, 0);
+	if (alist) { stash_free_alist(stash, alist); }
+	assert(reply);
+	if (reply->resultcode != STASH_ERR_OK) {
+		fprintf(stderr, "Unable to create row '%s': %s\n", name, stash_err_text(reply->resultcode));
+		exit(255);
+	}
+	if (stash_nextrow(reply)) { rid = stash_rowid(reply); }
+	stash_return_reply(reply);
+
+	assert(rid > 0);
+	return(rid);
+}
+
+
+// create 'count' rows with no attributes, and put their rowids in 'rids'.
+static stash_tableid_t check_rows(stash_t *stash, const char *table, stash_rowid_t *rids, int count)
+{
+	stash_tableid_t tid;
+	char name[32];
+	int i;
+
+	assert(stash && table && rids && count > 0);
+
+	tid = check_table(stash, table);
+	for (i=0; i<count; i++) {
+		sprintf(name, "row%d", i);
+		rids[i] = check_row(stash, tid, name, NULL);
+	}
+	return(tid);
+}
+
+
+// create a table with 'count' rows, where row i has a 'score' of i (from 1).
+// The rowids are put in 'rids' if it isn't NULL.
+static stash_tableid_t check_scores(stash_t *stash, const char *table, int count, stash_keyid_t *kid, stash_rowid_t *rids)
+{
+	stash_tableid_t tid;
+	stash_attrlist_t *alist;
+	stash_rowid_t rid;
+	char name[32];
+	int i;
+
+	assert(stash && table && count > 0 && kid);
+
+	tid = check_table(stash, table);
+	*kid = stash_get_key_id(stash, tid, "score");
+	for (i=1; i<=count; i++) {
+		sprintf(name, "row%d", i);
+		alist = stash_init_alist(stash);
+		stash_set_attr(alist, *kid, __value_int(i), 0);
+		rid = check_row(stash, tid, name, alist);
+		if (rids) { rids[i-1] = rid; }
+	}
+	return(tid);
+}
+
+
+// the values of a key in each row of the reply, in order, as a string like "3,1,2".
+static const char * row_values(stash_reply_t *reply, stash_keyid_t kid, char *out)
+{
+	assert(reply && kid > 0 && out);
+
+	out[0] = '\0';
+	while (stash_nextrow(reply)) {
+		sprintf(out + strlen(out), "%s%d", out[0] ? "," : "", stash_getint(reply, kid));
+	}
+	return(out);
+}
+
+
+static const char * query_values(stash_t *stash, stash_query_t *query, stash_keyid_t kid, char *out)
+{
+	stash_reply_t *reply;
+
+	reply = stash_query_execute(stash, query);
+	assert(reply);
+	if (reply->resultcode != STASH_ERR_OK) {
+		sprintf(out, "error %d", reply->resultcode);
+	}
+	else {
+		row_values(reply, kid, out);
+	}
+	stash_return_reply(reply);
+
+	return(out);
+}
+
+
+// the values of the key in the rows that match the condition, in order of the 
+// key.  The condition is freed.
+static const char * cond_values(stash_t *stash, stash_tableid_t tid, stash_keyid_t kid, stash_cond_t *cond, char *out)
+{
+	stash_query_t *query;
+
+	assert(stash && tid > 0 && kid > 0 && cond && out);
+
+	query = stash_query_new(tid);
+	stash_query_condition(query, cond);
+	stash_query_sort(query, kid, 0);
+	query_values(stash, query, kid, out);
+	stash_query_free(query);
+	stash_cond_free(cond);
+
+	return(out);
+}
+
+
+//-----------------------------------------------------------------------------
+// The checks.  Each returns NULL if it passed, or a description of what went
+// wrong.
+
+static char _reason[256];
+
+static const char * check_cache_sort(stash_t *stash)
+{
+	stash_tableid_t tid;
+	stash_keyid_t kid;
+	stash_attrlist_t *alist;
+	stash_reply_t *reply;
+	stash_query_t *query;
+	stash_stats_t stats;
+	char name[32], got[64];
+	int scores[] = { 3, 1, 2 };
+	int i;
+
+	tid = check_table(stash, "cache-sort");
+	kid = stash_get_key_id(stash, tid, "score");
+	for (i=0; i<3; i++) {
+		sprintf(name, "row%d", i);
+		alist = stash_init_alist(stash);
+		stash_set_attr(alist, kid, __value_int(scores[i]), 0);
+		reply = stash_create_row(stash, tid, 0, name, alist, 0);
+		stash_free_alist(stash, alist);
+		assert(reply && reply->resultcode == STASH_ERR_OK);
+		stash_return_reply(reply);
+	}
+
+	stash_cache(stash, 60000, 1024 * 1024);
+	query = stash_query_new(tid);
+
+	// with no limit, the sort is done on the client after the reply arrives.
+	stash_query_sort(query, kid, 0);
+	if (strcmp(query_values(stash, query, kid, got), "1,2,3") != 0) {
+		sprintf(_reason, "ascending sort gave %s", got);
+	}
+	else {
+		stash_query_sort_clear(query);
+		stash_query_sort(query, kid, 1);
+		if (strcmp(query_values(stash, query, kid, got), "3,2,1") != 0) {
+			sprintf(_reason, "descending sort after an ascending one gave %s", got);
+		}
+		else {
+			// the first query again should now come from the cache, still in order.
+			stash_query_sort_clear(query);
+			stash_query_sort(query, kid, 0);
+			stash_reset_stats(stash);
+			query_values(stash, query, kid, got);
+			stash_get_stats(stash, &stats);
+			if (strcmp(got, "1,2,3") != 0) {
+				sprintf(_reason, "cached ascending sort gave %s", got);
+			}
+			else if (stats.cache_hits != 1) {
+				sprintf(_reason, "repeated query was not served from the cache");
+			}
+			else {
+				_reason[0] = '\0';
+			}
+		}
+	}
+
+	stash_query_free(query);
+	return(_reason[0] ? _reason : NULL);
+}
+
+
+static const char * check_cache_if_modified(stash_t *stash)
+{
+	stash_tableid_t tid;
+	stash_keyid_t kid;
+	stash_attrlist_t *alist;
+	stash_reply_t *reply;
+	stash_query_t *query;
+	char got[64];
+
+	tid = check_table(stash, "cache-if-modified");
+	kid = stash_get_key_id(stash, tid, "score");
+	alist = stash_init_alist(stash);
+	stash_set_attr(alist, kid, __value_int(7), 0);
+	reply = stash_create_row(stash, tid, 0, "row", alist, 0);
+	stash_free_alist(stash, alist);
+	assert(reply && reply->resultcode == STASH_ERR_OK);
+	stash_return_reply(reply);
+
+	stash_cache(stash, 60000, 1024 * 1024);
+	query = stash_query_new(tid);
+	_reason[0] = '\0';
+
+	// the first reply goes into the cache, and is then kept by the query.
+	reply = stash_query_execute(stash, query);
+	assert(reply && reply->resultcode == STASH_ERR_OK);
+	stash_query_if_modified(query, reply);
+	reply = stash_query_execute(stash, query);
+	assert(reply && reply->resultcode == STASH_ERR_OK);
+	if (reply->version > 0 && reply->not_modified == 0) {
+		sprintf(_reason, "unchanged result was sent again");
+	}
+	stash_return_reply(reply);
+
+	// a plain query for the same rows must not see the not modified mark.
+	if (_reason[0] == '\0') {
+		reply = stash_query_execute(stash, query);
+		assert(reply && reply->resultcode == STASH_ERR_OK);
+		if (reply->not_modified) {
+			sprintf(_reason, "plain query was marked as not modified");
+		}
+		row_values(reply, kid, got);
+		stash_return_reply(reply);
+		if (_reason[0] == '\0' && strcmp(got, "7") != 0) {
+			sprintf(_reason, "plain query gave %s", got);
+		}
+	}
+
+	stash_query_free(query);
+	return(_reason[0] ? _reason : NULL);
+}
+
+
+static const char * check_cache_shared(stash_t *stash)
+{
+	stash_tableid_t tid;
+	stash_keyid_t kid;
+	stash_attrlist_t *alist;
+	stash_reply_t *first, *a, *b;
+	stash_query_t *query;
+	stash_sortentry_t *sort;
+	char name[32], got_a[64], got_b[64];
+	int i, more_a, more_b;
+
+	tid = check_table(stash, "cache-shared");
+	kid = stash_get_key_id(stash, tid, "score");
+	for (i=1; i<=3; i++) {
+		sprintf(name, "row%d", i);
+		alist = stash_init_alist(stash);
+		stash_set_attr(alist, kid, __value_int(i), 0);
+		check_row(stash, tid, name, alist);
+	}
+	_reason[0] = '\0';
+
+	stash_cache(stash, 60000, 1024 * 1024);
+	query = stash_query_new(tid);
+
+	// the reply that filled the cache is returned before the hits are read.
+	first = stash_query_execute(stash, query);
+	assert(first && first->resultcode == STASH_ERR_OK);
+	a = stash_query_execute(stash, query);
+	b = stash_query_execute(stash, query);
+	assert(a && b);
+	stash_return_reply(first);
+
+	// read the two hits a row at a time each.
+	got_a[0] = got_b[0] = '\0';
+	do {
+		if ((more_a = stash_nextrow(a))) {
+			sprintf(got_a + strlen(got_a), "%s%d", got_a[0] ? "," : "", stash_getint(a, kid));
+		}
+		if ((more_b = stash_nextrow(b))) {
+			sprintf(got_b + strlen(got_b), "%s%d", got_b[0] ? "," : "", stash_getint(b, kid));
+		}
+	} while (more_a || more_b);
+
+	if (strcmp(got_a, "1,2,3") != 0 || strcmp(got_b, "1,2,3") != 0) {
+		sprintf(_reason, "alternate reads gave %s and %s", got_a, got_b);
+	}
+	else {
+		// sorting one hit doesn't change the order of another.
+		sort = stash_sortentry(kid, 1, NULL);
+		stash_sort(b, sort);
+		stash_sortentry_free(sort);
+		row_values(b, kid, got_b);
+		stash_reply_reset(a);
+		row_values(a, kid, got_a);
+		if (strcmp(got_b, "3,2,1") != 0 || strcmp(got_a, "1,2,3") != 0) {
+			sprintf(_reason, "sorting one hit gave %s, and the other %s", got_b, got_a);
+		}
+	}
+	stash_return_reply(a);
+	stash_return_reply(b);
+
+	if (_reason[0] == '\0') {
+		if (strcmp(query_values(stash, query, kid, got_a), "1,2,3") != 0) {
+			sprintf(_reason, "a later hit gave %s", got_a);
+		}
+	}
+
+	stash_query_free(query);
+	return(_reason[0] ? _reason : NULL);
+}
+
+
+static const char * check_aggregate(stash_t *stash)
+{
+	stash_tableid_t tid;
+	stash_keyid_t kteam, kscore;
+	stash_attrlist_t *alist;
+	stash_reply_t *reply;
+	stash_query_t *query;
+	const char *teams[] = { "b", "a", "a", NULL, "b" };
+	int scores[] = { 4, 3, 5, 1, -1 };
+	char name[32], got[128];
+	const char *team;
+	int i;
+
+	tid = check_table(stash, "aggregate");
+	kteam = stash_get_key_id(stash, tid, "team");
+	kscore = stash_get_key_id(stash, tid, "score");
+	for (i=0; i<5; i++) {
+		sprintf(name, "row%d", i);
+		alist = stash_init_alist(stash);
+		if (teams[i]) { stash_set_attr(alist, kteam, __value_str(teams[i]), 0); }
+		if (scores[i] >= 0) { stash_set_attr(alist, kscore, __value_int(scores[i]), 0); }
+		check_row(stash, tid, name, alist);
+	}
+	_reason[0] = '\0';
+
+	// without a group there is a single row, and no rowid.
+	query = stash_query_new(tid);
+	stash_query_aggregate(query, STASH_AGG_COUNT, 0);
+	reply = stash_query_execute(stash, query);
+	assert(reply);
+	if (reply->resultcode != STASH_ERR_OK) {
+		sprintf(_reason, "count failed: %s", stash_err_text(reply->resultcode));
+	}
+	else if (stash_nextrow(reply) == 0 || stash_rowid(reply) != 0 || stash_getcount(reply) != 5 || stash_nextrow(reply) != 0) {
+		sprintf(_reason, "count did not give a single group of 5");
+	}
+	stash_return_reply(reply);
+	stash_query_free(query);
+
+	// grouped, each group has the group value, the sum and how many rows had a 
+	// score.  The rows without a team are a group of their own, at the end.
+	if (_reason[0] == '\0') {
+		query = stash_query_new(tid);
+		stash_query_aggregate(query, STASH_AGG_SUM, kscore);
+		stash_query_group_by(query, kteam);
+		reply = stash_query_execute(stash, query);
+		assert(reply);
+		if (reply->resultcode != STASH_ERR_OK) {
+			sprintf(_reason, "sum failed: %s", stash_err_text(reply->resultcode));
+		}
+		else {
+			got[0] = '\0';
+			while (stash_nextrow(reply)) {
+				team = stash_getstr(reply, kteam);
+				sprintf(got + strlen(got), "%s%s=%d/%d", got[0] ? "," : "", team ? team : "-", stash_getint(reply, kscore), stash_getcount(reply));
+			}
+			if (strcmp(got, "a=8/2,b=4/1,-=1/1") != 0) {
+				sprintf(_reason, "sum by group gave %s", got);
+			}
+		}
+		stash_return_reply(reply);
+		stash_query_free(query);
+	}
+
+	if (_reason[0] == '\0') {
+		query = stash_query_new(tid);
+		stash_query_aggregate(query, STASH_AGG_MAX, kscore);
+		if (strcmp(query_values(stash, query, kscore, got), "5") != 0) {
+			sprintf(_reason, "max gave %s", got);
+		}
+		stash_query_free(query);
+	}
+
+	return(_reason[0] ? _reason : NULL);
+}
+
+
+static const char * check_continue(stash_t *stash)
+{
+	stash_tableid_t tid;
+	stash_keyid_t kid;
+	stash_attrlist_t *alist;
+	stash_reply_t *reply;
+	stash_query_t *query;
+	int inserts[] = { 5, 15, 35 };
+	char name[32], got[128], page[64];
+	int i, j, more;
+
+	tid = check_table(stash, "continue");
+	kid = stash_get_key_id(stash, tid, "score");
+	for (i=1; i<=10; i++) {
+		sprintf(name, "row%d", i);
+		alist = stash_init_alist(stash);
+		stash_set_attr(alist, kid, __value_int(i * 10), 0);
+		check_row(stash, tid, name, alist);
+	}
+	_reason[0] = '\0';
+
+	query = stash_query_new(tid);
+	stash_query_limit(query, 3);
+	stash_query_sort(query, kid, 0);
+
+	// after the first page, rows are added before the cursor (which must not 
+	// be repeated or shift the pages) and after it (which must show up).
+	got[0] = '\0';
+	i = 0;
+	do {
+		reply = stash_query_execute(stash, query);
+		assert(reply);
+		if (reply->resultcode != STASH_ERR_OK) {
+			sprintf(_reason, "page %d failed: %s", i + 1, stash_err_text(reply->resultcode));
+			stash_return_reply(reply);
+			break;
+		}
+		row_values(reply, kid, page);
+		sprintf(got + strlen(got), "%s%s", got[0] && page[0] ? "," : "", page);
+		more = stash_query_continue(query, reply);
+		stash_return_reply(reply);
+
+		if (i == 0) {
+			for (j=0; j<3; j++) {
+				sprintf(name, "insert%d", j);
+				alist = stash_init_alist(stash);
+				stash_set_attr(alist, kid, __value_int(inserts[j]), 0);
+				check_row(stash, tid, name, alist);
+			}
+		}
+		i ++;
+	} while (more && i < 20);
+
+	if (_reason[0] == '\0' && strcmp(got, "10,20,30,35,40,50,60,70,80,90,100") != 0) {
+		sprintf(_reason, "pages gave %s", got);
+	}
+
+	stash_query_free(query);
+	return(_reason[0] ? _reason : NULL);
+}
+
+
+static const char * check_lockset_acquire(stash_t *stash)
+{
+	stash_tableid_t tid;
+	stash_rowid_t rids[3];
+	stash_lockset_t *a, *b;
+	stash_result_t res;
+
+	tid = check_rows(stash, "lockset-acquire", rids, 3);
+	_reason[0] = '\0';
+
+	// rows added out of order, and more than once, are sorted and sent once 
+	// (the server refuses a set that isn't).
+	a = stash_lockset_new(stash, 60);
+	stash_lockset_add(a, tid, rids[2]);
+	stash_lockset_add(a, tid, rids[0]);
+	stash_lockset_add(a, tid, rids[2]);
+	stash_lockset_add(a, tid, rids[0]);
+	res = stash_lockset_acquire(a);
+	if (res != STASH_ERR_OK) {
+		sprintf(_reason, "acquire failed: %s", stash_err_text(res));
+	}
+	else if (a->count != 2 || a->entries[0].rowid != rids[0] || a->entries[1].rowid != rids[2]) {
+		sprintf(_reason, "the set was not sorted and de-duplicated");
+	}
+
+	// a set with a row that is held gets none of its rows.
+	if (_reason[0] == '\0') {
+		b = stash_lockset_new(stash, 60);
+		stash_lockset_add(b, tid, rids[1]);
+		stash_lockset_add(b, tid, rids[2]);
+		res = stash_lockset_acquire(b);
+		stash_lockset_free(b);
+		if (res != STASH_ERR_LOCKED) {
+			sprintf(_reason, "overlapping set gave '%s' instead of being locked", stash_err_text(res));
+		}
+		else {
+			b = stash_lockset_new(stash, 60);
+			stash_lockset_add(b, tid, rids[1]);
+			res = stash_lockset_acquire(b);
+			stash_lockset_free(b);
+			if (res != STASH_ERR_OK) {
+				sprintf(_reason, "a row from a set that failed was left locked");
+			}
+		}
+	}
+
+	stash_lockset_free(a);
+	return(_reason[0] ? _reason : NULL);
+}
+
+
+static const char * check_lockset_renew(stash_t *stash)
+{
+	stash_tableid_t tid;
+	stash_rowid_t rid;
+	stash_lockset_t *a, *b;
+	stash_result_t res;
+
+	tid = check_rows(stash, "lockset-renew", &rid, 1);
+	_reason[0] = '\0';
+
+	// with a one second lease, the set is only still held after 1.2 seconds if 
+	// the renew worked.
+	a = stash_lockset_new(stash, 1);
+	stash_lockset_add(a, tid, rid);
+	res = stash_lockset_acquire(a);
+	if (res != STASH_ERR_OK) {
+		sprintf(_reason, "acquire failed: %s", stash_err_text(res));
+	}
+	else {
+		usleep(600000);
+		res = stash_lockset_renew(a);
+		usleep(600000);
+		b = stash_lockset_new(stash, 1);
+		stash_lockset_add(b, tid, rid);
+		if (res != STASH_ERR_OK) {
+			sprintf(_reason, "renew failed: %s", stash_err_text(res));
+		}
+		else if ((res = stash_lockset_acquire(b)) != STASH_ERR_LOCKED) {
+			sprintf(_reason, "renewed set was not held (%s)", stash_err_text(res));
+		}
+		stash_lockset_free(b);
+	}
+
+	// once the lease has run out, it can't be renewed.
+	if (_reason[0] == '\0') {
+		usleep(600000);
+		res = stash_lockset_renew(a);
+		if (res != STASH_ERR_LOCKNOTHELD) {
+			sprintf(_reason, "renew after the lease ran out gave '%s'", stash_err_text(res));
+		}
+		else if (a->lockid != 0) {
+			sprintf(_reason, "set still has a lock id after the lease ran out");
+		}
+	}
+
+	stash_lockset_free(a);
+	return(_reason[0] ? _reason : NULL);
+}
+
+
+static const char * check_lockset_release(stash_t *stash)
+{
+	stash_tableid_t tid;
+	stash_rowid_t rids[2];
+	stash_lockset_t *a, *b;
+	stash_result_t res;
+
+	tid = check_rows(stash, "lockset-release", rids, 2);
+	_reason[0] = '\0';
+
+	a = stash_lockset_new(stash, 60);
+	stash_lockset_add(a, tid, rids[0]);
+	stash_lockset_add(a, tid, rids[1]);
+	b = stash_lockset_new(stash, 60);
+	stash_lockset_add(b, tid, rids[1]);
+
+	if ((res = stash_lockset_acquire(a)) != STASH_ERR_OK) {
+		sprintf(_reason, "acquire failed: %s", stash_err_text(res));
+	}
+	else if ((res = stash_lockset_release(a)) != STASH_ERR_OK) {
+		sprintf(_reason, "release failed: %s", stash_err_text(res));
+	}
+	else if (a->lockid != 0) {
+		sprintf(_reason, "set still has a lock id after it was released");
+	}
+	else if ((res = stash_lockset_acquire(b)) != STASH_ERR_OK) {
+		sprintf(_reason, "released row could not be locked again (%s)", stash_err_text(res));
+	}
+	else if ((res = stash_lockset_acquire(a)) != STASH_ERR_LOCKED) {
+		sprintf(_reason, "released set was acquired again over a held row (%s)", stash_err_text(res));
+	}
+	else {
+		// freeing a set that is held releases it.
+		stash_lockset_free(b);
+		b = NULL;
+		if ((res = stash_lockset_acquire(a)) != STASH_ERR_OK) {
+			sprintf(_reason, "freeing a set did not release it (%s)", stash_err_text(res));
+		}
+	}
+
+	if (b) { stash_lockset_free(b); }
+	stash_lockset_free(a);
+	return(_reason[0] ? _reason : NULL);
+}
+
+
+static const char * check_conditions(stash_t *stash)
+{
+	stash_tableid_t tid;
+	stash_keyid_t kid;
+	stash_value_t *values[3];
+	char got[64];
+
+	tid = check_scores(stash, "conditions", 6, &kid, NULL);
+	_reason[0] = '\0';
+
+	if (strcmp(cond_values(stash, tid, kid, __cond_key_gt(kid, __value_int(4)), got), "5,6") != 0) {
+		sprintf(_reason, "greater than 4 gave %s", got);
+	}
+	else if (strcmp(cond_values(stash, tid, kid, __cond_key_le(kid, __value_int(2)), got), "1,2") != 0) {
+		sprintf(_reason, "less than or equal to 2 gave %s", got);
+	}
+	else if (strcmp(cond_values(stash, tid, kid, __cond_and(__cond_key_ge(kid, __value_int(2)), __cond_key_lt(kid, __value_int(4))), got), "2,3") != 0) {
+		sprintf(_reason, "from 2 and less than 4 gave %s", got);
+	}
+	else if (strcmp(cond_values(stash, tid, kid, __cond_key_between(kid, __value_int(2), __value_int(4)), got), "2,3,4") != 0) {
+		sprintf(_reason, "between 2 and 4 gave %s", got);
+	}
+	else {
+		values[0] = __value_int(6);
+		values[1] = __value_int(1);
+		values[2] = __value_int(3);
+		if (strcmp(cond_values(stash, tid, kid, __cond_key_in(kid, values, 3), got), "1,3,6") != 0) {
+			sprintf(_reason, "in 6,1,3 gave %s", got);
+		}
+	}
+
+	return(_reason[0] ? _reason : NULL);
+}
+
+
+static const char * check_select(stash_t *stash)
+{
+	stash_tableid_t tid;
+	stash_keyid_t ka, kb;
+	stash_attrlist_t *alist;
+	stash_reply_t *reply;
+	stash_query_t *query;
+	int others = 0, total = 0;
+
+	tid = check_table(stash, "select");
+	ka = stash_get_key_id(stash, tid, "a");
+	kb = stash_get_key_id(stash, tid, "b");
+	alist = stash_init_alist(stash);
+	stash_set_attr(alist, ka, __value_int(1), 0);
+	stash_set_attr(alist, kb, __value_str("unwanted"), 0);
+	check_row(stash, tid, "row", alist);
+	_reason[0] = '\0';
+
+	query = stash_query_new(tid);
+	stash_query_select(query, ka);
+	reply = stash_query_execute(stash, query);
+	assert(reply);
+	if (reply->resultcode != STASH_ERR_OK) {
+		sprintf(_reason, "query failed: %s", stash_err_text(reply->resultcode));
+	}
+	else {
+		while (stash_nextrow(reply)) {
+			total += stash_getint(reply, ka);
+			if (stash_getstr(reply, kb)) { others ++; }
+		}
+		if (total != 1) {
+			sprintf(_reason, "the selected key was not returned");
+		}
+		else if (others > 0) {
+			sprintf(_reason, "a key that wasn't selected was returned");
+		}
+	}
+	stash_return_reply(reply);
+
+	stash_query_free(query);
+	return(_reason[0] ? _reason : NULL);
+}
+
+
+static const char * check_get_rows(stash_t *stash)
+{
+	stash_tableid_t tid;
+	stash_keyid_t kid;
+	stash_rowid_t rids[4], list[4];
+	stash_reply_t *reply;
+	char got[64];
+
+	tid = check_scores(stash, "get-rows", 4, &kid, rids);
+	_reason[0] = '\0';
+
+	// in the order asked for, with repeats and missing rows left out.
+	list[0] = rids[3];
+	list[1] = rids[0];
+	list[2] = rids[3];
+	list[3] = rids[3] + 1000;
+	reply = stash_get_rows(stash, tid, list, 4, &kid, 1);
+	assert(reply);
+	if (reply->resultcode != STASH_ERR_OK) {
+		sprintf(_reason, "get rows failed: %s", stash_err_text(reply->resultcode));
+	}
+	else {
+		row_values(reply, kid, got);
+		if (strcmp(got, "4,1") != 0) {
+			sprintf(_reason, "rows %d,%d,%d,%d gave %s", list[0], list[1], list[2], list[3], got);
+		}
+	}
+	stash_return_reply(reply);
+
+	return(_reason[0] ? _reason : NULL);
+}
+
+
+static const char * check_where(stash_t *stash)
+{
+	stash_tableid_t tid;
+	stash_keyid_t kid;
+	stash_result_t res;
+	stash_query_t *query;
+	stash_cond_t *cond;
+	char got[64];
+	int count = -1;
+
+	tid = check_scores(stash, "where", 5, &kid, NULL);
+	_reason[0] = '\0';
+	query = stash_query_new(tid);
+	stash_query_sort(query, kid, 0);
+
+	cond = __cond_key_lt(kid, __value_int(3));
+	res = stash_delete_where(stash, tid, cond, &count);
+	stash_cond_free(cond);
+	if (res != STASH_ERR_OK) {
+		sprintf(_reason, "delete failed: %s", stash_err_text(res));
+	}
+	else if (strcmp(query_values(stash, query, kid, got), "3,4,5") != 0 || count != 2) {
+		sprintf(_reason, "delete of 2 rows said %d, and left %s", count, got);
+	}
+	else {
+		// expiries are in seconds, so wait long enough to be sure it has passed.
+		count = -1;
+		cond = __cond_key_ge(kid, __value_int(5));
+		res = stash_expire_where(stash, tid, cond, 0, 1, &count);
+		stash_cond_free(cond);
+		if (res != STASH_ERR_OK) {
+			sprintf(_reason, "expire failed: %s", stash_err_text(res));
+		}
+		else {
+			sleep(2);
+			if (strcmp(query_values(stash, query, kid, got), "3,4") != 0 || count != 1) {
+				sprintf(_reason, "expiry of 1 row said %d, and left %s", count, got);
+			}
+		}
+	}
+
+	// a failure comes back as the error, not as a count.
+	if (_reason[0] == '\0') {
+		cond = __cond_key_lt(kid, __value_int(3));
+		res = stash_delete_where(stash, tid + 1000, cond, &count);
+		stash_cond_free(cond);
+		if (res != STASH_ERR_TABLENOTEXIST) {
+			sprintf(_reason, "delete from a missing table gave '%s'", stash_err_text(res));
+		}
+	}
+
+	stash_query_free(query);
+	return(_reason[0] ? _reason : NULL);
+}
+
+
+// the result of an update, and the value of the key that came back.
+static stash_result_t update_value(stash_t *stash, stash_tableid_t tid, stash_rowid_t rid, stash_keyid_t kid, int op, stash_value_t *value, stash_value_t *expected, char *out)
+{
+	stash_reply_t *reply;
+	stash_result_t res;
+	const char *str;
+
+	reply = stash_update(stash, tid, rid, kid, op, value, expected);
+	assert(reply);
+	res = reply->resultcode;
+	out[0] = '\0';
+	if (res == STASH_ERR_OK && stash_nextrow(reply)) {
+		if ((str = stash_getstr(reply, kid))) { strcpy(out, str); }
+		else { sprintf(out, "%d", stash_getint(reply, kid)); }
+	}
+	stash_return_reply(reply);
+
+	return(res);
+}
+
+
+static const char * check_update(stash_t *stash)
+{
+	stash_tableid_t tid;
+	stash_keyid_t kid, kname;
+	stash_rowid_t rid;
+	stash_result_t res;
+	char got[64];
+
+	tid = check_scores(stash, "update", 1, &kid, &rid);
+	kname = stash_get_key_id(stash, tid, "label");
+	_reason[0] = '\0';
+
+	if ((res = update_value(stash, tid, rid, kid, STASH_UPDATE_INCREMENT, __value_int(5), NULL, got)) != STASH_ERR_OK || strcmp(got, "6") != 0) {
+		sprintf(_reason, "increment of 1 by 5 gave %s (%s)", got, stash_err_text(res));
+	}
+	else if ((res = update_value(stash, tid, rid, kid, STASH_UPDATE_DECREMENT, __value_int(2), NULL, got)) != STASH_ERR_OK || strcmp(got, "4") != 0) {
+		sprintf(_reason, "decrement of 6 by 2 gave %s (%s)", got, stash_err_text(res));
+	}
+	else if ((res = update_value(stash, tid, rid, kname, STASH_UPDATE_SET_IF_ABSENT, __value_str("ab"), NULL, got)) != STASH_ERR_OK || strcmp(got, "ab") != 0) {
+		sprintf(_reason, "set if absent on a missing key gave %s (%s)", got, stash_err_text(res));
+	}
+	else if ((res = update_value(stash, tid, rid, kname, STASH_UPDATE_SET_IF_ABSENT, __value_str("xy"), NULL, got)) != STASH_ERR_OK || strcmp(got, "ab") != 0) {
+		sprintf(_reason, "set if absent on a set key gave %s (%s)", got, stash_err_text(res));
+	}
+	else if ((res = update_value(stash, tid, rid, kname, STASH_UPDATE_APPEND, __value_str("cd"), NULL, got)) != STASH_ERR_OK || strcmp(got, "abcd") != 0) {
+		sprintf(_reason, "append gave %s (%s)", got, stash_err_text(res));
+	}
+	else if ((res = update_value(stash, tid, rid, kid, STASH_UPDATE_COMPARE_SET, __value_int(9), __value_int(5), got)) != STASH_ERR_VALUEMISMATCH) {
+		sprintf(_reason, "compare and set with the wrong value gave '%s'", stash_err_text(res));
+	}
+	else if ((res = update_value(stash, tid, rid, kid, STASH_UPDATE_COMPARE_SET, __value_int(9), __value_int(4), got)) != STASH_ERR_OK || strcmp(got, "9") != 0) {
+		sprintf(_reason, "compare and set gave %s (%s)", got, stash_err_text(res));
+	}
+
+	return(_reason[0] ? _reason : NULL);
+}
+
+
+static const char * check_upsert(stash_t *stash)
+{
+	stash_tableid_t tid;
+	stash_keyid_t kid;
+	stash_attrlist_t *alist;
+	stash_rowid_t rid = 0, again = 0;
+	stash_result_t res;
+	stash_query_t *query;
+	char got[64];
+	int created = -1;
+
+	tid = check_table(stash, "upsert");
+	kid = stash_get_key_id(stash, tid, "score");
+	_reason[0] = '\0';
+
+	alist = stash_init_alist(stash);
+	stash_set_attr(alist, kid, __value_int(1), 0);
+	res = stash_upsert(stash, tid, 0, "row", alist, 0, &rid, &created);
+	stash_free_alist(stash, alist);
+	if (res != STASH_ERR_OK || rid <= 0 || created != 1) {
+		sprintf(_reason, "first upsert gave rowid %d, created %d (%s)", rid, created, stash_err_text(res));
+	}
+	else {
+		alist = stash_init_alist(stash);
+		stash_set_attr(alist, kid, __value_int(2), 0);
+		res = stash_upsert(stash, tid, 0, "row", alist, 0, &again, &created);
+		stash_free_alist(stash, alist);
+		query = stash_query_new(tid);
+		if (res != STASH_ERR_OK || again != rid || created != 0) {
+			sprintf(_reason, "second upsert gave rowid %d (not %d), created %d (%s)", again, rid, created, stash_err_text(res));
+		}
+		else if (strcmp(query_values(stash, query, kid, got), "2") != 0) {
+			sprintf(_reason, "after the second upsert the rows were %s", got);
+		}
+		stash_query_free(query);
+	}
+
+	return(_reason[0] ? _reason : NULL);
+}
+
+
+static const char * check_not_modified(stash_t *stash)
+{
+	stash_tableid_t tid;
+	stash_keyid_t kid;
+	stash_rowid_t rids[3];
+	stash_reply_t *reply, *previous;
+	stash_query_t *query;
+	char got[64];
+
+	tid = check_scores(stash, "not-modified", 3, &kid, rids);
+	_reason[0] = '\0';
+
+	query = stash_query_new(tid);
+	stash_query_sort(query, kid, 0);
+	previous = stash_query_execute(stash, query);
+	assert(previous && previous->resultcode == STASH_ERR_OK);
+	row_values(previous, kid, got);
+
+	// unchanged, the same reply comes back, ready to read again.
+	stash_query_if_modified(query, previous);
+	reply = stash_query_execute(stash, query);
+	assert(reply);
+	if (reply->resultcode != STASH_ERR_OK) {
+		sprintf(_reason, "conditional query failed: %s", stash_err_text(reply->resultcode));
+	}
+	else if (reply->version == 0) {
+		sprintf(_reason, "the result had no version");
+	}
+	else if (reply->not_modified == 0 || reply != previous) {
+		sprintf(_reason, "unchanged result was sent again");
+	}
+	else if (strcmp(row_values(reply, kid, got), "1,2,3") != 0) {
+		sprintf(_reason, "unchanged result read as %s", got);
+	}
+
+	// once a row has changed, the new rows come back.
+	if (_reason[0] == '\0') {
+		stash_query_if_modified(query, reply);
+		stash_return_reply(stash_update(stash, tid, rids[0], kid, STASH_UPDATE_INCREMENT, __value_int(10), NULL));
+		reply = stash_query_execute(stash, query);
+		assert(reply);
+		if (reply->resultcode != STASH_ERR_OK || reply->not_modified) {
+			sprintf(_reason, "changed result was not sent");
+		}
+		else if (strcmp(row_values(reply, kid, got), "2,3,11") != 0) {
+			sprintf(_reason, "changed result read as %s", got);
+		}
+	}
+	stash_return_reply(reply);
+
+	stash_query_free(query);
+	return(_reason[0] ? _reason : NULL);
+}
+
+
+typedef struct {
+	const char *name;
+	const char * (*fn)(stash_t *stash);
+} check_t;
+
+static check_t _checks[] = {
+	{ "cache-sort", check_cache_sort },
+	{ "cache-if-modified", check_cache_if_modified },
+	{ "cache-shared", check_cache_shared },
+	{ "aggregate", check_aggregate },
+	{ "continue", check_continue },
+	{ "lockset-acquire", check_lockset_acquire },
+	{ "lockset-renew", check_lockset_renew },
+	{ "lockset-release", check_lockset_release },
+	{ "conditions", check_conditions },
+	{ "select", check_select },
+	{ "get-rows", check_get_rows },
+	{ "where", check_where },
+	{ "update", check_update },
+	{ "upsert", check_upsert },
+	{ "not-modified", check_not_modified },
+	{ NULL, NULL }
+};
+
+
+static void usage(void)
+{
+	printf(
+		"Usage: stash-check [options] [filter]\n"
+		"  -H <host>      server to connect to, or a unix socket path (default %s)\n"
+		"  -u <username>  username (default %s)\n"
+		"  -p <password>  password (default %s)\n"
+		"  -N <namespace> namespace (default %s)\n"
+		"  -h             this help\n",
+		_host, _username, _password, _namespace);
+}
+
+
+int main(int argc, char **argv)
+{
+	const char *filter = NULL, *reason;
+	stash_t *stash;
+	int c, i, failed = 0;
+
+	while ((c = getopt(argc, argv, "H:u:p:N:h")) != -1) {
+		switch (c) {
+			case 'H': _host = optarg;       break;
+			case 'u': _username = optarg;   break;
+			case 'p': _password = optarg;   break;
+			case 'N': _namespace = optarg;  break;
+			case 'h': usage(); exit(0);
+			default:  usage(); exit(255);
+		}
+	}
+	if (optind < argc) { filter = argv[optind]; }
+
+	_nonce = (long) time(NULL);
+
+	for (i=0; _checks[i].name; i++) {
+		if (filter && strstr(_checks[i].name, filter) == NULL) { continue; }
+
+		stash = check_connect();
+		reason = (*_checks[i].fn)(stash);
+		stash_free(stash);
+
+		if (reason) {
+			printf("FAIL %s: %s\n", _checks[i].name, reason);
+			failed ++;
+		}
+		else {
+			printf("ok   %s\n", _checks[i].name);
+		}
+	}
+
+	return(failed);
+}
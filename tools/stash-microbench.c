@@ -0,0 +1,524 @@
+//-----------------------------------------------------------------------------
+// stash-microbench
+// Times the CPU-bound parts of the library on synthetic buffers, with no
+// socket involved: building values, conditions and requests, decoding
+// replies, sorting them, and reading attributes out of them.  Each benchmark
+// reports the time and the number of allocations per operation, so a change
+// to one of those paths can be measured on its own.
+//
+// The library source is included directly so that the internal functions
+// (build_condition, parsereply, and so on) can be called the same way the
+// request path calls them.
+//
+// Usage: stash-microbench [-t <msec per benchmark>] [filter]
+//    where only the benchmarks with 'filter' in their name are run.
+
+#include "libstash.c"
+
+#include <time.h>
+#include <unistd.h>
+
+
+//-----------------------------------------------------------------------------
+// Allocation counting.  glibc lets an executable replace malloc, which also
+// catches the allocations made inside librisp, libexpbuf and liblinklist.
+
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t nmemb, size_t size);
+extern void * __libc_realloc(void *ptr, size_t size);
+extern void   __libc_free(void *ptr);
+
+static unsigned long long _allocs = 0;
+
+void * malloc(size_t size)
+{
+	_allocs ++;
+	return(__libc_malloc(size));
+}
+
+void * calloc(size_t nmemb, size_t size)
+{
+	_allocs ++;
+	return(__libc_calloc(nmemb, size));
+}
+
+void * realloc(void *ptr, size_t size)
+{
+	_allocs ++;
+	return(__libc_realloc(ptr, size));
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+
+//-----------------------------------------------------------------------------
+// The harness.  Each benchmark function is given a count and performs the
+// operation that many times.  The count is raised until the run takes at
+// least the minimum time.  Set-up work inside the loop can be left out of the
+// measurement with bench_stop() and bench_start().
+
+typedef struct {
+	long long n;
+	long long start;
+	long long elapsed;			// nanoseconds
+	unsigned long long allocs_start;
+	unsigned long long allocs;
+	long long bytes;			// bytes processed per operation, if it makes sense.
+	int running;
+} bench_t;
+
+typedef struct {
+	const char *name;
+	void (*fn)(bench_t *b, int rows, int wide);
+	int rows;
+	int wide;
+} benchmark_t;
+
+
+static long long _min_time = 500000000LL;
+
+
+static void bench_start(bench_t *b)
+{
+	assert(b && b->running == 0);
+	b->running = 1;
+	b->allocs_start = _allocs;
+	b->start = now_nsec();
+}
+
+static void bench_stop(bench_t *b)
+{
+	long long now = now_nsec();
+
+	assert(b && b->running);
+	b->elapsed += now - b->start;
+	b->allocs += _allocs - b->allocs_start;
+	b->running = 0;
+}
+
+
+static void run_benchmark(const benchmark_t *bm)
+{
+	bench_t b;
+	long long n = 1, next;
+
+	assert(bm);
+
+	for (;;) {
+		memset(&b, 0, sizeof(b));
+		b.n = n;
+		bench_start(&b);
+		bm->fn(&b, bm->rows, bm->wide);
+		bench_stop(&b);
+
+		if (b.elapsed >= _min_time || n >= 1000000000LL) { break; }
+
+		// aim a bit past the minimum, but dont grow too fast on a noisy first run.
+		next = b.elapsed > 0 ? (long long) (n * 1.2 * _min_time / b.elapsed) : n * 100;
+		if (next > n * 100) { next = n * 100; }
+		if (next <= n) { next = n + 1; }
+		n = next;
+	}
+
+	printf("%-32s %10lld %14.1f ns/op %10.2f allocs/op", bm->name, b.n,
+		(double) b.elapsed / b.n, (double) b.allocs / b.n);
+	if (b.bytes > 0) {
+		printf(" %10.1f MB/s", ((double) b.bytes * b.n / 1000000.0) / (b.elapsed / 1000000000.0));
+	}
+	printf("\n");
+}
+
+
+//-----------------------------------------------------------------------------
+// Synthetic data.  A narrow row has 4 attributes, a wide one has 32.  Odd
+// keys hold integers and even keys hold strings (10 bytes narrow, 32 wide).
+
+#define NARROW_KEYS  (4)
+#define WIDE_KEYS    (32)
+
+static stash_t *_stash = NULL;
+
+
+static int row_keys(int wide)
+{
+	return(wide ? WIDE_KEYS : NARROW_KEYS);
+}
+
+static void make_string(char *str, int wide, unsigned int seed)
+{
+	int len = wide ? 32 : 10;
+	int i;
+
+	assert(str);
+	sprintf(str, "v%08x", seed);
+	for (i=strlen(str); i<len; i++) { str[i] = 'a' + (i % 26); }
+	str[len] = '\0';
+}
+
+static stash_value_t * make_value(stash_keyid_t kid, int wide, unsigned int *seed)
+{
+	char str[64];
+
+	assert(seed);
+	if (kid & 1) { return(__value_int(rand_r(seed) % 1000000)); }
+	make_string(str, wide, rand_r(seed));
+	return(__value_str(str));
+}
+
+
+// build a complete reply frame, the same as the server would send back for a
+// query returning 'rows' rows.
+static expbuf_t * make_reply(int rows, int wide)
+{
+	expbuf_t *reply, *payload, *row, *attr, *value;
+	stash_value_t *val;
+	unsigned int seed = 1;
+	int i;
+	stash_keyid_t kid;
+
+	reply = expbuf_init(NULL, 0);
+	payload = expbuf_init(NULL, 0);
+	row = expbuf_init(NULL, 0);
+	attr = expbuf_init(NULL, 0);
+	value = expbuf_init(NULL, 0);
+
+	rispbuf_addInt(payload, STASH_CMD_REQUEST_ID, 1);
+	rispbuf_addInt(payload, STASH_CMD_COUNT, rows);
+	for (i=0; i<rows; i++) {
+		rispbuf_addInt(row, STASH_CMD_ROW_ID, i + 1);
+		rispbuf_addInt(row, STASH_CMD_NAME_ID, i + 1);
+		for (kid=1; kid<=row_keys(wide); kid++) {
+			val = make_value(kid, wide, &seed);
+			stash_build_value(value, val);
+			stash_free_value(val);
+
+			rispbuf_addInt(attr, STASH_CMD_KEY_ID, kid);
+			rispbuf_addBuffer(attr, STASH_CMD_VALUE, value);
+			rispbuf_addBuffer(row, STASH_CMD_ATTRIBUTE, attr);
+			expbuf_clear(value);
+			expbuf_clear(attr);
+		}
+		rispbuf_addBuffer(payload, STASH_CMD_ROW, row);
+		expbuf_clear(row);
+	}
+	rispbuf_addBuffer(reply, STASH_CMD_REPLY, payload);
+
+	expbuf_free(payload);
+	expbuf_free(row);
+	expbuf_free(attr);
+	expbuf_free(value);
+
+	return(reply);
+}
+
+
+// decode a reply frame the same way send_request_on() does.
+static stash_reply_t * decode_reply(expbuf_t *frame)
+{
+	stash_reply_t *reply;
+	risp_t *risp;
+	risp_length_t processed;
+
+	assert(frame);
+
+	risp = risp_init(NULL);
+	assert(risp);
+	processed = risp_process(risp, NULL, BUF_LENGTH(frame), BUF_DATA(frame));
+	assert(processed == BUF_LENGTH(frame));
+	reply = parsereply(_stash, risp);
+	assert(reply);
+	risp_shutdown(risp);
+
+	return(reply);
+}
+
+static stash_attrlist_t * make_alist(int wide)
+{
+	stash_attrlist_t *alist;
+	unsigned int seed = 1;
+	stash_keyid_t kid;
+
+	alist = stash_init_alist(_stash);
+	for (kid=1; kid<=row_keys(wide); kid++) {
+		stash_set_attr(alist, kid, make_value(kid, wide, &seed), 0);
+	}
+
+	return(alist);
+}
+
+// mix the rows of a reply up, so that every sort starts from the same disorder.
+static void shuffle_reply(stash_reply_t *reply, unsigned int seed)
+{
+	replyrow_t **list, *tmp;
+	int total, i, j;
+
+	assert(reply);
+
+	total = ll_count(reply->rows);
+	list = __libc_malloc(sizeof(replyrow_t *) * total);
+	assert(list);
+	for (i=0; i<total; i++) { list[i] = ll_pop_head(reply->rows); }
+	for (i=total-1; i>0; i--) {
+		j = rand_r(&seed) % (i + 1);
+		tmp = list[i]; list[i] = list[j]; list[j] = tmp;
+	}
+	for (i=0; i<total; i++) { ll_push_tail(reply->rows, list[i]); }
+	__libc_free(list);
+}
+
+
+//-----------------------------------------------------------------------------
+// Encoding.
+
+static void bm_value_int(bench_t *b, int rows, int wide)
+{
+	stash_value_t *value;
+	expbuf_t *buf;
+	long long i;
+
+	bench_stop(b);
+	value = __value_int(123456);
+	buf = expbuf_init(NULL, 0);
+	bench_start(b);
+
+	for (i=0; i<b->n; i++) {
+		stash_build_value(buf, value);
+		expbuf_clear(buf);
+	}
+
+	bench_stop(b);
+	stash_free_value(value);
+	expbuf_free(buf);
+	bench_start(b);
+}
+
+static void bm_value_str(bench_t *b, int rows, int wide)
+{
+	stash_value_t *value;
+	expbuf_t *buf;
+	char str[64];
+	long long i;
+
+	bench_stop(b);
+	make_string(str, wide, 1);
+	value = __value_str(str);
+	buf = expbuf_init(NULL, 0);
+	bench_start(b);
+
+	for (i=0; i<b->n; i++) {
+		stash_build_value(buf, value);
+		expbuf_clear(buf);
+	}
+
+	bench_stop(b);
+	stash_free_value(value);
+	expbuf_free(buf);
+	bench_start(b);
+}
+
+// wide selects a nested condition instead of a single comparison.
+static void bm_condition(bench_t *b, int rows, int wide)
+{
+	stash_cond_t *cond;
+	stash_value_t *values[8];
+	expbuf_t *buf;
+	long long i;
+	int j;
+
+	bench_stop(b);
+	if (wide == 0) {
+		cond = __cond_key_equals(1, __value_int(42));
+	}
+	else {
+		for (j=0; j<8; j++) { values[j] = __value_int(j * 100); }
+		cond = __cond_and(
+			__cond_key_between(1, __value_int(10), __value_int(500)),
+			__cond_or(
+				__cond_key_equals(2, __value_str("something")),
+				__cond_key_in(3, values, 8)));
+	}
+	buf = expbuf_init(NULL, 0);
+	bench_start(b);
+
+	for (i=0; i<b->n; i++) {
+		build_condition(buf, cond);
+		expbuf_clear(buf);
+	}
+
+	bench_stop(b);
+	stash_cond_free(cond);
+	expbuf_free(buf);
+	bench_start(b);
+}
+
+// the whole request, including the REQUEST framing from send_request_on().
+static void bm_create_row(bench_t *b, int rows, int wide)
+{
+	stash_attrlist_t *alist;
+	long long i;
+
+	bench_stop(b);
+	alist = make_alist(wide);
+	bench_start(b);
+
+	for (i=0; i<b->n; i++) {
+		build_create_row(_stash, 1, 0, "somerowname", alist, 0);
+
+		rispbuf_addInt(_stash->buf_payload, STASH_CMD_REQUEST_ID, 1);
+		rispbuf_addBuffer(_stash->buf_payload, STASH_CMD_SET, _stash->buf_set);
+		rispbuf_addBuffer(_stash->buf_request, STASH_CMD_REQUEST, _stash->buf_payload);
+		b->bytes = BUF_LENGTH(_stash->buf_request);
+
+		expbuf_clear(_stash->buf_set);
+		expbuf_clear(_stash->buf_payload);
+		expbuf_clear(_stash->buf_request);
+	}
+
+	bench_stop(b);
+	stash_free_alist(_stash, alist);
+	bench_start(b);
+}
+
+
+//-----------------------------------------------------------------------------
+// Decoding and reading.
+
+static void bm_decode(bench_t *b, int rows, int wide)
+{
+	expbuf_t *frame;
+	long long i;
+
+	bench_stop(b);
+	frame = make_reply(rows, wide);
+	b->bytes = BUF_LENGTH(frame);
+	bench_start(b);
+
+	for (i=0; i<b->n; i++) {
+		stash_return_reply(decode_reply(frame));
+	}
+
+	bench_stop(b);
+	expbuf_free(frame);
+	bench_start(b);
+}
+
+// walk every row reading the first and last keys of each type.
+static void bm_access(bench_t *b, int rows, int wide)
+{
+	expbuf_t *frame;
+	stash_reply_t *reply;
+	stash_keyid_t last_int, last_str;
+	long long i;
+	long total = 0;
+
+	bench_stop(b);
+	frame = make_reply(rows, wide);
+	reply = decode_reply(frame);
+	last_int = row_keys(wide) - 1;
+	last_str = row_keys(wide);
+	bench_start(b);
+
+	for (i=0; i<b->n; i++) {
+		while (stash_nextrow(reply)) {
+			total += stash_getint(reply, 1);
+			total += stash_getint(reply, last_int);
+			total += stash_getstr(reply, 2)[0];
+			total += stash_getstr(reply, last_str)[0];
+		}
+		stash_reply_reset(reply);
+	}
+
+	bench_stop(b);
+	stash_return_reply(reply);
+	expbuf_free(frame);
+	assert(total != 0);
+	bench_start(b);
+}
+
+// wide selects a two key sort (string, then integer) instead of one integer.
+static void bm_sort(bench_t *b, int rows, int wide)
+{
+	expbuf_t *frame;
+	stash_reply_t *reply;
+	stash_sortentry_t *sort;
+	long long i;
+
+	bench_stop(b);
+	frame = make_reply(rows, 0);
+	reply = decode_reply(frame);
+	sort = wide ? stash_sortentry(2, 0, stash_sortentry(1, 1, NULL)) : stash_sortentry(1, 0, NULL);
+	bench_start(b);
+
+	for (i=0; i<b->n; i++) {
+		bench_stop(b);
+		shuffle_reply(reply, i + 1);
+		bench_start(b);
+
+		stash_sort(reply, sort);
+	}
+
+	bench_stop(b);
+	stash_sortentry_free(sort);
+	stash_return_reply(reply);
+	expbuf_free(frame);
+	bench_start(b);
+}
+
+
+static const benchmark_t _benchmarks[] = {
+	{ "encode/value/int",           bm_value_int,  0,     0 },
+	{ "encode/value/str10",         bm_value_str,  0,     0 },
+	{ "encode/value/str32",         bm_value_str,  0,     1 },
+	{ "encode/condition/simple",    bm_condition,  0,     0 },
+	{ "encode/condition/nested",    bm_condition,  0,     1 },
+	{ "encode/create_row/narrow",   bm_create_row, 0,     0 },
+	{ "encode/create_row/wide",     bm_create_row, 0,     1 },
+	{ "decode/narrow/1",            bm_decode,     1,     0 },
+	{ "decode/narrow/100",          bm_decode,     100,   0 },
+	{ "decode/narrow/10000",        bm_decode,     10000, 0 },
+	{ "decode/wide/1",              bm_decode,     1,     1 },
+	{ "decode/wide/100",            bm_decode,     100,   1 },
+	{ "decode/wide/10000",          bm_decode,     10000, 1 },
+	{ "access/narrow/100",          bm_access,     100,   0 },
+	{ "access/wide/100",            bm_access,     100,   1 },
+	{ "sort/int/100",               bm_sort,       100,   0 },
+	{ "sort/int/10000",             bm_sort,       10000, 0 },
+	{ "sort/str_int/10000",         bm_sort,       10000, 1 },
+	{ NULL, NULL, 0, 0 }
+};
+
+
+int main(int argc, char **argv)
+{
+	int c, i;
+	const char *filter = NULL;
+
+	while ((c = getopt(argc, argv, "t:h")) != -1) {
+		switch (c) {
+			case 't': _min_time = atol(optarg) * 1000000LL;  break;
+			case 'h':
+			default:
+				printf("Usage: stash-microbench [-t <msec per benchmark>] [filter]\n");
+				exit(c == 'h' ? 0 : 1);
+		}
+	}
+	if (optind < argc) { filter = argv[optind]; }
+
+	// the handle is never connected, it only provides the buffers and the
+	// risp objects that the internal functions expect.
+	_stash = stash_init(NULL);
+	assert(_stash);
+	_stash->curr_nsid = 1;
+
+	for (i=0; _benchmarks[i].name; i++) {
+		if (filter == NULL || strstr(_benchmarks[i].name, filter)) {
+			run_benchmark(&_benchmarks[i]);
+		}
+	}
+
+	stash_free(_stash);
+	return(0);
+}
@@ -0,0 +1,276 @@
+//-----------------------------------------------------------------------------
+// stash-replay
+// Plays back a traffic capture made with stash_capture().
+//
+// Without a server, the recorded replies are fed through the reply decoder on
+// their own, which measures the decoding cost of a real query mix.  With a
+// server (-H), the recorded requests are sent exactly as they were captured,
+// one at a time as the library does, and the time for each reply is measured.
+// Ids (namespace, table, key and row) are sent as they were recorded, so the
+// server should hold the same data as the one the capture was taken from,
+// normally a stand-in that was filled by the same application.
+//
+// By default everything is played back as fast as possible.  With -r the
+// original gaps between messages are kept.
+//
+// The library source is included directly so that the replies are decoded and
+// the requests sent with the same code that the library uses.
+
+#include "libstash.c"
+
+
+typedef struct {
+	char type;
+	long long time;			// microseconds from the start of the capture.
+	int length;
+	char *data;
+} record_t;
+
+
+static record_t *_records = NULL;
+static int _record_count = 0;
+static char *_file = NULL;
+
+
+// read the whole capture into memory, so that file access isn't measured.
+static int load_capture(const char *path)
+{
+	FILE *fp;
+	long size, pos;
+	unsigned char *ptr;
+	int i, max = 0;
+
+	assert(path);
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) { return(-1); }
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	_file = malloc(size > 0 ? size : 1);
+	assert(_file);
+	if (fread(_file, 1, size, fp) != (size_t) size) { fclose(fp); return(-1); }
+	fclose(fp);
+
+	if (size < 9 || memcmp(_file, CAPTURE_MAGIC, 8) != 0 || _file[8] != CAPTURE_VERSION) {
+		return(-1);
+	}
+
+	pos = 9;
+	while (pos + 13 <= size) {
+		if (_record_count == max) {
+			max = max ? max * 2 : 1024;
+			_records = realloc(_records, sizeof(record_t) * max);
+			assert(_records);
+		}
+
+		ptr = (unsigned char *) _file + pos;
+		_records[_record_count].type = ptr[0];
+		_records[_record_count].time = 0;
+		for (i=0; i<8; i++) { _records[_record_count].time = (_records[_record_count].time << 8) | ptr[1+i]; }
+		_records[_record_count].length = 0;
+		for (i=0; i<4; i++) { _records[_record_count].length = (_records[_record_count].length << 8) | ptr[9+i]; }
+		_records[_record_count].data = _file + pos + 13;
+
+		// a capture that was cut short may end part way through a record.
+		if (pos + 13 + _records[_record_count].length > size) { break; }
+		pos += 13 + _records[_record_count].length;
+		_record_count ++;
+	}
+
+	return(0);
+}
+
+
+// wait until the recorded time of the message, relative to the start.
+static void pace(long long start, long long recorded)
+{
+	long long wait;
+
+	wait = (start + recorded) - now_usec();
+	if (wait > 0) { usleep(wait); }
+}
+
+
+static int longlong_fn(const void *a, const void *b)
+{
+	const long long *aa = a;
+	const long long *bb = b;
+	return(*aa < *bb ? -1 : (*aa > *bb ? 1 : 0));
+}
+
+
+static void replay_decode(int loops, int paced)
+{
+	stash_t *stash;
+	stash_reply_t *reply;
+	risp_t *risp;
+	risp_length_t processed;
+	long long start, loop_start, bytes = 0, rows = 0, failed = 0;
+	long count = 0;
+	double elapsed;
+	int i, l;
+
+	// the handle is never connected, it only provides the risp objects.
+	stash = stash_init(NULL);
+	assert(stash);
+
+	start = now_usec();
+	for (l=0; l<loops; l++) {
+		loop_start = now_usec();
+		for (i=0; i<_record_count; i++) {
+			if (_records[i].type != CAPTURE_REPLY) { continue; }
+			if (paced) { pace(loop_start, _records[i].time); }
+
+			risp = risp_init(NULL);
+			assert(risp);
+			processed = risp_process(risp, NULL, _records[i].length, _records[i].data);
+			assert(processed == _records[i].length);
+			reply = parsereply(stash, risp);
+			assert(reply);
+			risp_shutdown(risp);
+
+			if (reply->resultcode != STASH_ERR_OK) { failed ++; }
+			rows += reply->row_count;
+			bytes += _records[i].length;
+			count ++;
+			stash_return_reply(reply);
+		}
+	}
+	elapsed = (now_usec() - start) / 1000000.0;
+
+	printf("decoded %ld replies (%lld failures, %lld rows, %lld bytes) in %.3fs\n",
+		count, failed, rows, bytes, elapsed);
+	if (count > 0 && elapsed > 0) {
+		printf("  %.1f replies/s  %.1f rows/s  %.1f MB/s  %.0f ns/reply\n",
+			count / elapsed, rows / elapsed, bytes / elapsed / 1000000.0, elapsed * 1000000000.0 / count);
+	}
+
+	stash_free(stash);
+}
+
+
+static void replay_server(const char *host, const char *username, const char *password, int loops, int paced)
+{
+	stash_t *stash;
+	conn_t *conn;
+	risp_t *risp;
+	stash_result_t res;
+	long long start, loop_start, sent_at, bytes_out = 0, bytes_in = 0;
+	long long *latency;
+	long count = 0, requests = 0;
+	double elapsed;
+	int i, l;
+
+	assert(host);
+
+	stash = stash_init(NULL);
+	assert(stash);
+	stash_authority(stash, username, password);
+	stash_addserver(stash, host, 10);
+	res = stash_connect(stash);
+	if (res != STASH_ERR_OK) {
+		fprintf(stderr, "Unable to connect to %s: %s\n", host, stash_err_text(res));
+		exit(1);
+	}
+	conn = ll_get_head(stash->connlist);
+	assert(conn && conn->active);
+
+	for (i=0; i<_record_count; i++) {
+		if (_records[i].type == CAPTURE_REQUEST) { requests ++; }
+	}
+	latency = malloc(sizeof(long long) * (requests * loops + 1));
+	assert(latency);
+
+	start = now_usec();
+	for (l=0; l<loops && conn->active; l++) {
+		loop_start = now_usec();
+		for (i=0; i<_record_count && conn->active; i++) {
+			if (_records[i].type != CAPTURE_REQUEST) { continue; }
+			if (paced) { pace(loop_start, _records[i].time); }
+
+			assert(BUF_LENGTH(stash->buf_request) == 0);
+			expbuf_add(stash->buf_request, _records[i].data, _records[i].length);
+
+			sent_at = now_usec();
+			risp = risp_init(NULL);
+			assert(risp);
+			sock_send_request(stash, conn);
+			if (conn->active) {
+				bytes_in += sock_recv_reply(stash, conn, risp);
+				latency[count++] = now_usec() - sent_at;
+			}
+			risp_shutdown(risp);
+
+			bytes_out += _records[i].length;
+			expbuf_clear(stash->buf_request);
+			expbuf_clear(stash->readbuf);
+		}
+	}
+	elapsed = (now_usec() - start) / 1000000.0;
+
+	if (conn->active == 0) { fprintf(stderr, "Lost connection to %s\n", host); }
+
+	printf("replayed %ld requests (%lld bytes sent, %lld received) in %.3fs\n",
+		count, bytes_out, bytes_in, elapsed);
+	if (count > 0 && elapsed > 0) {
+		qsort(latency, count, sizeof(long long), longlong_fn);
+		printf("  %.1f requests/s  latency usec: p50 %lld  p99 %lld  p99.9 %lld  max %lld\n",
+			count / elapsed, latency[(count - 1) * 50 / 100], latency[(count - 1) * 99 / 100],
+			latency[(count - 1) * 999 / 1000], latency[count - 1]);
+	}
+
+	free(latency);
+	stash_free(stash);
+}
+
+
+static void usage(void)
+{
+	printf(
+		"Usage: stash-replay [options] <capture file>\n"
+		"  -H <host>      send the requests to this server (or unix socket path),\n"
+		"                 otherwise only the replies are decoded\n"
+		"  -u <username>  username for the server (default replay)\n"
+		"  -p <password>  password for the server (default replay)\n"
+		"  -r             keep the recorded timing, instead of full speed\n"
+		"  -n <loops>     play the capture this many times (default 1)\n"
+		"  -h             this help\n");
+}
+
+
+int main(int argc, char **argv)
+{
+	int c, paced = 0, loops = 1;
+	const char *host = NULL, *username = "replay", *password = "replay";
+
+	while ((c = getopt(argc, argv, "H:u:p:rn:h")) != -1) {
+		switch (c) {
+			case 'H': host = optarg;           break;
+			case 'u': username = optarg;       break;
+			case 'p': password = optarg;       break;
+			case 'r': paced = 1;               break;
+			case 'n': loops = atoi(optarg);    break;
+			case 'h': usage(); exit(0);
+			default:  usage(); exit(1);
+		}
+	}
+
+	if (optind >= argc || loops < 1) {
+		usage();
+		exit(1);
+	}
+
+	if (load_capture(argv[optind]) != 0) {
+		fprintf(stderr, "Unable to read capture file '%s'\n", argv[optind]);
+		exit(1);
+	}
+
+	if (host) { replay_server(host, username, password, loops, paced); }
+	else { replay_decode(loops, paced); }
+
+	free(_records);
+	free(_file);
+	return(0);
+}
@@ -0,0 +1,1991 @@
+//-----------------------------------------------------------------------------
+// stash-standin
+// A small stand-in for a stash server.  It speaks the same RISP request and
+// reply framing as the real service, and keeps everything in memory, so that
+// the library can be exercised (and benchmarked) on a single machine.
+//
+// It is not a replacement for the real server.  There is one user, no rights
+// checking, no persistence, and only the operations that the library uses
+// most are supported:
+//    LOGIN, GETID, CREATE_TABLE, SET, UPDATE, QUERY (including aggregates),
+//    DELETE, SET_EXPIRY, DELETE_WHERE, EXPIRE_WHERE, LOCKSET
+// Anything else gets a STASH_ERR_GENERICFAIL reply.
+//
+// Latency (added to every reply) and a bandwidth limit (per connection) can be
+// injected so that client changes can be measured reproducibly.
+
+// needed for ppoll()
+#define _GNU_SOURCE
+
+#include <stash.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define MAX_CLIENTS  (1024)
+
+
+// a value is kept decoded (for comparisons) and encoded (to send back).
+typedef struct {
+	short int valtype;		// STASH_VALTYPE_INT or STASH_VALTYPE_STR
+	int number;
+	char *str;
+	int len;
+} val_t;
+
+typedef struct {
+	stash_keyid_t kid;
+	val_t value;
+	time_t expires;			// 0 if the attribute doesn't expire.
+} sattr_t;
+
+typedef struct __srow_t {
+	stash_rowid_t rid;
+	stash_nameid_t nid;
+	char *name;
+	time_t expires;
+	int count, max;
+	sattr_t *attrs;
+	struct __srow_t *next_name;		// name hash chain.
+} srow_t;
+
+typedef struct {
+	stash_nsid_t nsid;
+	stash_tableid_t tid;
+	char *name;
+	int options;
+
+	char **keys;			// key id is the index+1
+	int key_count;
+
+	srow_t **rows;			// indexed by rowid-1, NULL if deleted.
+	int row_count;			// number of slots used (not the number of live rows)
+	int row_max;
+
+	srow_t **names;			// hash of the row names.
+	int name_slots;
+	int name_count;
+
+	int autoinc;
+} stable_t;
+
+
+// a set of row locks held under one lock id (see LOCKSET).
+typedef struct {
+	stash_lockid_t lockid;
+	stash_nsid_t nsid;
+	long long expires;		// monotonic microseconds.
+	int count;
+	stash_lockentry_t *entries;
+} slock_t;
+
+
+// replies that are waiting for the injected latency to pass.
+typedef struct __pending_t {
+	long long ready;
+	expbuf_t *buf;
+	struct __pending_t *next;
+} pending_t;
+
+typedef struct {
+	int handle;
+	int loggedin;
+	expbuf_t *in;
+	expbuf_t *out;
+	pending_t *pending, *pending_tail;
+	long long bw_last;
+	double bw_credit;
+} client_t;
+
+
+// settings.
+static int _latency = 0;			// microseconds added to each reply.
+static long _bandwidth = 0;			// bytes per second per connection, 0 for unlimited.
+static char *_username = NULL;
+static char *_password = NULL;
+static int _verbose = 0;
+
+// data.
+static char **_namespaces = NULL;	// nsid is the index+1
+static int _ns_count = 0;
+static stable_t **_tables = NULL;	// tid is the index+1
+static int _table_count = 0;
+static slock_t **_locks = NULL;		// NULL slots have been released.
+static int _lock_count = 0;
+static stash_lockid_t _lock_next = 0;
+
+static volatile int _shutdown = 0;
+
+
+//-----------------------------------------------------------------------------
+// message parsing.  The library uses librisp callbacks, but the server needs
+// to walk lists of repeated commands, so it steps through them directly.
+
+typedef struct {
+	const unsigned char *data;
+	int length;
+	int pos;
+
+	int cmd;
+	int value;
+	const unsigned char *param;
+	int paramlen;
+} msg_t;
+
+
+// return the length of the first complete command in the buffer, or 0 if it
+// is not complete yet.
+static int frame_length(const unsigned char *data, int length)
+{
+	int hdr, total;
+
+	assert(data && length >= 0);
+
+	if (length < 1) { return(0); }
+
+	if (data[0] < 64)       { return(1); }
+	else if (data[0] < 96)  { total = 2; }
+	else if (data[0] < 128) { total = 3; }
+	else if (data[0] < 160) { total = 5; }
+	else {
+		if (data[0] < 192)      { hdr = 2; }
+		else if (data[0] < 224) { hdr = 3; }
+		else                    { hdr = 5; }
+
+		if (length < hdr) { return(0); }
+
+		if (hdr == 2)      { total = data[1]; }
+		else if (hdr == 3) { total = (data[1] << 8) | data[2]; }
+		else               { total = ((unsigned int)data[1] << 24) | (data[2] << 16) | (data[3] << 8) | data[4]; }
+		total += hdr;
+	}
+
+	return(length < total ? 0 : total);
+}
+
+
+static void msg_init(msg_t *msg, const unsigned char *data, int length)
+{
+	assert(msg && length >= 0);
+	msg->data = data;
+	msg->length = length;
+	msg->pos = 0;
+}
+
+
+// step to the next command in the message.  Returns 0 at the end (or if the
+// message is malformed).
+static int msg_next(msg_t *msg)
+{
+	const unsigned char *p;
+	int len;
+
+	assert(msg);
+
+	if (msg->pos >= msg->length) { return(0); }
+
+	p = msg->data + msg->pos;
+	len = frame_length(p, msg->length - msg->pos);
+	if (len == 0) { return(0); }
+
+	msg->cmd = p[0];
+	msg->value = 0;
+	msg->param = NULL;
+	msg->paramlen = 0;
+
+	if (p[0] < 64)       { }
+	else if (p[0] < 96)  { msg->value = p[1]; }
+	else if (p[0] < 128) { msg->value = (p[1] << 8) | p[2]; }
+	else if (p[0] < 160) { msg->value = (int) (((unsigned int)p[1] << 24) | (p[2] << 16) | (p[3] << 8) | p[4]); }
+	else {
+		if (p[0] < 192)      { msg->param = p + 2; msg->paramlen = len - 2; }
+		else if (p[0] < 224) { msg->param = p + 3; msg->paramlen = len - 3; }
+		else                 { msg->param = p + 5; msg->paramlen = len - 5; }
+	}
+
+	msg->pos += len;
+	return(1);
+}
+
+
+// copy a string parameter so that it is null terminated.
+static char * msg_str(msg_t *msg)
+{
+	char *str;
+
+	assert(msg);
+	str = malloc(msg->paramlen + 1);
+	assert(str);
+	memcpy(str, msg->param, msg->paramlen);
+	str[msg->paramlen] = 0;
+	return(str);
+}
+
+
+static long long now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(((long long)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
+
+
+//-----------------------------------------------------------------------------
+// values.
+
+// decode the value from the encoded buffer (INTEGER, STRING, NULL or AUTO).
+// Returns 0 if the value could not be decoded.
+static int val_parse(val_t *val, const unsigned char *data, int length, stable_t *table)
+{
+	msg_t msg;
+
+	assert(val);
+	memset(val, 0, sizeof(*val));
+
+	msg_init(&msg, data, length);
+	if (msg_next(&msg) == 0) { return(0); }
+
+	switch (msg.cmd) {
+		case STASH_CMD_INTEGER:
+			val->valtype = STASH_VALTYPE_INT;
+			val->number = msg.value;
+			break;
+		case STASH_CMD_STRING:
+			val->valtype = STASH_VALTYPE_STR;
+			val->str = msg_str(&msg);
+			val->len = msg.paramlen;
+			break;
+		case STASH_CMD_NULL:
+			val->valtype = STASH_VALTYPE_STR;
+			val->str = strdup("");
+			val->len = 0;
+			break;
+		case STASH_CMD_AUTO:
+			// auto values are only meaningful when they are being stored.
+			if (table == NULL) { return(0); }
+			table->autoinc ++;
+			val->valtype = STASH_VALTYPE_INT;
+			val->number = table->autoinc;
+			break;
+		default:
+			return(0);
+	}
+
+	return(1);
+}
+
+static void val_free(val_t *val)
+{
+	assert(val);
+	if (val->str) { free(val->str); val->str = NULL; }
+}
+
+static void val_build(expbuf_t *buf, val_t *val)
+{
+	assert(buf && val);
+	if (val->valtype == STASH_VALTYPE_INT) {
+		rispbuf_addInt(buf, STASH_CMD_INTEGER, val->number);
+	}
+	else if (val->len == 0) {
+		rispbuf_addCmd(buf, STASH_CMD_NULL);
+	}
+	else {
+		rispbuf_addStr(buf, STASH_CMD_STRING, val->len, val->str);
+	}
+}
+
+// integers sort before strings.
+static int val_compare(const val_t *a, const val_t *b)
+{
+	int result;
+
+	assert(a && b);
+	if (a->valtype != b->valtype) {
+		return(a->valtype == STASH_VALTYPE_INT ? -1 : 1);
+	}
+	else if (a->valtype == STASH_VALTYPE_INT) {
+		return(a->number < b->number ? -1 : (a->number > b->number ? 1 : 0));
+	}
+	else {
+		result = memcmp(a->str, b->str, a->len < b->len ? a->len : b->len);
+		if (result == 0) { result = a->len - b->len; }
+		return(result);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// tables and rows.
+
+static stable_t * table_get(stash_nsid_t nsid, stash_tableid_t tid)
+{
+	stable_t *table;
+
+	if (tid <= 0 || tid > _table_count) { return(NULL); }
+	table = _tables[tid-1];
+	assert(table);
+	if (table->nsid != nsid) { return(NULL); }
+	return(table);
+}
+
+static unsigned int name_hash(const char *name)
+{
+	unsigned int hash = 5381;
+	assert(name);
+	while (*name) { hash = (hash * 33) ^ (unsigned char) *name++; }
+	return(hash);
+}
+
+static void name_grow(stable_t *table)
+{
+	srow_t **old, *row, *next;
+	int slots, i;
+	unsigned int h;
+
+	assert(table);
+	old = table->names;
+	slots = table->name_slots;
+
+	table->name_slots = slots ? slots * 2 : 1024;
+	table->names = calloc(table->name_slots, sizeof(srow_t *));
+	assert(table->names);
+
+	for (i=0; i<slots; i++) {
+		for (row = old[i]; row; row = next) {
+			next = row->next_name;
+			h = name_hash(row->name) & (table->name_slots - 1);
+			row->next_name = table->names[h];
+			table->names[h] = row;
+		}
+	}
+	if (old) { free(old); }
+}
+
+static int row_live(srow_t *row, time_t now)
+{
+	return(row && (row->expires == 0 || row->expires > now));
+}
+
+static srow_t * row_byname(stable_t *table, const char *name)
+{
+	srow_t *row;
+
+	assert(table && name);
+	if (table->name_slots == 0) { return(NULL); }
+	row = table->names[name_hash(name) & (table->name_slots - 1)];
+	while (row && strcmp(row->name, name) != 0) {
+		row = row->next_name;
+	}
+	return(row_live(row, time(NULL)) ? row : NULL);
+}
+
+static srow_t * row_byid(stable_t *table, stash_rowid_t rid)
+{
+	assert(table);
+	if (rid <= 0 || rid > table->row_count) { return(NULL); }
+	return(row_live(table->rows[rid-1], time(NULL)) ? table->rows[rid-1] : NULL);
+}
+
+// the name id of a row is the same as the row id.
+static srow_t * row_bynameid(stable_t *table, stash_nameid_t nid)
+{
+	return(row_byid(table, nid));
+}
+
+static srow_t * row_new(stable_t *table, const char *name)
+{
+	srow_t *row;
+	unsigned int h;
+
+	assert(table && name);
+
+	if (table->row_count == table->row_max) {
+		table->row_max = table->row_max ? table->row_max * 2 : 1024;
+		table->rows = realloc(table->rows, sizeof(srow_t *) * table->row_max);
+		assert(table->rows);
+	}
+
+	row = calloc(1, sizeof(*row));
+	assert(row);
+	row->name = strdup(name);
+	table->rows[table->row_count] = row;
+	table->row_count ++;
+	row->rid = table->row_count;
+	row->nid = row->rid;
+
+	if (table->name_count >= table->name_slots) { name_grow(table); }
+	h = name_hash(name) & (table->name_slots - 1);
+	row->next_name = table->names[h];
+	table->names[h] = row;
+	table->name_count ++;
+
+	return(row);
+}
+
+static void row_delete(stable_t *table, srow_t *row)
+{
+	srow_t **pp;
+	int i;
+
+	assert(table && row);
+	assert(table->rows[row->rid-1] == row);
+
+	pp = &table->names[name_hash(row->name) & (table->name_slots - 1)];
+	while (*pp != row) { pp = &(*pp)->next_name; }
+	*pp = row->next_name;
+	table->name_count --;
+
+	table->rows[row->rid-1] = NULL;
+	for (i=0; i<row->count; i++) { val_free(&row->attrs[i].value); }
+	if (row->attrs) { free(row->attrs); }
+	free(row->name);
+	free(row);
+}
+
+static sattr_t * attr_get(srow_t *row, stash_keyid_t kid)
+{
+	int i;
+	sattr_t *attr;
+
+	assert(row && kid > 0);
+	for (i=0; i<row->count; i++) {
+		attr = &row->attrs[i];
+		if (attr->kid == kid) {
+			if (attr->expires > 0 && attr->expires <= time(NULL)) { return(NULL); }
+			return(attr);
+		}
+	}
+	return(NULL);
+}
+
+// set the attribute (takes over the value).
+static sattr_t * attr_set(srow_t *row, stash_keyid_t kid, val_t *value, int expires)
+{
+	int i;
+	sattr_t *attr = NULL;
+
+	assert(row && kid > 0 && value);
+	for (i=0; i<row->count && attr == NULL; i++) {
+		if (row->attrs[i].kid == kid) { attr = &row->attrs[i]; }
+	}
+
+	if (attr) {
+		val_free(&attr->value);
+	}
+	else {
+		if (row->count == row->max) {
+			row->max = row->max ? row->max * 2 : 8;
+			row->attrs = realloc(row->attrs, sizeof(sattr_t) * row->max);
+			assert(row->attrs);
+		}
+		attr = &row->attrs[row->count];
+		row->count ++;
+		attr->kid = kid;
+	}
+
+	attr->value = *value;
+	attr->expires = expires > 0 ? time(NULL) + expires : 0;
+	return(attr);
+}
+
+static void attr_delete(srow_t *row, stash_keyid_t kid)
+{
+	int i;
+
+	assert(row && kid > 0);
+	for (i=0; i<row->count; i++) {
+		if (row->attrs[i].kid == kid) {
+			val_free(&row->attrs[i].value);
+			row->count --;
+			row->attrs[i] = row->attrs[row->count];
+			return;
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// conditions.
+
+// returns 1 if the row matches the condition.  The condition buffer contains
+// a single condition command.
+static int cond_match(stable_t *table, srow_t *row, const unsigned char *data, int length)
+{
+	msg_t msg, sub;
+	stash_keyid_t kid = 0;
+	sattr_t *attr;
+	val_t val, low, high;
+	int cmd, result = 0, cmp, have_low = 0, have_high = 0;
+	const unsigned char *ca = NULL, *cb = NULL;
+	int ca_len = 0, cb_len = 0;
+	char *str;
+
+	assert(table && row);
+
+	msg_init(&msg, data, length);
+	if (msg_next(&msg) == 0) { return(0); }
+	cmd = msg.cmd;
+	msg_init(&sub, msg.param, msg.paramlen);
+
+	switch (cmd) {
+		case STASH_CMD_COND_EQUALS:
+		case STASH_CMD_COND_GT:
+		case STASH_CMD_COND_LT:
+		case STASH_CMD_COND_GE:
+		case STASH_CMD_COND_LE:
+			memset(&val, 0, sizeof(val));
+			while (msg_next(&sub)) {
+				if (sub.cmd == STASH_CMD_KEY_ID) { kid = sub.value; }
+				else if (sub.cmd == STASH_CMD_VALUE) { val_parse(&val, sub.param, sub.paramlen, NULL); }
+			}
+			if (kid > 0 && val.valtype && (attr = attr_get(row, kid))) {
+				cmp = val_compare(&attr->value, &val);
+				switch (cmd) {
+					case STASH_CMD_COND_EQUALS: result = (cmp == 0); break;
+					case STASH_CMD_COND_GT:     result = (cmp > 0);  break;
+					case STASH_CMD_COND_LT:     result = (cmp < 0);  break;
+					case STASH_CMD_COND_GE:     result = (cmp >= 0); break;
+					case STASH_CMD_COND_LE:     result = (cmp <= 0); break;
+				}
+			}
+			val_free(&val);
+			break;
+
+		case STASH_CMD_COND_BETWEEN:
+			while (msg_next(&sub)) {
+				if (sub.cmd == STASH_CMD_KEY_ID) { kid = sub.value; }
+				else if (sub.cmd == STASH_CMD_COND_A) { have_low = val_parse(&low, sub.param, sub.paramlen, NULL); }
+				else if (sub.cmd == STASH_CMD_COND_B) { have_high = val_parse(&high, sub.param, sub.paramlen, NULL); }
+			}
+			if (kid > 0 && have_low && have_high && (attr = attr_get(row, kid))) {
+				result = (val_compare(&attr->value, &low) >= 0 && val_compare(&attr->value, &high) <= 0);
+			}
+			if (have_low) { val_free(&low); }
+			if (have_high) { val_free(&high); }
+			break;
+
+		case STASH_CMD_COND_IN:
+			// KEY_ID followed by the values.
+			while (msg_next(&sub) && result == 0) {
+				if (sub.cmd == STASH_CMD_KEY_ID) {
+					kid = sub.value;
+					if ((attr = attr_get(row, kid)) == NULL) { break; }
+				}
+				else if (kid > 0) {
+					// the values are not wrapped, so compare them directly.
+					memset(&val, 0, sizeof(val));
+					if (sub.cmd == STASH_CMD_INTEGER) { val.valtype = STASH_VALTYPE_INT; val.number = sub.value; }
+					else if (sub.cmd == STASH_CMD_STRING) { val.valtype = STASH_VALTYPE_STR; val.str = (char *) sub.param; val.len = sub.paramlen; }
+					else if (sub.cmd == STASH_CMD_NULL) { val.valtype = STASH_VALTYPE_STR; val.str = ""; val.len = 0; }
+					else { continue; }
+					result = (val_compare(&attr->value, &val) == 0);
+				}
+			}
+			break;
+
+		case STASH_CMD_COND_EXISTS:
+			while (msg_next(&sub)) {
+				if (sub.cmd == STASH_CMD_KEY_ID) { kid = sub.value; }
+			}
+			result = (kid > 0 && attr_get(row, kid) != NULL);
+			break;
+
+		case STASH_CMD_COND_NAME:
+		case STASH_CMD_COND_NAME_IN:
+			while (msg_next(&sub) && result == 0) {
+				if (sub.cmd == STASH_CMD_NAME_ID) { result = (row->nid == sub.value); }
+				else if (sub.cmd == STASH_CMD_NAME) {
+					str = msg_str(&sub);
+					result = (strcmp(row->name, str) == 0);
+					free(str);
+				}
+			}
+			break;
+
+		case STASH_CMD_COND_AND:
+		case STASH_CMD_COND_OR:
+			while (msg_next(&sub)) {
+				if (sub.cmd == STASH_CMD_COND_A) { ca = sub.param; ca_len = sub.paramlen; }
+				else if (sub.cmd == STASH_CMD_COND_B) { cb = sub.param; cb_len = sub.paramlen; }
+			}
+			if (ca && cb) {
+				if (cmd == STASH_CMD_COND_AND) {
+					result = cond_match(table, row, ca, ca_len) && cond_match(table, row, cb, cb_len);
+				}
+				else {
+					result = cond_match(table, row, ca, ca_len) || cond_match(table, row, cb, cb_len);
+				}
+			}
+			break;
+
+		case STASH_CMD_COND_NOT:
+			result = !cond_match(table, row, msg.param, msg.paramlen);
+			break;
+
+		default:
+			if (_verbose) { fprintf(stderr, "unknown condition: %d\n", cmd); }
+			break;
+	}
+
+	return(result);
+}
+
+
+//-----------------------------------------------------------------------------
+// building replies.
+
+static void build_row(expbuf_t *reply, srow_t *row, stash_keyid_t *select, int select_count)
+{
+	expbuf_t *buf_row, *buf_attr, *buf_value;
+	sattr_t *attr;
+	int i, j;
+	time_t now;
+
+	assert(reply && row);
+
+	buf_row = expbuf_init(NULL, 128);
+	buf_attr = expbuf_init(NULL, 64);
+	buf_value = expbuf_init(NULL, 32);
+
+	rispbuf_addInt(buf_row, STASH_CMD_ROW_ID, row->rid);
+	rispbuf_addInt(buf_row, STASH_CMD_NAME_ID, row->nid);
+
+	now = time(NULL);
+	for (i=0; i<row->count; i++) {
+		attr = &row->attrs[i];
+		if (attr->expires > 0 && attr->expires <= now) { continue; }
+
+		if (select_count > 0) {
+			for (j=0; j<select_count && select[j] != attr->kid; j++) {}
+			if (j == select_count) { continue; }
+		}
+
+		rispbuf_addInt(buf_attr, STASH_CMD_KEY_ID, attr->kid);
+		val_build(buf_value, &attr->value);
+		rispbuf_addBuffer(buf_attr, STASH_CMD_VALUE, buf_value);
+		rispbuf_addBuffer(buf_row, STASH_CMD_ATTRIBUTE, buf_attr);
+		expbuf_clear(buf_value);
+		expbuf_clear(buf_attr);
+	}
+
+	rispbuf_addBuffer(reply, STASH_CMD_ROW, buf_row);
+
+	buf_value = expbuf_free(buf_value);
+	buf_attr = expbuf_free(buf_attr);
+	buf_row = expbuf_free(buf_row);
+}
+
+
+// an aggregate group row (see stash.h).  'group' is the group key's attribute
+// (NULL if there is no group key, or the rows in the group don't have it), and
+// 'value' is the aggregate (NULL if nothing was aggregated).
+static void build_group(expbuf_t *reply, sattr_t *group, stash_keyid_t kid, val_t *value, int count)
+{
+	expbuf_t *buf_row, *buf_attr, *buf_value;
+
+	assert(reply && count >= 0);
+
+	buf_row = expbuf_init(NULL, 64);
+	buf_attr = expbuf_init(NULL, 32);
+	buf_value = expbuf_init(NULL, 32);
+
+	rispbuf_addInt(buf_row, STASH_CMD_COUNT, count);
+	if (group) {
+		rispbuf_addInt(buf_attr, STASH_CMD_KEY_ID, group->kid);
+		val_build(buf_value, &group->value);
+		rispbuf_addBuffer(buf_attr, STASH_CMD_VALUE, buf_value);
+		rispbuf_addBuffer(buf_row, STASH_CMD_ATTRIBUTE, buf_attr);
+		expbuf_clear(buf_value);
+		expbuf_clear(buf_attr);
+	}
+	if (value && kid > 0) {
+		rispbuf_addInt(buf_attr, STASH_CMD_KEY_ID, kid);
+		val_build(buf_value, value);
+		rispbuf_addBuffer(buf_attr, STASH_CMD_VALUE, buf_value);
+		rispbuf_addBuffer(buf_row, STASH_CMD_ATTRIBUTE, buf_attr);
+	}
+
+	rispbuf_addBuffer(reply, STASH_CMD_ROW, buf_row);
+
+	buf_value = expbuf_free(buf_value);
+	buf_attr = expbuf_free(buf_attr);
+	buf_row = expbuf_free(buf_row);
+}
+
+
+//-----------------------------------------------------------------------------
+// operations.  Each one parses the request, and adds the contents of the reply
+// to 'reply'.  They return the result code.
+
+static stash_result_t op_login(client_t *client, msg_t *msg, expbuf_t *reply)
+{
+	char *username = NULL, *password = NULL;
+	stash_result_t res = STASH_ERR_OK;
+
+	assert(client && msg && reply);
+
+	while (msg_next(msg)) {
+		if (msg->cmd == STASH_CMD_USERNAME && username == NULL) { username = msg_str(msg); }
+		else if (msg->cmd == STASH_CMD_PASSWORD && password == NULL) { password = msg_str(msg); }
+	}
+
+	if (username == NULL || password == NULL) { res = STASH_ERR_AUTHFAILED; }
+	else if (_username && strcmp(_username, username) != 0) { res = STASH_ERR_AUTHFAILED; }
+	else if (_password && strcmp(_password, password) != 0) { res = STASH_ERR_AUTHFAILED; }
+
+	if (res == STASH_ERR_OK) {
+		client->loggedin = 1;
+		rispbuf_addInt(reply, STASH_CMD_USER_ID, 1);
+	}
+
+	if (username) { free(username); }
+	if (password) { free(password); }
+	return(res);
+}
+
+
+static stash_result_t op_getid(msg_t *msg, expbuf_t *reply)
+{
+	char *namespace = NULL, *tablename = NULL, *keyname = NULL, *username = NULL;
+	stash_nsid_t nsid = 0;
+	stash_tableid_t tid = 0;
+	stable_t *table;
+	stash_result_t res = STASH_ERR_OK;
+	int i;
+
+	assert(msg && reply);
+
+	while (msg_next(msg)) {
+		switch (msg->cmd) {
+			case STASH_CMD_NAMESPACE:    if (!namespace) namespace = msg_str(msg); break;
+			case STASH_CMD_TABLE:        if (!tablename) tablename = msg_str(msg); break;
+			case STASH_CMD_KEY:          if (!keyname) keyname = msg_str(msg);     break;
+			case STASH_CMD_USERNAME:     if (!username) username = msg_str(msg);   break;
+			case STASH_CMD_NAMESPACE_ID: nsid = msg->value; break;
+			case STASH_CMD_TABLE_ID:     tid = msg->value;  break;
+		}
+	}
+
+	if (username) {
+		if (_username && strcmp(_username, username) != 0) { res = STASH_ERR_USERNOTEXIST; }
+		else { rispbuf_addInt(reply, STASH_CMD_USER_ID, 1); }
+	}
+	else if (namespace) {
+		// namespaces are created the first time they are used.
+		for (i=0; i<_ns_count && strcmp(_namespaces[i], namespace) != 0; i++) {}
+		if (i == _ns_count) {
+			_namespaces = realloc(_namespaces, sizeof(char *) * (_ns_count + 1));
+			assert(_namespaces);
+			_namespaces[_ns_count] = strdup(namespace);
+			_ns_count ++;
+		}
+		rispbuf_addInt(reply, STASH_CMD_NAMESPACE_ID, i + 1);
+	}
+	else if (tablename && nsid > 0) {
+		for (i=0; i<_table_count; i++) {
+			if (_tables[i]->nsid == nsid && strcmp(_tables[i]->name, tablename) == 0) { break; }
+		}
+		if (i == _table_count) { res = STASH_ERR_TABLENOTEXIST; }
+		else { rispbuf_addInt(reply, STASH_CMD_TABLE_ID, i + 1); }
+	}
+	else if (keyname && (table = table_get(nsid, tid))) {
+		// keys are created the first time they are used.
+		for (i=0; i<table->key_count && strcmp(table->keys[i], keyname) != 0; i++) {}
+		if (i == table->key_count) {
+			table->keys = realloc(table->keys, sizeof(char *) * (table->key_count + 1));
+			assert(table->keys);
+			table->keys[table->key_count] = strdup(keyname);
+			table->key_count ++;
+		}
+		rispbuf_addInt(reply, STASH_CMD_KEY_ID, i + 1);
+	}
+	else {
+		res = keyname ? STASH_ERR_TABLENOTEXIST : STASH_ERR_GENERICFAIL;
+	}
+
+	if (namespace) { free(namespace); }
+	if (tablename) { free(tablename); }
+	if (keyname) { free(keyname); }
+	if (username) { free(username); }
+	return(res);
+}
+
+
+static stash_result_t op_create_table(msg_t *msg, expbuf_t *reply)
+{
+	char *tablename = NULL;
+	stash_nsid_t nsid = 0;
+	stable_t *table;
+	int options = 0, i;
+	stash_result_t res = STASH_ERR_OK;
+
+	assert(msg && reply);
+
+	while (msg_next(msg)) {
+		switch (msg->cmd) {
+			case STASH_CMD_TABLE:        if (!tablename) tablename = msg_str(msg); break;
+			case STASH_CMD_NAMESPACE_ID: nsid = msg->value; break;
+			case STASH_CMD_STRICT:       options |= STASH_TABOPT_STRICT;    break;
+			case STASH_CMD_UNIQUE:       options |= STASH_TABOPT_UNIQUE;    break;
+			case STASH_CMD_OVERWRITE:    options |= STASH_TABOPT_OVERWRITE; break;
+		}
+	}
+
+	if (tablename == NULL || nsid <= 0 || nsid > _ns_count) {
+		res = STASH_ERR_NSNOTEXIST;
+	}
+	else {
+		for (i=0; i<_table_count; i++) {
+			if (_tables[i]->nsid == nsid && strcmp(_tables[i]->name, tablename) == 0) { break; }
+		}
+		if (i < _table_count) {
+			res = STASH_ERR_TABLEEXISTS;
+		}
+		else {
+			table = calloc(1, sizeof(*table));
+			assert(table);
+			table->nsid = nsid;
+			table->name = strdup(tablename);
+			table->options = options;
+
+			_tables = realloc(_tables, sizeof(stable_t *) * (_table_count + 1));
+			assert(_tables);
+			_tables[_table_count] = table;
+			_table_count ++;
+			table->tid = _table_count;
+
+			rispbuf_addInt(reply, STASH_CMD_TABLE_ID, table->tid);
+		}
+	}
+
+	if (tablename) { free(tablename); }
+	return(res);
+}
+
+
+// set the attributes from an ATTRIBUTE list.
+static int set_attributes(stable_t *table, srow_t *row, msg_t *msg)
+{
+	msg_t sub;
+	stash_keyid_t kid;
+	val_t val;
+	int expires, have_val;
+
+	assert(table && row && msg);
+
+	msg->pos = 0;
+	while (msg_next(msg)) {
+		if (msg->cmd == STASH_CMD_ATTRIBUTE) {
+			kid = 0; expires = 0; have_val = 0;
+			msg_init(&sub, msg->param, msg->paramlen);
+			while (msg_next(&sub)) {
+				if (sub.cmd == STASH_CMD_KEY_ID) { kid = sub.value; }
+				else if (sub.cmd == STASH_CMD_EXPIRES) { expires = sub.value; }
+				else if (sub.cmd == STASH_CMD_VALUE && have_val == 0) { have_val = val_parse(&val, sub.param, sub.paramlen, table); }
+			}
+			if (kid <= 0 || kid > table->key_count || have_val == 0) {
+				if (have_val) { val_free(&val); }
+				return(0);
+			}
+			attr_set(row, kid, &val, expires);
+		}
+	}
+
+	return(1);
+}
+
+
+static stash_result_t op_set(msg_t *msg, expbuf_t *reply)
+{
+	stash_nsid_t nsid = 0;
+	stash_tableid_t tid = 0;
+	stash_rowid_t rid = 0;
+	stash_nameid_t nid = 0;
+	char *name = NULL;
+	int expires = 0, overwrite = 0, created = 0;
+	stable_t *table;
+	srow_t *row = NULL;
+	stash_result_t res = STASH_ERR_OK;
+
+	assert(msg && reply);
+
+	while (msg_next(msg)) {
+		switch (msg->cmd) {
+			case STASH_CMD_NAMESPACE_ID: nsid = msg->value;    break;
+			case STASH_CMD_TABLE_ID:     tid = msg->value;     break;
+			case STASH_CMD_ROW_ID:       rid = msg->value;     break;
+			case STASH_CMD_NAME_ID:      nid = msg->value;     break;
+			case STASH_CMD_EXPIRES:      expires = msg->value; break;
+			case STASH_CMD_OVERWRITE:    overwrite = 1;        break;
+			case STASH_CMD_NAME:         if (!name) name = msg_str(msg); break;
+		}
+	}
+
+	table = table_get(nsid, tid);
+	if (table == NULL) {
+		res = STASH_ERR_TABLENOTEXIST;
+	}
+	else if (rid > 0) {
+		if ((row = row_byid(table, rid)) == NULL) { res = STASH_ERR_GENERICFAIL; }
+	}
+	else if (nid > 0) {
+		if ((row = row_bynameid(table, nid)) == NULL) { res = STASH_ERR_GENERICFAIL; }
+	}
+	else if (name) {
+		row = row_byname(table, name);
+		if (row && overwrite == 0 && (table->options & STASH_TABOPT_OVERWRITE) == 0) {
+			res = STASH_ERR_ROWEXISTS;
+		}
+		else if (row == NULL) {
+			row = row_new(table, name);
+			created = 1;
+		}
+	}
+	else {
+		res = STASH_ERR_GENERICFAIL;
+	}
+
+	if (res == STASH_ERR_OK) {
+		assert(row);
+		if (set_attributes(table, row, msg) == 0) {
+			res = STASH_ERR_KEYNOTEXIST;
+		}
+		else {
+			if (expires > 0) { row->expires = time(NULL) + expires; }
+			rispbuf_addInt(reply, STASH_CMD_COUNT, 1);
+			build_row(reply, row, NULL, 0);
+			if (created) { rispbuf_addCmd(reply, STASH_CMD_CREATED); }
+		}
+	}
+
+	if (name) { free(name); }
+	return(res);
+}
+
+
+static stash_result_t op_update(msg_t *msg, expbuf_t *reply)
+{
+	stash_nsid_t nsid = 0;
+	stash_tableid_t tid = 0;
+	stash_rowid_t rid = 0;
+	stash_keyid_t kid = 0;
+	stable_t *table;
+	srow_t *row;
+	sattr_t *attr;
+	val_t val, expected, result;
+	int op = 0, have_val = 0, have_exp = 0;
+	stash_result_t res = STASH_ERR_OK;
+
+	assert(msg && reply);
+
+	while (msg_next(msg)) {
+		switch (msg->cmd) {
+			case STASH_CMD_NAMESPACE_ID: nsid = msg->value; break;
+			case STASH_CMD_TABLE_ID:     tid = msg->value;  break;
+			case STASH_CMD_ROW_ID:       rid = msg->value;  break;
+			case STASH_CMD_KEY_ID:       kid = msg->value;  break;
+			case STASH_CMD_OP_INCREMENT:
+			case STASH_CMD_OP_DECREMENT:
+			case STASH_CMD_OP_APPEND:
+			case STASH_CMD_OP_SET_IF_ABSENT:
+			case STASH_CMD_OP_COMPARE_SET:
+				op = msg->cmd;
+				break;
+			case STASH_CMD_VALUE:    if (!have_val) have_val = val_parse(&val, msg->param, msg->paramlen, NULL);      break;
+			case STASH_CMD_EXPECTED: if (!have_exp) have_exp = val_parse(&expected, msg->param, msg->paramlen, NULL); break;
+		}
+	}
+
+	if ((table = table_get(nsid, tid)) == NULL) { res = STASH_ERR_TABLENOTEXIST; }
+	else if ((row = row_byid(table, rid)) == NULL) { res = STASH_ERR_GENERICFAIL; }
+	else if (kid <= 0 || kid > table->key_count) { res = STASH_ERR_KEYNOTEXIST; }
+	else if (op == 0 || have_val == 0) { res = STASH_ERR_GENERICFAIL; }
+	else {
+		attr = attr_get(row, kid);
+		memset(&result, 0, sizeof(result));
+
+		switch (op) {
+			case STASH_CMD_OP_INCREMENT:
+			case STASH_CMD_OP_DECREMENT:
+				if (val.valtype != STASH_VALTYPE_INT || (attr && attr->value.valtype != STASH_VALTYPE_INT)) { res = STASH_ERR_GENERICFAIL; break; }
+				result.valtype = STASH_VALTYPE_INT;
+				result.number = (attr ? attr->value.number : 0) + (op == STASH_CMD_OP_INCREMENT ? val.number : -val.number);
+				attr = attr_set(row, kid, &result, 0);
+				break;
+
+			case STASH_CMD_OP_APPEND:
+				if (val.valtype != STASH_VALTYPE_STR || (attr && attr->value.valtype != STASH_VALTYPE_STR)) { res = STASH_ERR_GENERICFAIL; break; }
+				result.valtype = STASH_VALTYPE_STR;
+				result.len = (attr ? attr->value.len : 0) + val.len;
+				result.str = malloc(result.len + 1);
+				assert(result.str);
+				if (attr) { memcpy(result.str, attr->value.str, attr->value.len); }
+				memcpy(result.str + result.len - val.len, val.str, val.len);
+				result.str[result.len] = 0;
+				attr = attr_set(row, kid, &result, 0);
+				break;
+
+			case STASH_CMD_OP_SET_IF_ABSENT:
+				if (attr == NULL) {
+					attr = attr_set(row, kid, &val, 0);
+					have_val = 0;
+				}
+				break;
+
+			case STASH_CMD_OP_COMPARE_SET:
+				if (have_exp == 0) { res = STASH_ERR_GENERICFAIL; }
+				else if (attr == NULL || val_compare(&attr->value, &expected) != 0) { res = STASH_ERR_VALUEMISMATCH; }
+				else {
+					attr = attr_set(row, kid, &val, 0);
+					have_val = 0;
+				}
+				break;
+		}
+
+		if (res == STASH_ERR_OK) {
+			rispbuf_addInt(reply, STASH_CMD_COUNT, 1);
+			build_row(reply, row, &kid, 1);
+		}
+	}
+
+	if (have_val) { val_free(&val); }
+	if (have_exp) { val_free(&expected); }
+	return(res);
+}
+
+
+// sort entries for the query being sorted.
+static stash_keyid_t _sort_kid[16];
+static int _sort_desc[16];
+static int _sort_count = 0;
+
+static int sortfn(const void *a, const void *b)
+{
+	srow_t * const *ra = a;
+	srow_t * const *rb = b;
+	sattr_t *aa, *ab;
+	int i, result;
+
+	for (i=0; i<_sort_count; i++) {
+		aa = attr_get(*ra, _sort_kid[i]);
+		ab = attr_get(*rb, _sort_kid[i]);
+		if (aa == NULL && ab == NULL) { result = 0; }
+		else if (aa == NULL) { result = 1; }
+		else if (ab == NULL) { result = -1; }
+		else { result = val_compare(&aa->value, &ab->value); }
+
+		if (result != 0) { return(_sort_desc[i] ? -result : result); }
+	}
+
+	// keep the order stable, so that paging is consistent.
+	return((*ra)->rid - (*rb)->rid);
+}
+
+
+// where a page ended.  The continuation token has the values of the sort keys in
+// the last row that was returned (VALUE, or NULL if the row didn't have the
+// key), followed by its ROW_ID.  The next page starts with the first row that
+// sorts after that, so rows added or removed before it don't shift the pages.
+typedef struct {
+	val_t keys[16];
+	short int have[16];
+	int count;
+	stash_rowid_t rid;
+} position_t;
+
+static void position_build(expbuf_t *buf, srow_t *row)
+{
+	expbuf_t *buf_value;
+	sattr_t *attr;
+	int i;
+
+	assert(buf && row);
+
+	buf_value = expbuf_init(NULL, 32);
+	for (i=0; i<_sort_count; i++) {
+		if ((attr = attr_get(row, _sort_kid[i]))) {
+			val_build(buf_value, &attr->value);
+			rispbuf_addBuffer(buf, STASH_CMD_VALUE, buf_value);
+			expbuf_clear(buf_value);
+		}
+		else {
+			rispbuf_addCmd(buf, STASH_CMD_NULL);
+		}
+	}
+	rispbuf_addInt(buf, STASH_CMD_ROW_ID, row->rid);
+	buf_value = expbuf_free(buf_value);
+}
+
+// returns 0 if the token is not valid for this query.
+static int position_parse(position_t *pos, const unsigned char *data, int length)
+{
+	msg_t msg;
+
+	assert(pos && data);
+	memset(pos, 0, sizeof(*pos));
+
+	msg_init(&msg, data, length);
+	while (msg_next(&msg)) {
+		if (msg.cmd == STASH_CMD_ROW_ID) { pos->rid = msg.value; }
+		else if (pos->count >= 16) { break; }
+		else if (msg.cmd == STASH_CMD_NULL) { pos->count ++; }
+		else if (msg.cmd == STASH_CMD_VALUE) {
+			pos->have[pos->count] = val_parse(&pos->keys[pos->count], msg.param, msg.paramlen, NULL);
+			pos->count ++;
+		}
+	}
+
+	return(pos->rid > 0 && pos->count == _sort_count);
+}
+
+static void position_free(position_t *pos)
+{
+	int i;
+
+	assert(pos);
+	for (i=0; i<pos->count; i++) {
+		if (pos->have[i]) { val_free(&pos->keys[i]); }
+	}
+}
+
+// compares the row against the position, in the same order as sortfn.
+static int position_compare(srow_t *row, position_t *pos)
+{
+	sattr_t *attr;
+	int i, result;
+
+	assert(row && pos);
+
+	for (i=0; i<_sort_count; i++) {
+		attr = attr_get(row, _sort_kid[i]);
+		if (attr == NULL && pos->have[i] == 0) { result = 0; }
+		else if (attr == NULL) { result = 1; }
+		else if (pos->have[i] == 0) { result = -1; }
+		else { result = val_compare(&attr->value, &pos->keys[i]); }
+
+		if (result != 0) { return(_sort_desc[i] ? -result : result); }
+	}
+
+	return(row->rid < pos->rid ? -1 : (row->rid > pos->rid ? 1 : 0));
+}
+
+
+// FNV-1a of the encoded result.  0 is not used, it means there is no version.
+static stash_version_t result_version(expbuf_t *buf)
+{
+	stash_version_t hash = 2166136261u;
+	int i;
+
+	assert(buf);
+	for (i=0; i<BUF_LENGTH(buf); i++) {
+		hash ^= (unsigned char) BUF_DATA(buf)[i];
+		hash *= 16777619u;
+	}
+	return(hash ? hash : 1);
+}
+
+
+// calculate the aggregate over the matching rows, and add a group row for each
+// value of the group key to the reply.  The rows are sorted on the group key, so
+// the groups come back in that order (with the rows that don't have it last).
+static void aggregate(expbuf_t *reply, srow_t **list, int total, int op, stash_keyid_t kid, stash_keyid_t group)
+{
+	expbuf_t *rows;
+	sattr_t *first, *next, *attr;
+	val_t sum, *value;
+	int groups = 0, count, i, j;
+
+	assert(reply && list && total >= 0);
+	assert(op == STASH_CMD_AGG_COUNT || op == STASH_CMD_AGG_SUM || op == STASH_CMD_AGG_MIN || op == STASH_CMD_AGG_MAX);
+
+	if (group > 0) {
+		_sort_kid[0] = group;
+		_sort_desc[0] = 0;
+		_sort_count = 1;
+		qsort(list, total, sizeof(srow_t *), sortfn);
+	}
+
+	rows = expbuf_init(NULL, 128);
+	i = 0;
+	while (i < total || (group == 0 && groups == 0)) {
+		// find the end of the group.
+		first = (group > 0 && i < total) ? attr_get(list[i], group) : NULL;
+		for (j=i+1; j<total && group > 0; j++) {
+			next = attr_get(list[j], group);
+			if (first == NULL ? next != NULL : (next == NULL || val_compare(&first->value, &next->value) != 0)) { break; }
+		}
+		if (group == 0) { j = total; }
+
+		count = 0;
+		value = NULL;
+		memset(&sum, 0, sizeof(sum));
+		sum.valtype = STASH_VALTYPE_INT;
+		for (; i<j; i++) {
+			if (kid == 0) { count ++; continue; }
+			if ((attr = attr_get(list[i], kid)) == NULL) { continue; }
+			count ++;
+			if (op == STASH_CMD_AGG_SUM) {
+				if (attr->value.valtype == STASH_VALTYPE_INT) { sum.number += attr->value.number; }
+				value = &sum;
+			}
+			else if (op == STASH_CMD_AGG_MIN) {
+				if (value == NULL || val_compare(&attr->value, value) < 0) { value = &attr->value; }
+			}
+			else if (op == STASH_CMD_AGG_MAX) {
+				if (value == NULL || val_compare(&attr->value, value) > 0) { value = &attr->value; }
+			}
+		}
+		if (op == STASH_CMD_AGG_COUNT) {
+			sum.number = count;
+			value = &sum;
+		}
+		if (count == 0) { value = NULL; }
+
+		build_group(rows, first, kid, value, count);
+		groups ++;
+	}
+
+	rispbuf_addInt(reply, STASH_CMD_COUNT, groups);
+	expbuf_add(reply, BUF_DATA(rows), BUF_LENGTH(rows));
+	rows = expbuf_free(rows);
+}
+
+
+static stash_result_t op_query(msg_t *msg, expbuf_t *reply)
+{
+	stash_nsid_t nsid = 0;
+	stash_tableid_t tid = 0;
+	stable_t *table;
+	srow_t *row, **list;
+	msg_t sub, entry;
+	const unsigned char *cond = NULL, *rowlist = NULL, *cont = NULL;
+	int cond_len = 0, rowlist_len = 0, cont_len = 0;
+	position_t pos;
+	expbuf_t *token;
+	stash_keyid_t select[64];
+	int select_count = 0;
+	int limit = 0, offset = 0, total = 0, i, count;
+	int agg_op = 0;
+	stash_keyid_t agg_kid = 0, agg_group = 0;
+	stash_version_t if_version = 0, version;
+	time_t now;
+
+	assert(msg && reply);
+	assert(BUF_LENGTH(reply) == 0);
+
+	_sort_count = 0;
+	while (msg_next(msg)) {
+		switch (msg->cmd) {
+			case STASH_CMD_NAMESPACE_ID: nsid = msg->value;  break;
+			case STASH_CMD_TABLE_ID:     tid = msg->value;   break;
+			case STASH_CMD_LIMIT:        limit = msg->value; break;
+			case STASH_CMD_IF_VERSION:   if_version = msg->value; break;
+			case STASH_CMD_CONDITION:    cond = msg->param;    cond_len = msg->paramlen;    break;
+			case STASH_CMD_ROW_LIST:     rowlist = msg->param; rowlist_len = msg->paramlen; break;
+			case STASH_CMD_CONTINUE:     cont = msg->param;    cont_len = msg->paramlen;    break;
+			case STASH_CMD_SELECT:
+				msg_init(&sub, msg->param, msg->paramlen);
+				while (msg_next(&sub) && select_count < 64) {
+					if (sub.cmd == STASH_CMD_KEY_ID) { select[select_count++] = sub.value; }
+				}
+				break;
+			case STASH_CMD_SORT:
+				msg_init(&sub, msg->param, msg->paramlen);
+				while (msg_next(&sub) && _sort_count < 16) {
+					if (sub.cmd != STASH_CMD_SORTENTRY) { continue; }
+					_sort_kid[_sort_count] = 0;
+					_sort_desc[_sort_count] = 0;
+					msg_init(&entry, sub.param, sub.paramlen);
+					while (msg_next(&entry)) {
+						if (entry.cmd == STASH_CMD_KEY_ID) { _sort_kid[_sort_count] = entry.value; }
+						else if (entry.cmd == STASH_CMD_SORTDESC) { _sort_desc[_sort_count] = 1; }
+					}
+					if (_sort_kid[_sort_count] > 0) { _sort_count ++; }
+				}
+				break;
+			case STASH_CMD_AGGREGATE:
+				msg_init(&sub, msg->param, msg->paramlen);
+				while (msg_next(&sub)) {
+					switch (sub.cmd) {
+						case STASH_CMD_AGG_COUNT:
+						case STASH_CMD_AGG_SUM:
+						case STASH_CMD_AGG_MIN:
+						case STASH_CMD_AGG_MAX:       agg_op = sub.cmd;      break;
+						case STASH_CMD_KEY_ID:        agg_kid = sub.value;   break;
+						case STASH_CMD_GROUP_KEY_ID:  agg_group = sub.value; break;
+					}
+				}
+				if (agg_op == 0 || (agg_op != STASH_CMD_AGG_COUNT && agg_kid == 0)) { return(STASH_ERR_GENERICFAIL); }
+				break;
+		}
+	}
+
+	if ((table = table_get(nsid, tid)) == NULL) { return(STASH_ERR_TABLENOTEXIST); }
+
+	// collect the matching rows.
+	now = time(NULL);
+	list = malloc(sizeof(srow_t *) * (table->row_count + 1));
+	assert(list);
+	if (rowlist) {
+		msg_init(&sub, rowlist, rowlist_len);
+		while (msg_next(&sub) && total < table->row_count) {
+			if (sub.cmd == STASH_CMD_ROW_ID && (row = row_byid(table, sub.value))) {
+				list[total++] = row;
+			}
+		}
+	}
+	else {
+		for (i=0; i<table->row_count; i++) {
+			row = table->rows[i];
+			if (row_live(row, now) && (cond == NULL || cond_match(table, row, cond, cond_len))) {
+				list[total++] = row;
+			}
+		}
+	}
+
+	if (agg_op != 0) {
+		// limits, sorting and selected keys don't apply to aggregates.
+		aggregate(reply, list, total, agg_op, agg_kid, agg_group);
+	}
+	else {
+		// pages are always in the same order, even if there is no sort.
+		if (limit > 0) {
+			qsort(list, total, sizeof(srow_t *), sortfn);
+		}
+
+		// skip the rows up to the end of the last page.
+		if (cont) {
+			if (position_parse(&pos, cont, cont_len) == 0) {
+				position_free(&pos);
+				free(list);
+				return(STASH_ERR_GENERICFAIL);
+			}
+			while (offset < total && position_compare(list[offset], &pos) <= 0) { offset ++; }
+			position_free(&pos);
+		}
+
+		count = total - offset;
+		if (limit > 0 && count > limit) { count = limit; }
+
+		rispbuf_addInt(reply, STASH_CMD_COUNT, count);
+		for (i=offset; i<offset+count; i++) {
+			build_row(reply, list[i], select, select_count);
+		}
+
+		if (limit > 0 && offset + count < total) {
+			assert(count > 0);
+			token = expbuf_init(NULL, 64);
+			position_build(token, list[offset + count - 1]);
+			rispbuf_addBuffer(reply, STASH_CMD_CONTINUE, token);
+			token = expbuf_free(token);
+		}
+	}
+
+	free(list);
+
+	// the version is a hash of the result, so it changes when anything in the 
+	// result does (including rows and attributes expiring).  If the client 
+	// already has this result, it only gets told that it hasn't changed.
+	version = result_version(reply);
+	if (if_version != 0 && if_version == version) {
+		expbuf_clear(reply);
+		rispbuf_addCmd(reply, STASH_CMD_NOT_MODIFIED);
+	}
+	rispbuf_addInt(reply, STASH_CMD_VERSION, version);
+
+	return(STASH_ERR_OK);
+}
+
+
+// DELETE and SET_EXPIRY on a single row (or a key in the row).
+static stash_result_t op_row(risp_command_t op, msg_t *msg, expbuf_t *reply)
+{
+	stash_nsid_t nsid = 0;
+	stash_tableid_t tid = 0;
+	stash_rowid_t rid = 0;
+	stash_keyid_t kid = 0;
+	int expires = 0;
+	stable_t *table;
+	srow_t *row;
+	sattr_t *attr;
+
+	assert(msg && reply);
+
+	while (msg_next(msg)) {
+		switch (msg->cmd) {
+			case STASH_CMD_NAMESPACE_ID: nsid = msg->value;    break;
+			case STASH_CMD_TABLE_ID:     tid = msg->value;     break;
+			case STASH_CMD_ROW_ID:       rid = msg->value;     break;
+			case STASH_CMD_KEY_ID:       kid = msg->value;     break;
+			case STASH_CMD_EXPIRES:      expires = msg->value; break;
+		}
+	}
+
+	if ((table = table_get(nsid, tid)) == NULL) { return(STASH_ERR_TABLENOTEXIST); }
+	if ((row = row_byid(table, rid)) == NULL) { return(STASH_ERR_GENERICFAIL); }
+
+	if (op == STASH_CMD_DELETE) {
+		if (kid > 0) { attr_delete(row, kid); }
+		else { row_delete(table, row); }
+	}
+	else {
+		assert(op == STASH_CMD_SET_EXPIRY);
+		if (kid > 0) {
+			if ((attr = attr_get(row, kid)) == NULL) { return(STASH_ERR_KEYNOTEXIST); }
+			attr->expires = expires > 0 ? time(NULL) + expires : 0;
+		}
+		else {
+			row->expires = expires > 0 ? time(NULL) + expires : 0;
+		}
+	}
+
+	return(STASH_ERR_OK);
+}
+
+
+// DELETE_WHERE and EXPIRE_WHERE.
+static stash_result_t op_where(risp_command_t op, msg_t *msg, expbuf_t *reply)
+{
+	stash_nsid_t nsid = 0;
+	stash_tableid_t tid = 0;
+	stash_keyid_t kid = 0;
+	const unsigned char *cond = NULL;
+	int cond_len = 0, expires = 0, count = 0, i;
+	stable_t *table;
+	srow_t *row;
+	sattr_t *attr;
+	time_t now;
+
+	assert(msg && reply);
+
+	while (msg_next(msg)) {
+		switch (msg->cmd) {
+			case STASH_CMD_NAMESPACE_ID: nsid = msg->value;    break;
+			case STASH_CMD_TABLE_ID:     tid = msg->value;     break;
+			case STASH_CMD_KEY_ID:       kid = msg->value;     break;
+			case STASH_CMD_EXPIRES:      expires = msg->value; break;
+			case STASH_CMD_CONDITION:    cond = msg->param; cond_len = msg->paramlen; break;
+		}
+	}
+
+	if ((table = table_get(nsid, tid)) == NULL) { return(STASH_ERR_TABLENOTEXIST); }
+	if (cond == NULL) { return(STASH_ERR_GENERICFAIL); }
+
+	now = time(NULL);
+	for (i=0; i<table->row_count; i++) {
+		row = table->rows[i];
+		if (row_live(row, now) && cond_match(table, row, cond, cond_len)) {
+			count ++;
+			if (op == STASH_CMD_DELETE_WHERE) { row_delete(table, row); }
+			else if (kid > 0) {
+				if ((attr = attr_get(row, kid))) { attr->expires = expires > 0 ? now + expires : 0; }
+			}
+			else { row->expires = expires > 0 ? now + expires : 0; }
+		}
+	}
+
+	rispbuf_addInt(reply, STASH_CMD_COUNT, count);
+	return(STASH_ERR_OK);
+}
+
+
+// returns the slot of the lock if it is still held.  Locks whose lease has run
+// out are released when they are looked at.
+static int lock_held(int slot, long long now)
+{
+	slock_t *lock;
+
+	assert(slot >= 0 && slot < _lock_count);
+
+	lock = _locks[slot];
+	if (lock && lock->expires <= now) {
+		free(lock->entries);
+		free(lock);
+		_locks[slot] = NULL;
+		lock = NULL;
+	}
+	return(lock != NULL);
+}
+
+static int lock_find(stash_lockid_t lockid, long long now)
+{
+	int i;
+
+	assert(lockid > 0);
+	for (i=0; i<_lock_count; i++) {
+		if (lock_held(i, now) && _locks[i]->lockid == lockid) { return(i); }
+	}
+	return(-1);
+}
+
+// LOCKSET.  Acquires all the rows in the LOCK_ENTRY list, or none of them, and
+// replies with the LOCK_ID.  With a LOCK_ID and LOCK_RENEW or LOCK_RELEASE, it
+// extends the lease on the set, or releases it.  The entries have to be sorted
+// by table and row, without duplicates, which is the order every client takes
+// them in.
+static stash_result_t op_lockset(msg_t *msg, expbuf_t *reply)
+{
+	stash_nsid_t nsid = 0;
+	stash_lockid_t lockid = 0;
+	stash_lockentry_t *entries = NULL, *e;
+	int count = 0, lease = 0, renew = 0, release = 0, i, j, k, slot;
+	stash_result_t res = STASH_ERR_OK;
+	slock_t *lock;
+	msg_t sub;
+	long long now;
+
+	assert(msg && reply);
+
+	while (msg_next(msg)) {
+		switch (msg->cmd) {
+			case STASH_CMD_NAMESPACE_ID: nsid = msg->value;   break;
+			case STASH_CMD_LOCK_ID:      lockid = msg->value; break;
+			case STASH_CMD_EXPIRES:      lease = msg->value;  break;
+			case STASH_CMD_LOCK_RENEW:   renew = 1;           break;
+			case STASH_CMD_LOCK_RELEASE: release = 1;         break;
+			case STASH_CMD_LOCK_ENTRY:
+				entries = realloc(entries, sizeof(*entries) * (count + 1));
+				assert(entries);
+				e = &entries[count++];
+				e->tid = 0;
+				e->rowid = 0;
+				msg_init(&sub, msg->param, msg->paramlen);
+				while (msg_next(&sub)) {
+					if (sub.cmd == STASH_CMD_TABLE_ID) { e->tid = sub.value; }
+					else if (sub.cmd == STASH_CMD_ROW_ID) { e->rowid = sub.value; }
+				}
+				break;
+		}
+	}
+
+	now = now_usec();
+	if (lockid > 0) {
+		// renew or release a set that is held.
+		if (count > 0 || renew == release) { res = STASH_ERR_GENERICFAIL; }
+		else if ((slot = lock_find(lockid, now)) < 0) { res = STASH_ERR_LOCKNOTHELD; }
+		else if (renew) {
+			if (lease <= 0) { res = STASH_ERR_GENERICFAIL; }
+			else { _locks[slot]->expires = now + ((long long)lease * 1000000); }
+		}
+		else {
+			free(_locks[slot]->entries);
+			free(_locks[slot]);
+			_locks[slot] = NULL;
+		}
+	}
+	else if (count == 0 || lease <= 0 || renew || release) {
+		res = STASH_ERR_GENERICFAIL;
+	}
+	else {
+		for (i=0; i<count && res == STASH_ERR_OK; i++) {
+			if (table_get(nsid, entries[i].tid) == NULL) { res = STASH_ERR_TABLENOTEXIST; }
+			else if (entries[i].rowid <= 0) { res = STASH_ERR_GENERICFAIL; }
+			else if (i > 0 && (entries[i].tid < entries[i-1].tid || (entries[i].tid == entries[i-1].tid && entries[i].rowid <= entries[i-1].rowid))) {
+				if (_verbose) { fprintf(stderr, "lockset entries are not sorted\n"); }
+				res = STASH_ERR_GENERICFAIL;
+			}
+		}
+
+		// none of the rows can be in a set that is held.
+		for (slot=0; slot<_lock_count && res == STASH_ERR_OK; slot++) {
+			if (lock_held(slot, now) == 0 || _locks[slot]->nsid != nsid) { continue; }
+			lock = _locks[slot];
+			for (j=0; j<lock->count && res == STASH_ERR_OK; j++) {
+				for (k=0; k<count; k++) {
+					if (lock->entries[j].tid == entries[k].tid && lock->entries[j].rowid == entries[k].rowid) {
+						res = STASH_ERR_LOCKED;
+						break;
+					}
+				}
+			}
+		}
+
+		if (res == STASH_ERR_OK) {
+			lock = calloc(1, sizeof(*lock));
+			assert(lock);
+			lock->lockid = ++_lock_next;
+			lock->nsid = nsid;
+			lock->expires = now + ((long long)lease * 1000000);
+			lock->count = count;
+			lock->entries = entries;
+			entries = NULL;
+
+			for (slot=0; slot<_lock_count && _locks[slot]; slot++) {}
+			if (slot == _lock_count) {
+				_locks = realloc(_locks, sizeof(slock_t *) * (_lock_count + 1));
+				assert(_locks);
+				_lock_count ++;
+			}
+			_locks[slot] = lock;
+
+			rispbuf_addInt(reply, STASH_CMD_LOCK_ID, lock->lockid);
+		}
+	}
+
+	if (entries) { free(entries); }
+	return(res);
+}
+
+
+//-----------------------------------------------------------------------------
+// process a complete REQUEST, and queue the reply.
+static void process_request(client_t *client, const unsigned char *data, int length)
+{
+	msg_t msg, op;
+	int reqid = 0, cmd = 0;
+	stash_result_t res;
+	expbuf_t *reply, *wrap, *out;
+	pending_t *pending;
+
+	assert(client && data && length > 0);
+
+	msg_init(&op, NULL, 0);
+	msg_init(&msg, data, length);
+	while (msg_next(&msg)) {
+		if (msg.cmd == STASH_CMD_REQUEST_ID) { reqid = msg.value; }
+		else if (msg.cmd >= 160) {
+			cmd = msg.cmd;
+			msg_init(&op, msg.param, msg.paramlen);
+		}
+	}
+
+	reply = expbuf_init(NULL, 128);
+
+	if (cmd == 0) { res = STASH_ERR_GENERICFAIL; }
+	else if (cmd == STASH_CMD_LOGIN) { res = op_login(client, &op, reply); }
+	else if (client->loggedin == 0) { res = STASH_ERR_NOTCONNECTED; }
+	else {
+		switch (cmd) {
+			case STASH_CMD_GETID:        res = op_getid(&op, reply);        break;
+			case STASH_CMD_CREATE_TABLE: res = op_create_table(&op, reply); break;
+			case STASH_CMD_SET:          res = op_set(&op, reply);          break;
+			case STASH_CMD_UPDATE:       res = op_update(&op, reply);       break;
+			case STASH_CMD_QUERY:        res = op_query(&op, reply);        break;
+			case STASH_CMD_DELETE:
+			case STASH_CMD_SET_EXPIRY:   res = op_row(cmd, &op, reply);     break;
+			case STASH_CMD_DELETE_WHERE:
+			case STASH_CMD_EXPIRE_WHERE: res = op_where(cmd, &op, reply);   break;
+			case STASH_CMD_LOCKSET:      res = op_lockset(&op, reply);      break;
+			default:
+				if (_verbose) { fprintf(stderr, "unsupported request: %d\n", cmd); }
+				res = STASH_ERR_GENERICFAIL;
+				break;
+		}
+	}
+
+	if (_verbose) { fprintf(stderr, "request %d: cmd=%d result=%d\n", reqid, cmd, res); }
+
+	wrap = expbuf_init(NULL, BUF_LENGTH(reply) + 16);
+	rispbuf_addInt(wrap, STASH_CMD_REQUEST_ID, reqid);
+	if (res == STASH_ERR_OK) {
+		expbuf_add(wrap, BUF_DATA(reply), BUF_LENGTH(reply));
+	}
+	else {
+		rispbuf_addInt(wrap, STASH_CMD_FAILCODE, res);
+	}
+
+	out = expbuf_init(NULL, BUF_LENGTH(wrap) + 8);
+	rispbuf_addBuffer(out, res == STASH_ERR_OK ? STASH_CMD_REPLY : STASH_CMD_FAILED, wrap);
+
+	reply = expbuf_free(reply);
+	wrap = expbuf_free(wrap);
+
+	if (_latency > 0) {
+		// hold the reply back until the latency has passed.
+		pending = calloc(1, sizeof(*pending));
+		assert(pending);
+		pending->ready = now_usec() + _latency;
+		pending->buf = out;
+		if (client->pending_tail) { client->pending_tail->next = pending; }
+		else { client->pending = pending; }
+		client->pending_tail = pending;
+	}
+	else {
+		expbuf_add(client->out, BUF_DATA(out), BUF_LENGTH(out));
+		out = expbuf_free(out);
+	}
+}
+
+
+// process all the complete requests that are in the input buffer.
+static void process_input(client_t *client)
+{
+	msg_t msg;
+	int len, done = 0;
+
+	assert(client);
+
+	while ((len = frame_length((unsigned char *) BUF_DATA(client->in) + done, BUF_LENGTH(client->in) - done)) > 0) {
+		msg_init(&msg, (unsigned char *) BUF_DATA(client->in) + done, len);
+		msg_next(&msg);
+		if (msg.cmd == STASH_CMD_REQUEST) {
+			process_request(client, msg.param, msg.paramlen);
+		}
+		done += len;
+	}
+
+	if (done > 0) { expbuf_purge(client->in, done); }
+}
+
+
+//-----------------------------------------------------------------------------
+// network.
+
+static int listen_tcp(int port)
+{
+	int handle, on = 1;
+	struct sockaddr_in sin;
+
+	handle = socket(AF_INET, SOCK_STREAM, 0);
+	if (handle < 0) { return(-1); }
+	setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if (bind(handle, (struct sockaddr *) &sin, sizeof(sin)) < 0 || listen(handle, 64) < 0) {
+		close(handle);
+		return(-1);
+	}
+	return(handle);
+}
+
+static int listen_unix(const char *path)
+{
+	int handle;
+	struct sockaddr_un sun;
+
+	assert(path);
+	if (strlen(path) >= sizeof(sun.sun_path)) { return(-1); }
+
+	handle = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (handle < 0) { return(-1); }
+
+	unlink(path);
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	if (bind(handle, (struct sockaddr *) &sun, sizeof(sun)) < 0 || listen(handle, 64) < 0) {
+		close(handle);
+		return(-1);
+	}
+	return(handle);
+}
+
+
+static void client_free(client_t *client)
+{
+	pending_t *pending;
+
+	assert(client);
+	close(client->handle);
+	while ((pending = client->pending)) {
+		client->pending = pending->next;
+		expbuf_free(pending->buf);
+		free(pending);
+	}
+	expbuf_free(client->in);
+	expbuf_free(client->out);
+	free(client);
+}
+
+
+// move the replies that are ready into the output buffer.  Returns the time
+// until the next one is ready (or -1 if there are none waiting).
+static long long client_pending(client_t *client, long long now)
+{
+	pending_t *pending;
+
+	assert(client);
+	while ((pending = client->pending) && pending->ready <= now) {
+		expbuf_add(client->out, BUF_DATA(pending->buf), BUF_LENGTH(pending->buf));
+		client->pending = pending->next;
+		if (client->pending == NULL) { client->pending_tail = NULL; }
+		expbuf_free(pending->buf);
+		free(pending);
+	}
+	return(client->pending ? client->pending->ready - now : -1);
+}
+
+
+// the number of bytes that can be sent now (with the bandwidth limit).
+static int client_allowance(client_t *client, long long now)
+{
+	double burst;
+
+	assert(client);
+	if (_bandwidth <= 0) { return(BUF_LENGTH(client->out)); }
+
+	// allow up to 10ms worth of data to go at once.
+	burst = _bandwidth / 100.0;
+	if (burst < 1500) { burst = 1500; }
+
+	client->bw_credit += (now - client->bw_last) * (_bandwidth / 1000000.0);
+	if (client->bw_credit > burst) { client->bw_credit = burst; }
+	client->bw_last = now;
+
+	if (client->bw_credit < 1) { return(0); }
+	return(client->bw_credit < BUF_LENGTH(client->out) ? (int) client->bw_credit : BUF_LENGTH(client->out));
+}
+
+
+static void sig_handler(int sig)
+{
+	_shutdown = 1;
+}
+
+
+static void usage(void)
+{
+	printf(
+		"Usage: stash-standin [options]\n"
+		"  -l <port>      listen on a TCP port (default %d)\n"
+		"  -s <path>      listen on a unix socket instead\n"
+		"  -u <username>  only accept this username\n"
+		"  -p <password>  only accept this password\n"
+		"  -L <usec>      latency added to every reply\n"
+		"  -B <bytes>     bandwidth limit per connection (bytes per second)\n"
+		"  -v             verbose\n"
+		"  -h             this help\n", STASH_DEFAULT_PORT);
+}
+
+
+int main(int argc, char **argv)
+{
+	int c, port = STASH_DEFAULT_PORT, listener, handle, i, j, nfds, len, allowed;
+	char *path = NULL;
+	client_t *clients[MAX_CLIENTS];
+	int client_count = 0;
+	struct pollfd fds[MAX_CLIENTS + 1];
+	long long now, wait, next;
+	struct timespec ts;
+	char buffer[16384];
+
+	while ((c = getopt(argc, argv, "l:s:u:p:L:B:vh")) != -1) {
+		switch (c) {
+			case 'l': port = atoi(optarg);        break;
+			case 's': path = optarg;              break;
+			case 'u': _username = optarg;         break;
+			case 'p': _password = optarg;         break;
+			case 'L': _latency = atoi(optarg);    break;
+			case 'B': _bandwidth = atol(optarg);  break;
+			case 'v': _verbose ++;                break;
+			case 'h': usage(); exit(0);
+			default:  usage(); exit(1);
+		}
+	}
+
+	listener = path ? listen_unix(path) : listen_tcp(port);
+	if (listener < 0) {
+		fprintf(stderr, "Unable to listen on %s: %s\n", path ? path : "tcp port", strerror(errno));
+		exit(1);
+	}
+
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (_shutdown == 0) {
+
+		now = now_usec();
+		next = -1;
+
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+		for (i=0; i<client_count; i++) {
+			wait = client_pending(clients[i], now);
+			if (wait >= 0 && (next < 0 || wait < next)) { next = wait; }
+
+			fds[i+1].fd = clients[i]->handle;
+			fds[i+1].events = POLLIN;
+			if (BUF_LENGTH(clients[i]->out) > 0) {
+				if (client_allowance(clients[i], now) > 0) { fds[i+1].events |= POLLOUT; }
+				else if (next < 0 || next > 1000) { next = 1000; }
+			}
+		}
+		nfds = client_count + 1;
+
+		if (next >= 0) {
+			ts.tv_sec = next / 1000000;
+			ts.tv_nsec = (next % 1000000) * 1000;
+		}
+		if (ppoll(fds, nfds, next >= 0 ? &ts : NULL, NULL) < 0) {
+			if (errno == EINTR) { continue; }
+			break;
+		}
+
+		now = now_usec();
+
+		for (i=client_count-1; i>=0; i--) {
+			client_t *client = clients[i];
+			int lost = 0;
+
+			if (fds[i+1].revents & (POLLIN | POLLHUP | POLLERR)) {
+				len = recv(client->handle, buffer, sizeof(buffer), 0);
+				if (len <= 0) { lost = 1; }
+				else {
+					expbuf_add(client->in, buffer, len);
+					process_input(client);
+					client_pending(client, now);
+				}
+			}
+
+			if (lost == 0 && BUF_LENGTH(client->out) > 0 && (allowed = client_allowance(client, now)) > 0) {
+				len = send(client->handle, BUF_DATA(client->out), allowed, MSG_DONTWAIT);
+				if (len > 0) {
+					expbuf_purge(client->out, len);
+					if (_bandwidth > 0) { client->bw_credit -= len; }
+				}
+				else if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) { lost = 1; }
+			}
+
+			if (lost) {
+				client_free(client);
+				for (j=i; j<client_count-1; j++) { clients[j] = clients[j+1]; }
+				client_count --;
+			}
+		}
+
+		if (fds[0].revents & POLLIN) {
+			handle = accept(listener, NULL, NULL);
+			if (handle >= 0) {
+				if (client_count == MAX_CLIENTS) { close(handle); }
+				else {
+					if (path == NULL) {
+						c = 1;
+						setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, &c, sizeof(c));
+					}
+					clients[client_count] = calloc(1, sizeof(client_t));
+					assert(clients[client_count]);
+					clients[client_count]->handle = handle;
+					clients[client_count]->in = expbuf_init(NULL, 1024);
+					clients[client_count]->out = expbuf_init(NULL, 1024);
+					clients[client_count]->bw_last = now;
+					client_count ++;
+				}
+			}
+		}
+	}
+
+	for (i=0; i<client_count; i++) { client_free(clients[i]); }
+	close(listener);
+	if (path) { unlink(path); }
+
+	return(0);
+}
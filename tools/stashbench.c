@@ -0,0 +1,543 @@
+//-----------------------------------------------------------------------------
+// stashbench
+// Drives a stash server (normally tools/stash-standin) through the library
+// with a fixed workload, and reports the throughput and latency distribution
+// seen by the client.  It is used to compare libstash versions against each
+// other, so everything it measures goes through the public interface.
+//
+// Workloads:
+//    lookup   fetch one row by name, using __cond_name().
+//    insert   create a new row with stash_create_row().
+//    sorted   range query on one key, sorted on two keys.
+//    scan     read every row in the table.
+//
+// Each thread has its own stash_t handle, with its own connection to the
+// server.
+
+#include <stash.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define WL_LOOKUP   (0)
+#define WL_INSERT   (1)
+#define WL_SORTED   (2)
+#define WL_SCAN     (3)
+#define WL_COUNT    (4)
+
+static const char *_wl_names[WL_COUNT] = { "lookup", "insert", "sorted", "scan" };
+
+
+//-----------------------------------------------------------------------------
+// Latency histogram, in nanoseconds.  Values below 16 get a bucket each, above
+// that there are 16 buckets for each power of two, so the error is under 7%.
+// Unlike the one in the library, it never decays, because we want the
+// distribution over the whole run.
+
+#define HIST_SUB      (16)
+#define HIST_BUCKETS  (HIST_SUB + (60 * HIST_SUB))
+
+typedef struct {
+	unsigned long long counts[HIST_BUCKETS];
+	unsigned long long total;
+	long long max;
+} hist_t;
+
+
+static int hist_bucket(long long nsec)
+{
+	int msb;
+	int idx;
+
+	if (nsec < HIST_SUB) { return(nsec < 0 ? 0 : nsec); }
+
+	msb = 63 - __builtin_clzll(nsec);
+	assert(msb >= 4);
+	idx = HIST_SUB + ((msb - 4) * HIST_SUB) + ((nsec >> (msb - 4)) & (HIST_SUB - 1));
+	return(idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1);
+}
+
+// the highest value that would go in the bucket.
+static long long hist_value(int idx)
+{
+	int msb, sub;
+
+	assert(idx >= 0 && idx < HIST_BUCKETS);
+	if (idx < HIST_SUB) { return(idx); }
+
+	msb = ((idx - HIST_SUB) / HIST_SUB) + 4;
+	sub = (idx - HIST_SUB) % HIST_SUB;
+	return((((long long)(HIST_SUB + sub + 1)) << (msb - 4)) - 1);
+}
+
+static void hist_record(hist_t *hist, long long nsec)
+{
+	assert(hist);
+	hist->counts[hist_bucket(nsec)] ++;
+	hist->total ++;
+	if (nsec > hist->max) { hist->max = nsec; }
+}
+
+static void hist_merge(hist_t *into, const hist_t *from)
+{
+	int i;
+
+	assert(into && from);
+	for (i=0; i<HIST_BUCKETS; i++) {
+		into->counts[i] += from->counts[i];
+	}
+	into->total += from->total;
+	if (from->max > into->max) { into->max = from->max; }
+}
+
+// return the value at the fraction (0 to 1) of the distribution.  The top
+// bucket is capped to the largest value actually seen.
+static long long hist_quantile(const hist_t *hist, double q)
+{
+	unsigned long long target, count;
+	long long value;
+	int i;
+
+	assert(hist);
+	assert(q >= 0 && q <= 1);
+
+	target = (unsigned long long) (hist->total * q);
+	if (target == 0) { target = 1; }
+	count = 0;
+	for (i=0; i<HIST_BUCKETS; i++) {
+		count += hist->counts[i];
+		if (count >= target && count > 0) {
+			value = hist_value(i);
+			return(value < hist->max ? value : hist->max);
+		}
+	}
+
+	return(0);
+}
+
+
+//-----------------------------------------------------------------------------
+// settings and shared state.
+
+static const char *_host = "127.0.0.1";
+static const char *_username = "bench";
+static const char *_password = "bench";
+static const char *_namespace = "bench";
+static const char *_tablename = "bench";
+static int _threads = 1;
+static double _duration = 10;
+static long _ops = 0;				// per thread; if set, overrides the duration.
+static int _rows = 10000;
+static int _width = 32;				// bytes in the 'data' attribute.
+static int _span = 50;				// range of ages covered by a sorted query.
+static int _limit = 100;			// limit on a sorted query, 0 to sort client-side.
+static int _json = 0;
+
+static stash_tableid_t _tid = 0;
+static stash_keyid_t _k_age = 0, _k_score = 0, _k_nick = 0, _k_data = 0;
+static char *_data = NULL;
+static long _nonce = 0;
+
+static volatile int _stop = 0;
+static pthread_barrier_t _barrier;
+
+
+typedef struct {
+	int id;
+	int workload;
+	stash_t *stash;
+	unsigned int seed;
+	long ops;
+	long errors;
+	long long rows;
+	hist_t hist;
+	pthread_t thread;
+} worker_t;
+
+
+static long long now_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(((long long) ts.tv_sec * 1000000000LL) + ts.tv_nsec);
+}
+
+
+static stash_t * bench_connect(void)
+{
+	stash_t *stash;
+	stash_result_t res;
+
+	stash = stash_init(NULL);
+	assert(stash);
+	stash_authority(stash, _username, _password);
+	stash_addserver(stash, _host, 10);
+
+	res = stash_connect(stash);
+	if (res == STASH_ERR_OK) { res = stash_set_namespace(stash, _namespace); }
+	if (res != STASH_ERR_OK) {
+		fprintf(stderr, "Unable to connect to %s: %s\n", _host, stash_err_text(res));
+		exit(1);
+	}
+
+	return(stash);
+}
+
+
+static stash_reply_t * create_row(stash_t *stash, const char *name, int age, int score)
+{
+	stash_attrlist_t *alist;
+	stash_reply_t *reply;
+	char nick[32];
+
+	assert(stash && name);
+
+	sprintf(nick, "n%08d", score);
+	alist = stash_init_alist(stash);
+	stash_set_attr(alist, _k_age, __value_int(age), 0);
+	stash_set_attr(alist, _k_score, __value_int(score), 0);
+	stash_set_attr(alist, _k_nick, __value_str(nick), 0);
+	stash_set_attr(alist, _k_data, __value_str(_data), 0);
+	reply = stash_create_row(stash, _tid, 0, name, alist, 0);
+	stash_free_alist(stash, alist);
+
+	return(reply);
+}
+
+
+// find (or create and fill) the table that the workloads run against.  If the
+// table already exists, it is assumed to have been filled by an earlier run.
+static void setup(void)
+{
+	stash_t *stash;
+	stash_reply_t *reply;
+	stash_result_t res;
+	char name[32];
+	int i;
+
+	stash = bench_connect();
+
+	res = stash_get_table_id(stash, _tablename, &_tid);
+	if (res == STASH_ERR_TABLENOTEXIST) {
+		res = stash_create_table(stash, _tablename, STASH_TABOPT_UNIQUE, &_tid);
+		if (res != STASH_ERR_OK) {
+			fprintf(stderr, "Unable to create table '%s': %s\n", _tablename, stash_err_text(res));
+			exit(1);
+		}
+
+		_k_age = stash_get_key_id(stash, _tid, "age");
+		_k_score = stash_get_key_id(stash, _tid, "score");
+		_k_nick = stash_get_key_id(stash, _tid, "nick");
+		_k_data = stash_get_key_id(stash, _tid, "data");
+
+		for (i=0; i<_rows; i++) {
+			sprintf(name, "row%d", i);
+			reply = create_row(stash, name, i % 1000, i);
+			if (reply->resultcode != STASH_ERR_OK) {
+				fprintf(stderr, "Unable to create row '%s': %s\n", name, stash_err_text(reply->resultcode));
+				exit(1);
+			}
+			stash_return_reply(reply);
+		}
+	}
+	else if (res != STASH_ERR_OK) {
+		fprintf(stderr, "Unable to find table '%s': %s\n", _tablename, stash_err_text(res));
+		exit(1);
+	}
+	else {
+		_k_age = stash_get_key_id(stash, _tid, "age");
+		_k_score = stash_get_key_id(stash, _tid, "score");
+		_k_nick = stash_get_key_id(stash, _tid, "nick");
+		_k_data = stash_get_key_id(stash, _tid, "data");
+	}
+
+	assert(_tid > 0);
+	assert(_k_age > 0 && _k_score > 0 && _k_nick > 0 && _k_data > 0);
+
+	stash_free(stash);
+}
+
+
+// perform one operation, returning the number of rows it got back, or -1 if it
+// failed.
+static int run_op(worker_t *worker)
+{
+	stash_reply_t *reply;
+	stash_query_t *query;
+	char name[64];
+	int age, rows = 0;
+
+	assert(worker);
+
+	switch (worker->workload) {
+		case WL_LOOKUP:
+			sprintf(name, "row%d", rand_r(&worker->seed) % _rows);
+			reply = stash_query(worker->stash, _tid, 0, __cond_name(0, name));
+			break;
+
+		case WL_INSERT:
+			sprintf(name, "i%lx-%d-%ld", _nonce, worker->id, worker->ops);
+			reply = create_row(worker->stash, name, rand_r(&worker->seed) % 1000, worker->ops);
+			break;
+
+		case WL_SORTED:
+			age = rand_r(&worker->seed) % (1000 - _span);
+			query = stash_query_new(_tid);
+			stash_query_condition(query, __cond_key_between(_k_age, __value_int(age), __value_int(age + _span)));
+			stash_query_sort(query, _k_age, 1);
+			stash_query_sort(query, _k_nick, 0);
+			stash_query_select(query, _k_nick);
+			stash_query_limit(query, _limit);
+			reply = stash_query_execute(worker->stash, query);
+			stash_query_free(query);
+			break;
+
+		case WL_SCAN:
+			reply = stash_query(worker->stash, _tid, 0, NULL);
+			break;
+
+		default:
+			assert(0);
+			return(-1);
+	}
+
+	assert(reply);
+	if (reply->resultcode != STASH_ERR_OK) {
+		stash_return_reply(reply);
+		return(-1);
+	}
+
+	// touch every row, the way an application would.
+	while (stash_nextrow(reply)) {
+		if (worker->workload == WL_SCAN) {
+			stash_getint(reply, _k_age);
+			stash_getstr(reply, _k_data);
+		}
+		else if (worker->workload == WL_SORTED) {
+			stash_getstr(reply, _k_nick);
+		}
+		rows ++;
+	}
+
+	stash_return_reply(reply);
+	return(rows);
+}
+
+
+static void * worker_main(void *arg)
+{
+	worker_t *worker = arg;
+	long long start;
+	int rows;
+
+	assert(worker);
+
+	pthread_barrier_wait(&_barrier);
+
+	while (_stop == 0 && (_ops == 0 || worker->ops < _ops)) {
+		start = now_nsec();
+		rows = run_op(worker);
+		hist_record(&worker->hist, now_nsec() - start);
+
+		worker->ops ++;
+		if (rows < 0) { worker->errors ++; }
+		else { worker->rows += rows; }
+	}
+
+	return(NULL);
+}
+
+
+static void report(int workload, worker_t *workers, double elapsed, int first)
+{
+	hist_t *hist;
+	long ops = 0, errors = 0;
+	long long rows = 0;
+	int i;
+
+	assert(workers && elapsed > 0);
+
+	hist = calloc(1, sizeof(*hist));
+	assert(hist);
+	for (i=0; i<_threads; i++) {
+		hist_merge(hist, &workers[i].hist);
+		ops += workers[i].ops;
+		errors += workers[i].errors;
+		rows += workers[i].rows;
+	}
+
+	if (_json) {
+		printf("%s  {\"workload\": \"%s\", \"threads\": %d, \"seconds\": %.3f, "
+			"\"ops\": %ld, \"errors\": %ld, \"rows\": %lld, \"ops_per_sec\": %.1f, \"rows_per_sec\": %.1f, "
+			"\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f}}",
+			first ? "" : ",\n",
+			_wl_names[workload], _threads, elapsed,
+			ops, errors, rows, ops / elapsed, rows / elapsed,
+			hist_quantile(hist, 0.50) / 1000.0, hist_quantile(hist, 0.99) / 1000.0,
+			hist_quantile(hist, 0.999) / 1000.0, hist->max / 1000.0);
+	}
+	else {
+		printf("%-8s %3d thr %8.2fs %10ld ops %6ld err %12.1f ops/s %12.1f rows/s   "
+			"p50 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f us\n",
+			_wl_names[workload], _threads, elapsed,
+			ops, errors, ops / elapsed, rows / elapsed,
+			hist_quantile(hist, 0.50) / 1000.0, hist_quantile(hist, 0.99) / 1000.0,
+			hist_quantile(hist, 0.999) / 1000.0, hist->max / 1000.0);
+	}
+
+	free(hist);
+}
+
+
+static void run_workload(int workload, int first)
+{
+	worker_t *workers;
+	long long start;
+	double elapsed;
+	struct timespec ts;
+	int i;
+
+	assert(workload >= 0 && workload < WL_COUNT);
+
+	workers = calloc(_threads, sizeof(worker_t));
+	assert(workers);
+
+	_stop = 0;
+	pthread_barrier_init(&_barrier, NULL, _threads + 1);
+	for (i=0; i<_threads; i++) {
+		workers[i].id = i;
+		workers[i].workload = workload;
+		workers[i].seed = 1 + i;
+		workers[i].stash = bench_connect();
+		pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+	}
+
+	pthread_barrier_wait(&_barrier);
+	start = now_nsec();
+
+	if (_ops == 0) {
+		ts.tv_sec = (time_t) _duration;
+		ts.tv_nsec = (long) ((_duration - ts.tv_sec) * 1000000000);
+		while (nanosleep(&ts, &ts) != 0) {}
+		_stop = 1;
+	}
+
+	for (i=0; i<_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	elapsed = (now_nsec() - start) / 1000000000.0;
+
+	report(workload, workers, elapsed, first);
+
+	for (i=0; i<_threads; i++) {
+		stash_free(workers[i].stash);
+	}
+	pthread_barrier_destroy(&_barrier);
+	free(workers);
+}
+
+
+static void usage(void)
+{
+	printf(
+		"Usage: stashbench [options]\n"
+		"  -H <host>      server to connect to, or a unix socket path (default %s)\n"
+		"  -u <username>  username (default %s)\n"
+		"  -p <password>  password (default %s)\n"
+		"  -N <namespace> namespace (default %s)\n"
+		"  -T <table>     table (default %s)\n"
+		"  -w <list>      comma separated workloads: lookup,insert,sorted,scan or all (default lookup)\n"
+		"  -t <threads>   number of threads, each with its own handle (default 1)\n"
+		"  -d <seconds>   how long to run each workload (default 10)\n"
+		"  -o <ops>       run this many operations per thread instead\n"
+		"  -n <rows>      rows to create when the table is new (default %d)\n"
+		"  -W <bytes>     size of the 'data' attribute (default %d)\n"
+		"  -l <limit>     limit on sorted queries, 0 to sort on the client (one thread only, default %d)\n"
+		"  -j             output JSON\n"
+		"  -h             this help\n",
+		_host, _username, _password, _namespace, _tablename, _rows, _width, _limit);
+}
+
+
+int main(int argc, char **argv)
+{
+	int c, i, first;
+	int selected[WL_COUNT];
+	char *list = "lookup", *copy, *token, *saveptr;
+
+	while ((c = getopt(argc, argv, "H:u:p:N:T:w:t:d:o:n:W:l:jh")) != -1) {
+		switch (c) {
+			case 'H': _host = optarg;               break;
+			case 'u': _username = optarg;           break;
+			case 'p': _password = optarg;           break;
+			case 'N': _namespace = optarg;          break;
+			case 'T': _tablename = optarg;          break;
+			case 'w': list = optarg;                break;
+			case 't': _threads = atoi(optarg);      break;
+			case 'd': _duration = atof(optarg);     break;
+			case 'o': _ops = atol(optarg);          break;
+			case 'n': _rows = atoi(optarg);         break;
+			case 'W': _width = atoi(optarg);        break;
+			case 'l': _limit = atoi(optarg);        break;
+			case 'j': _json = 1;                    break;
+			case 'h': usage(); exit(0);
+			default:  usage(); exit(1);
+		}
+	}
+
+	if (_threads < 1 || _rows < 1 || _width < 0 || _limit < 0 || (_ops == 0 && _duration <= 0)) {
+		usage();
+		exit(1);
+	}
+
+	memset(selected, 0, sizeof(selected));
+	copy = strdup(list);
+	assert(copy);
+	for (token = strtok_r(copy, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+		if (strcmp(token, "all") == 0) {
+			for (i=0; i<WL_COUNT; i++) { selected[i] = 1; }
+			continue;
+		}
+		for (i=0; i<WL_COUNT && strcmp(token, _wl_names[i]) != 0; i++) {}
+		if (i == WL_COUNT) {
+			fprintf(stderr, "Unknown workload '%s'\n", token);
+			exit(1);
+		}
+		selected[i] = 1;
+	}
+	free(copy);
+
+	// sorting on the client uses library state that is shared by every handle, 
+	// so it can only be done from one thread at a time.
+	if (selected[WL_SORTED] && _limit == 0 && _threads > 1) {
+		fprintf(stderr, "The sorted workload can only sort on the client (-l 0) with a single thread.\n");
+		exit(1);
+	}
+
+	_data = malloc(_width + 1);
+	assert(_data);
+	memset(_data, 'x', _width);
+	_data[_width] = '\0';
+	_nonce = (long) time(NULL);
+
+	setup();
+
+	if (_json) { printf("[\n"); }
+	first = 1;
+	for (i=0; i<WL_COUNT; i++) {
+		if (selected[i]) {
+			run_workload(i, first);
+			first = 0;
+		}
+	}
+	if (_json) { printf("\n]\n"); }
+
+	free(_data);
+	return(0);
+}